@@ -0,0 +1,319 @@
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+/* I/O driver for bench-fuse.sh. Runs one workload against the given
+   paths and prints the result as a single line of json, so the same
+   workload can be compared between the fuse mount and the backing
+   files. */
+
+static char *opt_label = NULL;
+static gint64 opt_size = 64 * 1024 * 1024;
+static gint opt_block_size = 64 * 1024;
+static gint opt_ops = 10000;
+
+static GOptionEntry entries[] = {
+  { "label", 0, 0, G_OPTION_ARG_STRING, &opt_label, "Label to put in the output", "LABEL" },
+  { "size", 0, 0, G_OPTION_ARG_INT64, &opt_size, "File size for sequential workloads", "BYTES" },
+  { "block-size", 0, 0, G_OPTION_ARG_INT, &opt_block_size, "Size of each read or write", "BYTES" },
+  { "ops", 0, 0, G_OPTION_ARG_INT, &opt_ops, "Number of ops for random and metadata workloads", "N" },
+  { NULL }
+};
+
+typedef struct {
+  guint64 ops;
+  guint64 bytes;
+} BenchResult;
+
+typedef gboolean (*BenchFunc) (char **paths,
+                               char *buf,
+                               GRand *rand,
+                               BenchResult *result);
+
+static gboolean
+fail (const char *what, const char *path)
+{
+  g_printerr ("%s %s: %s\n", what, path, g_strerror (errno));
+  return FALSE;
+}
+
+static gboolean
+bench_seq_write (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  gint64 written = 0;
+  int fd;
+
+  fd = open (paths[0], O_WRONLY | O_TRUNC);
+  if (fd < 0)
+    return fail ("open", paths[0]);
+
+  while (written < opt_size)
+    {
+      ssize_t res = write (fd, buf, MIN (opt_block_size, opt_size - written));
+      if (res < 0)
+        {
+          close (fd);
+          return fail ("write", paths[0]);
+        }
+      written += res;
+      result->ops++;
+    }
+
+  if (fsync (fd) != 0 || close (fd) != 0)
+    return fail ("close", paths[0]);
+
+  result->bytes = written;
+  return TRUE;
+}
+
+static gboolean
+bench_seq_read (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  ssize_t res;
+  int fd;
+
+  fd = open (paths[0], O_RDONLY);
+  if (fd < 0)
+    return fail ("open", paths[0]);
+
+  while ((res = read (fd, buf, opt_block_size)) > 0)
+    {
+      result->bytes += res;
+      result->ops++;
+    }
+
+  close (fd);
+
+  if (res < 0)
+    return fail ("read", paths[0]);
+
+  return TRUE;
+}
+
+static gboolean
+bench_random (char **paths, char *buf, GRand *rand, BenchResult *result,
+              gboolean do_write)
+{
+  struct stat st_buf;
+  gint64 n_blocks;
+  int fd, i;
+
+  fd = open (paths[0], do_write ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return fail ("open", paths[0]);
+
+  if (fstat (fd, &st_buf) != 0)
+    {
+      close (fd);
+      return fail ("stat", paths[0]);
+    }
+
+  n_blocks = MAX (st_buf.st_size / opt_block_size, 1);
+
+  for (i = 0; i < opt_ops; i++)
+    {
+      off_t offset = g_rand_int_range (rand, 0, n_blocks) * (off_t)opt_block_size;
+      ssize_t res;
+
+      if (do_write)
+        res = pwrite (fd, buf, opt_block_size, offset);
+      else
+        res = pread (fd, buf, opt_block_size, offset);
+
+      if (res < 0)
+        {
+          close (fd);
+          return fail (do_write ? "pwrite" : "pread", paths[0]);
+        }
+
+      result->bytes += res;
+      result->ops++;
+    }
+
+  if (close (fd) != 0)
+    return fail ("close", paths[0]);
+
+  return TRUE;
+}
+
+static gboolean
+bench_rand_read (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  return bench_random (paths, buf, rand, result, FALSE);
+}
+
+static gboolean
+bench_rand_write (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  return bench_random (paths, buf, rand, result, TRUE);
+}
+
+/* Truncating overwrite of small files, which goes through the atomic
+   replace path in the portal */
+static gboolean
+bench_rewrite (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  guint n_paths = g_strv_length (paths);
+  int i;
+
+  for (i = 0; i < opt_ops; i++)
+    {
+      const char *path = paths[i % n_paths];
+      int fd;
+
+      fd = open (path, O_WRONLY | O_TRUNC);
+      if (fd < 0)
+        return fail ("open", path);
+
+      if (write (fd, buf, opt_block_size) < 0)
+        {
+          close (fd);
+          return fail ("write", path);
+        }
+
+      if (close (fd) != 0)
+        return fail ("close", path);
+
+      result->bytes += opt_block_size;
+      result->ops++;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+bench_stat (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  guint n_paths = g_strv_length (paths);
+  struct stat st_buf;
+  int i;
+
+  for (i = 0; i < opt_ops; i++)
+    {
+      const char *path = paths[i % n_paths];
+
+      if (stat (path, &st_buf) != 0)
+        return fail ("stat", path);
+
+      result->ops++;
+    }
+
+  return TRUE;
+}
+
+/* Like ls -l: list each directory and stat every entry */
+static gboolean
+bench_ls (char **paths, char *buf, GRand *rand, BenchResult *result)
+{
+  guint n_paths = g_strv_length (paths);
+  int i;
+
+  for (i = 0; i < opt_ops; i++)
+    {
+      const char *path = paths[i % n_paths];
+      struct dirent *dent;
+      struct stat st_buf;
+      DIR *dir;
+
+      dir = opendir (path);
+      if (dir == NULL)
+        return fail ("opendir", path);
+
+      while ((dent = readdir (dir)) != NULL)
+        {
+          if (fstatat (dirfd (dir), dent->d_name, &st_buf, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+              closedir (dir);
+              return fail ("stat", dent->d_name);
+            }
+          result->ops++;
+        }
+
+      closedir (dir);
+    }
+
+  return TRUE;
+}
+
+static struct {
+  const char *name;
+  BenchFunc func;
+} workloads[] = {
+  { "seq-write", bench_seq_write },
+  { "seq-read", bench_seq_read },
+  { "rand-read", bench_rand_read },
+  { "rand-write", bench_rand_write },
+  { "rewrite", bench_rewrite },
+  { "stat", bench_stat },
+  { "ls", bench_ls },
+};
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GRand) rand = NULL;
+  g_autofree char *buf = NULL;
+  BenchResult result = { 0 };
+  GOptionContext *context;
+  BenchFunc func = NULL;
+  gint64 start, usec;
+  int i;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("WORKLOAD PATH... - run a benchmark workload");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (argc < 3 || opt_block_size <= 0 || opt_ops <= 0)
+    {
+      g_printerr ("Usage: bench-fuse-io [OPTIONS] WORKLOAD PATH...\n");
+      return 1;
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (workloads); i++)
+    {
+      if (strcmp (argv[1], workloads[i].name) == 0)
+        func = workloads[i].func;
+    }
+
+  if (func == NULL)
+    {
+      g_printerr ("Unknown workload %s\n", argv[1]);
+      return 1;
+    }
+
+  buf = g_malloc (opt_block_size);
+  memset (buf, 'x', opt_block_size);
+  rand = g_rand_new_with_seed (4711);
+
+  start = g_get_monotonic_time ();
+  if (!func (argv + 2, buf, rand, &result))
+    return 1;
+  usec = MAX (g_get_monotonic_time () - start, 1);
+
+  g_print ("{\"label\": \"%s\", \"workload\": \"%s\", "
+           "\"ops\": %" G_GUINT64_FORMAT ", \"bytes\": %" G_GUINT64_FORMAT ", "
+           "\"usec\": %" G_GINT64_FORMAT ", \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f}\n",
+           opt_label ? opt_label : "", argv[1],
+           result.ops, result.bytes, usec,
+           result.ops * (double)G_USEC_PER_SEC / usec,
+           result.bytes / (1024.0 * 1024.0) * G_USEC_PER_SEC / usec);
+
+  return 0;
+}
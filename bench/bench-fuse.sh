@@ -0,0 +1,120 @@
+#!/bin/sh
+# Runs the data-path benchmarks against a private instance of the
+# portal, and against the backing files directly for comparison.
+# Output is one json object per line on stdout.
+#
+# Usage: bench-fuse.sh [BUILDDIR]
+#
+# Knobs (environment): BENCH_SIZE, BENCH_OPS, BENCH_FILES
+
+set -e
+
+builddir=${1:-.}
+size=${BENCH_SIZE:-67108864}
+ops=${BENCH_OPS:-10000}
+n_files=${BENCH_FILES:-100}
+
+portal=$builddir/xdg-document-portal
+xdp=$builddir/xdp
+io=$builddir/bench-fuse-io
+
+for prog in $portal $xdp $io; do
+    if ! test -x $prog; then
+        echo "$prog not built" >&2
+        exit 1
+    fi
+done
+
+tmpdir=`mktemp -d ${TMPDIR:-/tmp}/xdp-bench.XXXXXX`
+portal_pid=
+dbus_pid=
+
+cleanup () {
+    if test -n "$portal_pid"; then
+        kill $portal_pid 2>/dev/null || true
+        wait $portal_pid 2>/dev/null || true
+    fi
+    if mountpoint -q $tmpdir/runtime/doc 2>/dev/null; then
+        fusermount -u $tmpdir/runtime/doc || true
+    fi
+    if test -n "$dbus_pid"; then
+        kill $dbus_pid 2>/dev/null || true
+    fi
+    rm -rf $tmpdir
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p $tmpdir/data $tmpdir/runtime $tmpdir/backing
+chmod 700 $tmpdir/runtime
+
+export XDG_DATA_HOME=$tmpdir/data
+export XDG_RUNTIME_DIR=$tmpdir/runtime
+
+dbus-daemon --session --fork --nopidfile \
+    --print-address=3 --print-pid=4 \
+    3>$tmpdir/dbus-address 4>$tmpdir/dbus-pid
+DBUS_SESSION_BUS_ADDRESS=`cat $tmpdir/dbus-address`
+export DBUS_SESSION_BUS_ADDRESS
+dbus_pid=`cat $tmpdir/dbus-pid`
+
+$portal &
+portal_pid=$!
+
+i=0
+while ! mountpoint -q $XDG_RUNTIME_DIR/doc 2>/dev/null; do
+    i=$((i + 1))
+    if test $i -gt 100; then
+        echo "portal did not mount $XDG_RUNTIME_DIR/doc" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# Export a document for the given backing file and print its path
+# inside the mount
+add_doc () {
+    doc_id=`$xdp add-local $1 | sed -n 's/^document id: //p'`
+    echo $XDG_RUNTIME_DIR/doc/$doc_id/`basename $1`
+}
+
+head -c $size /dev/zero > $tmpdir/backing/large
+large_fuse=`add_doc $tmpdir/backing/large`
+
+small_backing=
+small_fuse=
+small_dirs_fuse=
+i=0
+while test $i -lt $n_files; do
+    head -c 4096 /dev/zero > $tmpdir/backing/small-$i
+    path=`add_doc $tmpdir/backing/small-$i`
+    small_backing="$small_backing $tmpdir/backing/small-$i"
+    small_fuse="$small_fuse $path"
+    small_dirs_fuse="$small_dirs_fuse `dirname $path`"
+    i=$((i + 1))
+done
+
+run () {
+    label=$1
+    shift
+    $io --label=$label --size=$size --ops=$ops "$@"
+}
+
+for target in backing fuse; do
+    if test $target = fuse; then
+        large=$large_fuse
+        small=$small_fuse
+        dirs="$XDG_RUNTIME_DIR/doc $small_dirs_fuse"
+    else
+        large=$tmpdir/backing/large
+        small=$small_backing
+        dirs=$tmpdir/backing
+    fi
+
+    run $target seq-write $large
+    run $target seq-read $large
+    run $target --block-size=4096 rand-read $large
+    run $target --block-size=4096 rand-write $large
+    run $target --block-size=4096 rewrite $small
+    run $target stat $small
+    run $target --ops=100 ls $dirs
+done
@@ -0,0 +1,878 @@
+#include "config.h"
+
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gvdb/gvdb-reader.h"
+#include "gvdb/gvdb-builder.h"
+#include "xdp-doc-db.h"
+
+/* Lookup latency of gvdb tables shaped like the tables of the
+   document db, for keys that are there (hits) and keys that are not
+   (misses). The docs table is run with and without a bloom filter,
+   and with string or integer keys. The uris table is run with each
+   key hash, on a generated corpus or on one read from a file (one
+   uri per line, e.g. from find ~ | sed s,^,file://,), and also
+   reports the bucket chain lengths of each hash. Doc records are
+   also written with the streaming writer with and without value
+   deduplication, both as stored by the portal and as bare permission
+   lists, reporting the file size and how much of the file is in the
+   page cache after reading every value from a cold cache, and with
+   and without the cache friendly layout, reporting the page faults
+   per lookup from a cold cache. Finally the path, basename and
+   dirname of docs in a real doc db are read through the cached doc
+   views and by decoding the uri each time, reporting the mallocs per
+   lookup. Prints one line of json per table and kind of lookup. */
+
+static gint opt_keys = 10000;
+static gint opt_lookups = 1000000;
+static gdouble opt_fp_rate = 0.01;
+static char *opt_corpus = NULL;
+
+static GOptionEntry entries[] = {
+  { "keys", 0, 0, G_OPTION_ARG_INT, &opt_keys, "Number of keys in the table", "N" },
+  { "lookups", 0, 0, G_OPTION_ARG_INT, &opt_lookups, "Number of lookups per run", "N" },
+  { "fp-rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_fp_rate, "Bloom filter false positive rate", "RATE" },
+  { "corpus", 0, 0, G_OPTION_ARG_FILENAME, &opt_corpus, "File with uris for the uris table", "FILE" },
+  { NULL }
+};
+
+#ifdef __GLIBC__
+/* Counts the mallocs of the process, by wrapping the glibc ones */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n_members, size_t size);
+extern void *__libc_realloc (void *mem, size_t size);
+
+static guint64 n_allocs = 0;
+
+void *
+malloc (size_t size)
+{
+  n_allocs++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+  n_allocs++;
+  return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *mem, size_t size)
+{
+  n_allocs++;
+  return __libc_realloc (mem, size);
+}
+#endif
+
+static GvdbTable *
+open_table (const char *filename,
+            const char *name,
+            goffset    *size)
+{
+  g_autoptr(GError) error = NULL;
+  GvdbTable *gvdb, *table;
+  struct stat st_buf;
+
+  gvdb = gvdb_table_new (filename, TRUE, &error);
+  if (gvdb == NULL)
+    g_error ("Can't read %s: %s", filename, error->message);
+
+  table = gvdb_table_get_table (gvdb, name);
+  gvdb_table_free (gvdb);
+
+  *size = 0;
+  if (stat (filename, &st_buf) == 0)
+    *size = st_buf.st_size;
+
+  return table;
+}
+
+static GvdbTable *
+write_table (const char *filename,
+             guint32    *keys,
+             gboolean    uint_keys,
+             gdouble     fp_rate,
+             goffset    *size)
+{
+  g_autoptr(GError) error = NULL;
+  GvdbBuilderOptions options = { 0, };
+  GHashTable *root, *docs;
+  int i;
+
+  root = gvdb_hash_table_new (NULL, NULL);
+  docs = gvdb_hash_table_new (root, "docs");
+
+  for (i = 0; keys[i] != 0; i++)
+    {
+      GvdbItem *item;
+
+      if (uint_keys)
+        item = gvdb_hash_table_insert_uint (docs, keys[i]);
+      else
+        {
+          char id_num[9];
+
+          g_snprintf (id_num, sizeof id_num, "%x", keys[i]);
+          item = gvdb_hash_table_insert (docs, id_num);
+        }
+
+      gvdb_item_set_value (item, g_variant_new ("(s@a(su))",
+                                                "file:///home/user/Documents/some-file.txt",
+                                                g_variant_new_array (G_VARIANT_TYPE ("(su)"), NULL, 0)));
+    }
+
+  g_hash_table_unref (docs);
+
+  options.bloom_false_positive_rate = fp_rate;
+  if (!gvdb_table_write_contents_full (root, filename, &options, &error))
+    g_error ("Can't write %s: %s", filename, error->message);
+
+  g_hash_table_unref (root);
+
+  return open_table (filename, "docs", size);
+}
+
+static void
+run (GvdbTable  *table,
+     const char *label,
+     const char *kind,
+     goffset     size,
+     guint32    *keys,
+     gboolean    uint_keys)
+{
+  guint found = 0;
+  gint64 start, usec;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_lookups; i++)
+    {
+      guint32 key = keys[i % opt_keys];
+
+      if (uint_keys)
+        found += gvdb_table_has_value_uint (table, key);
+      else
+        {
+          /* Formatting the key is part of the cost, as in the doc db */
+          char id_num[9];
+
+          g_snprintf (id_num, sizeof id_num, "%x", key);
+          found += gvdb_table_has_value (table, id_num);
+        }
+    }
+  usec = MAX (g_get_monotonic_time () - start, 1);
+
+  g_print ("{\"table\": \"%s\", \"lookups\": \"%s\", \"keys\": %d, "
+           "\"file_size\": %" G_GOFFSET_FORMAT ", \"found\": %u, "
+           "\"ns_per_lookup\": %.1f}\n",
+           label, kind, opt_keys, size, found,
+           usec * 1000.0 / opt_lookups);
+}
+
+/* A home directory worth of uris, with the long shared prefixes
+   that real ones have */
+static GPtrArray *
+generate_uris (GRand *rand)
+{
+  static const char *dirs[] = {
+    "Documents", "Downloads", "Pictures", "Music", "Videos", "Desktop",
+    "src", ".local/share", "Documents/work/reports", "Pictures/2015/holiday",
+  };
+  static const char *words[] = {
+    "report", "invoice", "IMG", "notes", "draft", "final", "photo",
+    "track", "meeting", "budget", "thesis", "scan", "backup", "export",
+  };
+  static const char *exts[] = {
+    "pdf", "odt", "jpg", "png", "txt", "mp3", "ogg", "tar.gz", "csv",
+  };
+  GPtrArray *uris = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+  while (uris->len < opt_keys)
+    {
+      char *uri;
+
+      uri = g_strdup_printf ("file:///home/user/%s/%s-%u.%s",
+                             dirs[g_rand_int_range (rand, 0, G_N_ELEMENTS (dirs))],
+                             words[g_rand_int_range (rand, 0, G_N_ELEMENTS (words))],
+                             g_rand_int_range (rand, 0, 100000),
+                             exts[g_rand_int_range (rand, 0, G_N_ELEMENTS (exts))]);
+
+      if (g_hash_table_add (seen, uri))
+        g_ptr_array_add (uris, uri);
+      else
+        g_free (uri);
+    }
+
+  return uris;
+}
+
+static GPtrArray *
+read_uris (const char *filename)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *contents = NULL;
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  GPtrArray *uris = g_ptr_array_new_with_free_func (g_free);
+  char **lines;
+  int i;
+
+  if (!g_file_get_contents (filename, &contents, NULL, &error))
+    g_error ("Can't read %s: %s", filename, error->message);
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (*lines[i] != 0 && g_hash_table_add (seen, lines[i]))
+        g_ptr_array_add (uris, g_strdup (lines[i]));
+    }
+  g_strfreev (lines);
+
+  return uris;
+}
+
+/* Chain lengths as the builder lays them out: one bucket per key */
+static void
+print_chains (const char  *label,
+              GvdbHashType hash_type,
+              GPtrArray   *uris)
+{
+  g_autofree guint *chains = g_new0 (guint, uris->len);
+  guint empty = 0, max = 0;
+  guint64 probes = 0;
+  int i;
+
+  for (i = 0; i < uris->len; i++)
+    {
+      const char *uri = g_ptr_array_index (uris, i);
+
+      chains[gvdb_hash (hash_type, uri, strlen (uri)) % uris->len]++;
+    }
+
+  for (i = 0; i < uris->len; i++)
+    {
+      if (chains[i] == 0)
+        empty++;
+      max = MAX (max, chains[i]);
+      /* A hit on the n:th item in a chain looks at n items */
+      probes += (guint64)chains[i] * (chains[i] + 1) / 2;
+    }
+
+  g_print ("{\"table\": \"%s\", \"buckets\": %u, \"empty_buckets\": %u, "
+           "\"max_chain\": %u, \"avg_probes_per_hit\": %.3f}\n",
+           label, uris->len, empty, max, probes / (double)uris->len);
+}
+
+static void
+run_uris (const char  *label,
+          const char  *kind,
+          GvdbTable   *table,
+          goffset      size,
+          GPtrArray   *uris)
+{
+  guint found = 0;
+  gint64 start, usec;
+  int i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < opt_lookups; i++)
+    found += gvdb_table_has_value (table, g_ptr_array_index (uris, i % uris->len));
+  usec = MAX (g_get_monotonic_time () - start, 1);
+
+  g_print ("{\"table\": \"%s\", \"lookups\": \"%s\", \"keys\": %u, "
+           "\"file_size\": %" G_GOFFSET_FORMAT ", \"found\": %u, "
+           "\"ns_per_lookup\": %.1f, \"lookups_per_sec\": %.0f}\n",
+           label, kind, uris->len, size, found,
+           usec * 1000.0 / opt_lookups,
+           opt_lookups * (double)G_USEC_PER_SEC / usec);
+}
+
+static void
+bench_uris (const char *filename,
+            GRand      *rand)
+{
+  g_autoptr(GPtrArray) uris = NULL;
+  g_autoptr(GPtrArray) misses = NULL;
+  struct {
+    const char *label;
+    GvdbHashType hash_type;
+  } hashes[] = {
+    { "uris-djb", GVDB_HASH_DJB },
+    { "uris-xxh32", GVDB_HASH_XXH32 },
+  };
+  int i;
+
+  if (opt_corpus)
+    uris = read_uris (opt_corpus);
+  else
+    uris = generate_uris (rand);
+
+  if (uris->len == 0)
+    return;
+
+  /* Near misses, as for a file next to an exported one */
+  misses = g_ptr_array_new_with_free_func (g_free);
+  for (i = 0; i < uris->len; i++)
+    g_ptr_array_add (misses, g_strconcat (g_ptr_array_index (uris, i), "~", NULL));
+
+  for (i = 0; i < G_N_ELEMENTS (hashes); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      GvdbBuilderOptions options = { 0, };
+      GHashTable *root, *table_uris;
+      GvdbTable *table;
+      goffset size;
+      int j;
+
+      root = gvdb_hash_table_new (NULL, NULL);
+      table_uris = gvdb_hash_table_new (root, "uris");
+      for (j = 0; j < uris->len; j++)
+        {
+          GvdbItem *item = gvdb_hash_table_insert (table_uris, g_ptr_array_index (uris, j));
+          guint32 doc_id = j + 1;
+
+          gvdb_item_set_value (item, g_variant_new ("(@au)",
+                                                    g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+                                                                               &doc_id, 1, sizeof (guint32))));
+        }
+      g_hash_table_unref (table_uris);
+
+      options.hash_type = hashes[i].hash_type;
+      if (!gvdb_table_write_contents_full (root, filename, &options, &error))
+        g_error ("Can't write %s: %s", filename, error->message);
+      g_hash_table_unref (root);
+
+      table = open_table (filename, "uris", &size);
+
+      print_chains (hashes[i].label, hashes[i].hash_type, uris);
+      run_uris (hashes[i].label, "hit", table, size, uris);
+      run_uris (hashes[i].label, "miss", table, size, misses);
+
+      gvdb_table_free (table);
+      unlink (filename);
+    }
+}
+
+#define DEDUP_N_APPS 50
+
+/* One to three apps, out of a few, with read or read-write access,
+   like the grants of a real db */
+static GVariant *
+make_perms (guint32 doc_id)
+{
+  GVariantBuilder builder;
+  guint n_apps = 1 + doc_id % 3;
+  guint i;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(su)"));
+  for (i = 0; i < n_apps; i++)
+    {
+      char app_id[64];
+
+      g_snprintf (app_id, sizeof app_id, "org.example.App%u",
+                  (doc_id / 3 + i * 7) % DEDUP_N_APPS);
+      g_variant_builder_add (&builder, "(su)", app_id,
+                             (doc_id >> 4) % 2 ? 3 : 1);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+typedef struct {
+  guint32 *doc_ids;
+  gboolean perms_only;
+  int i;
+} DocIter;
+
+static void
+doc_iter_reset (gpointer user_data)
+{
+  DocIter *iter = user_data;
+
+  iter->i = 0;
+}
+
+static guint32
+doc_iter_tell (gpointer user_data)
+{
+  DocIter *iter = user_data;
+
+  return iter->i;
+}
+
+static void
+doc_iter_seek (gpointer user_data,
+               guint32  position)
+{
+  DocIter *iter = user_data;
+
+  iter->i = position;
+}
+
+static gboolean
+doc_iter_next (gpointer      user_data,
+                 const gchar **key,
+                 guint32      *uint_key,
+                 GVariant    **value)
+{
+  DocIter *iter = user_data;
+  guint32 doc_id = iter->doc_ids[iter->i];
+  char uri[128];
+
+  if (doc_id == 0)
+    return FALSE;
+
+  iter->i++;
+
+  *key = NULL;
+  *uint_key = doc_id;
+  if (value == NULL)
+    return TRUE;
+
+  if (iter->perms_only)
+    *value = g_variant_ref_sink (make_perms (doc_id));
+  else
+    {
+      g_snprintf (uri, sizeof uri, "file:///home/user/Documents/dir-%u/file-%x.txt",
+                  doc_id % 100, doc_id);
+      *value = g_variant_ref_sink (g_variant_new ("(s@a(su))", uri, make_perms (doc_id)));
+    }
+
+  return TRUE;
+}
+
+static const GvdbWriterIterFuncs doc_iter_funcs = {
+  doc_iter_reset,
+  doc_iter_next,
+  doc_iter_tell,
+  doc_iter_seek,
+};
+
+static void
+write_docs (const char         *filename,
+            GvdbBuilderOptions *options,
+            guint32            *doc_ids,
+            gboolean            perms_only,
+            GvdbBuilderStats   *stats)
+{
+  g_autoptr(GError) error = NULL;
+  DocIter iter = { doc_ids, perms_only, 0 };
+  GvdbWriter *writer;
+
+  writer = gvdb_writer_new (filename, options, &error);
+  if (writer == NULL ||
+      !gvdb_writer_add_table (writer, "docs", &doc_iter_funcs, &iter, &error) ||
+      !gvdb_writer_finish (writer, &error))
+    g_error ("Can't write %s: %s", filename, error->message);
+
+  if (stats)
+    gvdb_writer_get_stats (writer, stats);
+  gvdb_writer_free (writer);
+}
+
+/* Bytes of the file in the page cache after dropping it from the
+   cache and then reading every value of the table */
+static goffset
+get_scan_footprint (const char *filename,
+                    const char *name,
+                    guint32    *doc_ids)
+{
+  GvdbTable *table;
+  goffset size, resident = 0;
+  gsize page_size = sysconf (_SC_PAGESIZE);
+  gsize n_pages, i;
+  guchar *vec;
+  guint sum = 0;
+  void *map;
+  int fd;
+
+  fd = open (filename, O_RDONLY);
+  if (fd < 0)
+    g_error ("Can't open %s", filename);
+
+  /* The writer syncs the file, so all its pages are clean */
+  posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  table = open_table (filename, name, &size);
+  for (i = 0; doc_ids[i] != 0; i++)
+    {
+      const guchar *data;
+      gsize data_size, j;
+
+      data = gvdb_table_get_raw_data_uint (table, doc_ids[i], &data_size);
+      for (j = 0; data != NULL && j < data_size; j++)
+        sum += data[j];
+    }
+
+  n_pages = (size + page_size - 1) / page_size;
+  vec = g_malloc (n_pages);
+  map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map != MAP_FAILED && mincore (map, size, vec) == 0)
+    {
+      for (i = 0; i < n_pages; i++)
+        resident += (vec[i] & 1) * page_size;
+    }
+
+  if (map != MAP_FAILED)
+    munmap (map, size);
+  g_free (vec);
+  gvdb_table_free (table);
+  close (fd);
+
+  /* Keep the reads from being optimized away */
+  if (sum == 1)
+    g_printerr (" ");
+
+  return resident;
+}
+
+static void
+bench_dedup (const char *filename,
+             guint32    *doc_ids)
+{
+  struct {
+    const char *label;
+    gboolean perms_only;
+  } shapes[] = {
+    { "dedup-docs", FALSE },
+    { "dedup-perms", TRUE },
+  };
+  int i, dedup;
+
+  for (i = 0; i < G_N_ELEMENTS (shapes); i++)
+    {
+      for (dedup = 0; dedup < 2; dedup++)
+        {
+          GvdbBuilderOptions options = { 0, };
+          GvdbBuilderStats stats;
+          struct stat st_buf;
+          goffset resident;
+
+          options.hash_type = GVDB_HASH_XXH32;
+          options.dedup_values = dedup;
+          write_docs (filename, &options, doc_ids, shapes[i].perms_only, &stats);
+
+          if (stat (filename, &st_buf) != 0)
+            g_error ("Can't stat %s", filename);
+
+          resident = get_scan_footprint (filename, "docs", doc_ids);
+
+          g_print ("{\"table\": \"%s\", \"dedup\": %s, \"keys\": %d, "
+                   "\"file_size\": %" G_GOFFSET_FORMAT ", "
+                   "\"values\": %" G_GUINT64_FORMAT ", "
+                   "\"shared_values\": %" G_GUINT64_FORMAT ", "
+                   "\"bytes_saved\": %" G_GUINT64_FORMAT ", "
+                   "\"resident_after_scan\": %" G_GOFFSET_FORMAT "}\n",
+                   shapes[i].label, dedup ? "true" : "false", opt_keys,
+                   (goffset) st_buf.st_size, stats.n_values,
+                   stats.n_shared_values, stats.bytes_saved, resident);
+
+          unlink (filename);
+        }
+    }
+}
+
+/* Major page faults per lookup on a doc table that is not in the
+   page cache, as right after login. The file is mapped here with
+   MADV_RANDOM, so that each page touched is a fault of its own
+   rather than part of a readahead window. */
+static void
+bench_cold (const char *filename,
+            guint32    *doc_ids,
+            GRand      *rand)
+{
+  struct {
+    const char *label;
+    gboolean cache_friendly;
+  } layouts[] = {
+    { "cold-plain", FALSE },
+    { "cold-cache-friendly", TRUE },
+  };
+  guint n_lookups = MIN (opt_keys, 1000);
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (layouts); i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autoptr(GBytes) bytes = NULL;
+      GvdbBuilderOptions options = { 0, };
+      GvdbTable *gvdb, *table;
+      struct rusage before, after;
+      struct stat st_buf;
+      guint sum = 0;
+      void *map;
+      int fd;
+      guint j;
+
+      options.hash_type = GVDB_HASH_XXH32;
+      options.cache_friendly = layouts[i].cache_friendly;
+      write_docs (filename, &options, doc_ids, FALSE, NULL);
+
+      fd = open (filename, O_RDONLY);
+      if (fd < 0 || fstat (fd, &st_buf) != 0)
+        g_error ("Can't open %s", filename);
+
+      /* The writer syncs the file, so all its pages are clean */
+      posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+      map = mmap (NULL, st_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED)
+        g_error ("Can't map %s", filename);
+      madvise (map, st_buf.st_size, MADV_RANDOM);
+
+      getrusage (RUSAGE_SELF, &before);
+
+      bytes = g_bytes_new_static (map, st_buf.st_size);
+      gvdb = gvdb_table_new_from_bytes (bytes, TRUE, &error);
+      if (gvdb == NULL)
+        g_error ("Can't read %s: %s", filename, error->message);
+      table = gvdb_table_get_table (gvdb, "docs");
+      gvdb_table_free (gvdb);
+
+      for (j = 0; j < n_lookups; j++)
+        {
+          guint32 doc_id = doc_ids[g_rand_int_range (rand, 0, opt_keys)];
+          const guchar *data;
+          gsize size, k;
+
+          data = gvdb_table_get_raw_data_uint (table, doc_id, &size);
+          for (k = 0; data != NULL && k < size; k++)
+            sum += data[k];
+        }
+
+      getrusage (RUSAGE_SELF, &after);
+
+      g_print ("{\"table\": \"%s\", \"keys\": %d, "
+               "\"file_size\": %" G_GOFFSET_FORMAT ", \"lookups\": %u, "
+               "\"major_faults_per_lookup\": %.3f}\n",
+               layouts[i].label, opt_keys, (goffset) st_buf.st_size, n_lookups,
+               (after.ru_majflt - before.ru_majflt) / (double) n_lookups);
+
+      /* Keep the reads from being optimized away */
+      if (sum == 1)
+        g_printerr (" ");
+
+      gvdb_table_free (table);
+      munmap (map, st_buf.st_size);
+      close (fd);
+      unlink (filename);
+    }
+}
+
+#define DOC_PATHS_HOT_DOCS 100
+
+/* Mallocs per doc lookup that also gets the path, basename and
+   dirname, as most fuse ops do. "view" goes through the doc view and
+   the path cache, "decode" through a GFile for each lookup as before
+   the cache. "hot" cycles over a few docs, "all" over all of them,
+   which is more than the cache holds for the default number of keys. */
+static void
+bench_doc_paths (const char *dir)
+{
+#ifdef __GLIBC__
+  g_autoptr(GError) error = NULL;
+  g_autofree char *filename = g_build_filename (dir, "docs", NULL);
+  g_autofree guint32 *doc_ids = g_new0 (guint32, opt_keys);
+  XdpDocDb *db;
+  const char *name;
+  GDir *gdir;
+  int i, run;
+
+  db = xdp_doc_db_new (filename, &error);
+  if (db == NULL)
+    g_error ("Can't create db: %s", error->message);
+
+  xdp_doc_db_begin (db);
+  for (i = 0; i < opt_keys; i++)
+    {
+      char uri[128];
+
+      g_snprintf (uri, sizeof uri, "file:///home/user/Documents/dir-%u/file-%x.txt",
+                  i % 100, i);
+      doc_ids[i] = xdp_doc_db_create_doc (db, uri);
+    }
+  xdp_doc_db_commit (db);
+
+  /* So that the docs are read from the files, as after a restart */
+  if (!xdp_doc_db_save (db, &error))
+    g_error ("Can't save db: %s", error->message);
+
+  for (run = 0; run < 4; run++)
+    {
+      gboolean use_view = run < 2;
+      guint n_docs = run % 2 == 0 ? MIN (opt_keys, DOC_PATHS_HOT_DOCS) : opt_keys;
+      guint64 allocs;
+      gint64 start, usec;
+      gsize sum = 0;
+
+      allocs = n_allocs;
+      start = g_get_monotonic_time ();
+
+      for (i = 0; i < opt_lookups; i++)
+        {
+          guint32 doc_id = doc_ids[i % n_docs];
+
+          if (use_view)
+            {
+              g_auto(XdpDocView) view = XDP_DOC_VIEW_INIT;
+
+              if (!xdp_doc_db_lookup_doc_view (db, doc_id, &view))
+                continue;
+
+              sum += strlen (xdp_doc_view_get_path (&view));
+              sum += strlen (xdp_doc_view_get_basename (&view));
+              sum += strlen (xdp_doc_view_get_dirname (&view));
+            }
+          else
+            {
+              g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, doc_id);
+              g_autoptr(GFile) file = NULL;
+              g_autofree char *path = NULL;
+              g_autofree char *basename = NULL;
+              g_autofree char *dirname = NULL;
+
+              if (doc == NULL)
+                continue;
+
+              file = g_file_new_for_uri (xdp_doc_get_uri (doc));
+              path = g_file_get_path (file);
+              basename = g_file_get_basename (file);
+              dirname = g_path_get_dirname (path);
+              sum += strlen (path) + strlen (basename) + strlen (dirname);
+            }
+        }
+
+      usec = MAX (g_get_monotonic_time () - start, 1);
+      allocs = n_allocs - allocs;
+
+      g_print ("{\"table\": \"doc-paths-%s\", \"lookups\": \"%s\", \"keys\": %d, "
+               "\"allocs_per_lookup\": %.2f, \"ns_per_lookup\": %.1f}\n",
+               use_view ? "view" : "decode", run % 2 == 0 ? "hot" : "all",
+               opt_keys, allocs / (double) opt_lookups,
+               usec * 1000.0 / opt_lookups);
+
+      if (sum == 1)
+        g_printerr (" ");
+    }
+
+  g_object_unref (db);
+
+  gdir = g_dir_open (dir, 0, NULL);
+  while (gdir != NULL && (name = g_dir_read_name (gdir)) != NULL)
+    {
+      g_autofree char *path = g_build_filename (dir, name, NULL);
+      unlink (path);
+    }
+  if (gdir != NULL)
+    g_dir_close (gdir);
+#endif
+}
+
+int
+main (int argc, char *argv[])
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GHashTable) used = NULL;
+  g_autoptr(GRand) rand = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *filename = NULL;
+  GOptionContext *context;
+  GArray *hits, *misses;
+  struct {
+    const char *label;
+    gboolean uint_keys;
+    gdouble fp_rate;
+  } tables[4] = {
+    { "string", FALSE, 0 },
+    { "string-bloom", FALSE, 0 },
+    { "uint", TRUE, 0 },
+    { "uint-bloom", TRUE, 0 },
+  };
+  int i;
+
+  setlocale (LC_ALL, "");
+
+  context = g_option_context_new ("- benchmark gvdb lookups");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      g_printerr ("option parsing failed: %s\n", error->message);
+      return 1;
+    }
+
+  if (argc != 1 || opt_keys <= 0 || opt_lookups <= 0)
+    {
+      g_printerr ("Usage: bench-gvdb [OPTIONS]\n");
+      return 1;
+    }
+
+  tables[1].fp_rate = opt_fp_rate;
+  tables[3].fp_rate = opt_fp_rate;
+
+  dir = g_dir_make_tmp ("bench-gvdb-XXXXXX", &error);
+  if (dir == NULL)
+    {
+      g_printerr ("Can't create temp dir: %s\n", error->message);
+      return 1;
+    }
+  filename = g_build_filename (dir, "db", NULL);
+
+  /* Doc ids are random nonzero 32bit numbers */
+  rand = g_rand_new_with_seed (4711);
+  used = g_hash_table_new (NULL, NULL);
+  hits = g_array_new (TRUE, FALSE, sizeof (guint32));
+  misses = g_array_new (TRUE, FALSE, sizeof (guint32));
+
+  while (hits->len < opt_keys || misses->len < opt_keys)
+    {
+      guint32 id = g_rand_int (rand);
+
+      if (id == 0 || !g_hash_table_add (used, GUINT_TO_POINTER (id)))
+        continue;
+
+      if (hits->len < opt_keys)
+        g_array_append_val (hits, id);
+      else
+        g_array_append_val (misses, id);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (tables); i++)
+    {
+      GvdbTable *table;
+      goffset size;
+
+      table = write_table (filename, (guint32 *)hits->data,
+                           tables[i].uint_keys, tables[i].fp_rate, &size);
+
+      run (table, tables[i].label, "hit", size,
+           (guint32 *)hits->data, tables[i].uint_keys);
+      run (table, tables[i].label, "miss", size,
+           (guint32 *)misses->data, tables[i].uint_keys);
+
+      gvdb_table_free (table);
+      unlink (filename);
+    }
+
+  bench_uris (filename, rand);
+  bench_dedup (filename, (guint32 *)hits->data);
+  bench_cold (filename, (guint32 *)hits->data, rand);
+  bench_doc_paths (dir);
+
+  rmdir (dir);
+  g_array_unref (hits);
+  g_array_unref (misses);
+
+  return 0;
+}
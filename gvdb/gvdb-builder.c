@@ -17,21 +17,31 @@
  * Author: Ryan Lortie <desrt@desrt.ca>
  */
 
+/* For O_TMPFILE */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "gvdb-builder.h"
 #include "gvdb-format.h"
 
 #include <glib.h>
+#include <errno.h>
+#include <stdio.h>
 #include <fcntl.h>
 #if !defined(G_OS_WIN32) || !defined(_MSC_VER)
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <math.h>
+#include <sys/uio.h>
 
 
 struct _GvdbItem
 {
   gchar *key;
   guint32 hash_value;
+  gboolean uint_key;
   guint32_le assigned_index;
   GvdbItem *parent;
   GvdbItem *sibling;
@@ -85,28 +95,37 @@ gvdb_hash_table_new (GHashTable  *parent,
   return table;
 }
 
-static guint32
-djb_hash (const gchar *key)
+GvdbItem *
+gvdb_hash_table_insert (GHashTable  *table,
+                        const gchar *key)
 {
-  guint32 hash_value = 5381;
+  GvdbItem *item;
 
-  while (*key)
-    hash_value = hash_value * 33 + *(signed char *)key++;
+  /* The hash depends on the file options, so it is only computed
+   * when the table is written.
+   */
+  item = g_slice_new0 (GvdbItem);
+  item->key = g_strdup (key);
 
-  return hash_value;
+  g_hash_table_insert (table, g_strdup (key), item);
+
+  return item;
 }
 
+/* Integer keys are stored as the hash value, with no key string.  A
+ * table must not mix integer and string keys.
+ */
 GvdbItem *
-gvdb_hash_table_insert (GHashTable  *table,
-                        const gchar *key)
+gvdb_hash_table_insert_uint (GHashTable *table,
+                             guint32     key)
 {
   GvdbItem *item;
 
   item = g_slice_new0 (GvdbItem);
-  item->key = g_strdup (key);
-  item->hash_value = djb_hash (key);
+  item->hash_value = key;
+  item->uint_key = TRUE;
 
-  g_hash_table_insert (table, g_strdup (key), item);
+  g_hash_table_insert (table, g_strdup_printf ("%u", key), item);
 
   return item;
 }
@@ -146,6 +165,7 @@ gvdb_item_set_parent (GvdbItem *item,
 {
   GvdbItem **node;
 
+  g_return_if_fail (!item->uint_key && !parent->uint_key);
   g_return_if_fail (g_str_has_prefix (item->key, parent->key));
   g_return_if_fail (!parent->value && !parent->table);
   g_return_if_fail (!item->parent && !item->sibling);
@@ -163,16 +183,19 @@ typedef struct
 {
   GvdbItem **buckets;
   gint n_buckets;
+  GvdbHashType hash_type;
 } HashTable;
 
 static HashTable *
-hash_table_new (gint n_buckets)
+hash_table_new (gint         n_buckets,
+                GvdbHashType hash_type)
 {
   HashTable *table;
 
   table = g_slice_new (HashTable);
   table->buckets = g_new0 (GvdbItem *, n_buckets);
   table->n_buckets = n_buckets;
+  table->hash_type = hash_type;
 
   return table;
 }
@@ -194,12 +217,28 @@ hash_table_insert (gpointer key,
   HashTable *table = data;
   GvdbItem *item = value;
 
-  hash_value = djb_hash (key);
+  if (!item->uint_key)
+    item->hash_value = gvdb_hash (table->hash_type, item->key, strlen (item->key));
+
+  hash_value = item->hash_value;
   bucket = hash_value % table->n_buckets;
   item->next = table->buckets[bucket];
   table->buckets[bucket] = item;
 }
 
+static gboolean
+hash_table_has_uint_keys (GHashTable *table)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init (&iter, table);
+  if (g_hash_table_iter_next (&iter, NULL, &value))
+    return ((GvdbItem *) value)->uint_key;
+
+  return FALSE;
+}
+
 static guint32_le
 item_to_index (GvdbItem *item)
 {
@@ -214,6 +253,12 @@ typedef struct
   GQueue *chunks;
   guint64 offset;
   gboolean byteswap;
+  gdouble bloom_false_positive_rate;
+  GvdbHashType hash_type;
+  gboolean cache_friendly;
+
+  /* Serialised value => its gvdb_pointer, if deduplicating */
+  GHashTable *values;
 } FileBuilder;
 
 typedef struct
@@ -223,6 +268,37 @@ typedef struct
   gpointer data;
 } FileChunk;
 
+#define CACHE_LINE_SIZE 64
+#define LAYOUT_PAGE_SIZE 4096
+
+/* Larger data is allowed to straddle pages */
+#define LAYOUT_MAX_PAGE_PADDING 512
+
+/* Returns the alignment to put @size bytes at the end of the file
+ * with, for a cache friendly layout: small data is moved to the next
+ * cache line or page rather than straddling two.
+ */
+static gsize
+layout_alignment (guint64 offset,
+                  gsize   alignment,
+                  gsize   size)
+{
+  if (size == 0)
+    return alignment;
+
+  offset += (-offset) & (alignment - 1);
+
+  if (size <= CACHE_LINE_SIZE &&
+      offset / CACHE_LINE_SIZE != (offset + size - 1) / CACHE_LINE_SIZE)
+    return CACHE_LINE_SIZE;
+
+  if (size <= LAYOUT_MAX_PAGE_PADDING &&
+      offset / LAYOUT_PAGE_SIZE != (offset + size - 1) / LAYOUT_PAGE_SIZE)
+    return LAYOUT_PAGE_SIZE;
+
+  return alignment;
+}
+
 static gpointer
 file_builder_allocate (FileBuilder         *fb,
                        guint                alignment,
@@ -255,6 +331,7 @@ file_builder_add_value (FileBuilder         *fb,
                         struct gvdb_pointer *pointer)
 {
   GVariant *variant, *normal;
+  gsize alignment;
   gpointer data;
   gsize size;
 
@@ -271,8 +348,37 @@ file_builder_add_value (FileBuilder         *fb,
   g_variant_unref (variant);
 
   size = g_variant_get_size (normal);
-  data = file_builder_allocate (fb, 8, size, pointer);
-  g_variant_store (normal, data);
+  alignment = 8;
+  if (fb->cache_friendly)
+    alignment = layout_alignment (fb->offset, alignment, size);
+
+  if (fb->values)
+    {
+      GBytes *bytes = g_variant_get_data_as_bytes (normal);
+      struct gvdb_pointer *shared;
+
+      shared = g_hash_table_lookup (fb->values, bytes);
+      if (shared != NULL)
+        {
+          *pointer = *shared;
+          g_bytes_unref (bytes);
+          g_variant_unref (normal);
+          return;
+        }
+
+      shared = g_new (struct gvdb_pointer, 1);
+      g_hash_table_insert (fb->values, bytes, shared);
+
+      data = file_builder_allocate (fb, alignment, size, pointer);
+      g_variant_store (normal, data);
+      *shared = *pointer;
+    }
+  else
+    {
+      data = file_builder_allocate (fb, alignment, size, pointer);
+      g_variant_store (normal, data);
+    }
+
   g_variant_unref (normal);
 }
 
@@ -287,6 +393,13 @@ file_builder_add_string (FileBuilder *fb,
 
   length = strlen (string);
 
+  if (fb->cache_friendly)
+    {
+      gsize alignment = layout_alignment (fb->offset, 1, length);
+
+      fb->offset += (-fb->offset) & (alignment - 1);
+    }
+
   chunk = g_slice_new (FileChunk);
   chunk->offset = fb->offset;
   chunk->size = length;
@@ -325,7 +438,8 @@ file_builder_allocate_for_hash (FileBuilder            *fb,
          n_buckets     * sizeof (guint32_le) +
          n_items       * sizeof (struct gvdb_hash_item);
 
-  data = file_builder_allocate (fb, 4, size, pointer);
+  data = file_builder_allocate (fb, fb->cache_friendly ? CACHE_LINE_SIZE : 4,
+                               size, pointer);
 
 #define chunk(s) (size -= (s), data += (s), data - (s))
   memcpy (chunk (sizeof bloom_hdr), &bloom_hdr, sizeof bloom_hdr);
@@ -338,13 +452,51 @@ file_builder_allocate_for_hash (FileBuilder            *fb,
 #undef chunk
 
   memset (*bloom_filter, 0, n_bloom_words * sizeof (guint32_le));
+}
 
-  /* NOTE - the code to actually fill in the bloom filter here is missing.
-   * Patches welcome! 
-   *
-   * http://en.wikipedia.org/wiki/Bloom_filter
-   * http://0pointer.de/blog/projects/bloom.html
-   */
+/* The reader sets two bits per key, both in the same word: bit
+ * (hash % 32) and bit ((hash >> bloom_shift) % 32) of word
+ * ((hash / 32) % n_bloom_words).  The number of words is picked with
+ * the usual formula for k = 2, m = -k n / ln (1 - p^(1/k)), which is
+ * a slight underestimate for a blocked filter like this one.
+ */
+static gsize
+bloom_filter_n_words (gsize   n_items,
+                      gdouble false_positive_rate)
+{
+  gdouble n_bits;
+
+  if (n_items == 0 ||
+      false_positive_rate <= 0.0 || false_positive_rate >= 1.0)
+    return 0;
+
+  n_bits = -2.0 * n_items / log (1.0 - sqrt (false_positive_rate));
+
+  return MIN ((gsize) ceil (n_bits / 32), (1u << 27) - 1);
+}
+
+/* Take the second bit from above the ones used to pick the word, so
+ * that the two bits are independent.
+ */
+static guint
+bloom_filter_shift (gsize n_bloom_words)
+{
+  return MIN (5 + g_bit_storage (n_bloom_words), 27);
+}
+
+static void
+bloom_filter_add (guint32_le *bloom_filter,
+                  gsize       n_bloom_words,
+                  guint       bloom_shift,
+                  guint32     hash_value)
+{
+  guint32 word, mask;
+
+  word = (hash_value / 32) % n_bloom_words;
+  mask = 1 << (hash_value & 31);
+  mask |= 1 << ((hash_value >> bloom_shift) & 31);
+
+  bloom_filter[word] = guint32_to_le (guint32_from_le (bloom_filter[word]) | mask);
 }
 
 static void
@@ -356,10 +508,12 @@ file_builder_add_hash (FileBuilder         *fb,
   struct gvdb_hash_item *items;
   HashTable *mytable;
   GvdbItem *item;
+  gsize n_bloom_words;
+  guint bloom_shift;
   guint32 index;
   gint bucket;
 
-  mytable = hash_table_new (g_hash_table_size (table));
+  mytable = hash_table_new (g_hash_table_size (table), fb->hash_type);
   g_hash_table_foreach (table, hash_table_insert, mytable);
   index = 0;
 
@@ -367,7 +521,11 @@ file_builder_add_hash (FileBuilder         *fb,
     for (item = mytable->buckets[bucket]; item; item = item->next)
       item->assigned_index = guint32_to_le (index++);
 
-  file_builder_allocate_for_hash (fb, mytable->n_buckets, index, 5, 0,
+  n_bloom_words = bloom_filter_n_words (index, fb->bloom_false_positive_rate);
+  bloom_shift = bloom_filter_shift (n_bloom_words);
+
+  file_builder_allocate_for_hash (fb, mytable->n_buckets, index,
+                                  bloom_shift, n_bloom_words,
                                   &bloom_filter, &buckets, &items, pointer);
 
   index = 0;
@@ -382,17 +540,29 @@ file_builder_add_hash (FileBuilder         *fb,
 
           g_assert (index == guint32_from_le (item->assigned_index));
           entry->hash_value = guint32_to_le (item->hash_value);
+
+          if (n_bloom_words > 0)
+            bloom_filter_add (bloom_filter, n_bloom_words, bloom_shift,
+                              item->hash_value);
           entry->parent = item_to_index (item->parent);
           entry->unused = 0;
 
-          if (item->parent != NULL)
-            basename = item->key + strlen (item->parent->key);
+          if (item->uint_key)
+            {
+              entry->key_start = guint32_to_le (0);
+              entry->key_size = guint16_to_le (0);
+            }
           else
-            basename = item->key;
-
-          file_builder_add_string (fb, basename,
-                                   &entry->key_start,
-                                   &entry->key_size);
+            {
+              if (item->parent != NULL)
+                basename = item->key + strlen (item->parent->key);
+              else
+                basename = item->key;
+
+              file_builder_add_string (fb, basename,
+                                       &entry->key_start,
+                                       &entry->key_size);
+            }
 
           if (item->value != NULL)
             {
@@ -425,7 +595,7 @@ file_builder_add_hash (FileBuilder         *fb,
 
           if (item->table != NULL)
             {
-              entry->type = 'H';
+              entry->type = hash_table_has_uint_keys (item->table) ? 'I' : 'H';
               file_builder_add_hash (fb, item->table, &entry->value.pointer);
             }
 
@@ -437,39 +607,67 @@ file_builder_add_hash (FileBuilder         *fb,
 }
 
 static FileBuilder *
-file_builder_new (gboolean byteswap)
+file_builder_new (const GvdbBuilderOptions *options)
 {
   FileBuilder *builder;
 
   builder = g_slice_new (FileBuilder);
   builder->chunks = g_queue_new ();
   builder->offset = sizeof (struct gvdb_header);
-  builder->byteswap = byteswap;
+  builder->byteswap = options->byteswap;
+  builder->bloom_false_positive_rate = options->bloom_false_positive_rate;
+  builder->hash_type = options->hash_type;
+  builder->cache_friendly = options->cache_friendly;
+  builder->values = NULL;
+  if (options->dedup_values)
+    builder->values = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                             (GDestroyNotify) g_bytes_unref,
+                                             g_free);
 
   return builder;
 }
 
-static GString *
-file_builder_serialise (FileBuilder          *fb,
-                        struct gvdb_pointer   root)
+static void
+header_init (struct gvdb_header  *header,
+             gboolean             byteswap,
+             GvdbHashType         hash_type,
+             struct gvdb_pointer  root)
 {
-  struct gvdb_header header = { { 0, }, };
-  GString *result;
+  memset (header, 0, sizeof *header);
 
-  if (fb->byteswap)
+  if (byteswap)
     {
-      header.signature[0] = GVDB_SWAPPED_SIGNATURE0;
-      header.signature[1] = GVDB_SWAPPED_SIGNATURE1;
+      header->signature[0] = GVDB_SWAPPED_SIGNATURE0;
+      header->signature[1] = GVDB_SWAPPED_SIGNATURE1;
     }
   else
     {
-      header.signature[0] = GVDB_SIGNATURE0;
-      header.signature[1] = GVDB_SIGNATURE1;
+      header->signature[0] = GVDB_SIGNATURE0;
+      header->signature[1] = GVDB_SIGNATURE1;
     }
 
+  /* Keep writing version 0 when possible, so that older readers can
+   * still use the file.
+   */
+  if (hash_type != GVDB_HASH_DJB)
+    {
+      header->version = guint32_to_le (1);
+      header->options = guint32_to_le (hash_type);
+    }
+
+  header->root = root;
+}
+
+static GString *
+file_builder_serialise (FileBuilder          *fb,
+                        struct gvdb_pointer   root)
+{
+  struct gvdb_header header;
+  GString *result;
+
   result = g_string_new (NULL);
 
-  header.root = root;
+  header_init (&header, fb->byteswap, fb->hash_type, root);
   g_string_append_len (result, (gpointer) &header, sizeof header);
 
   while (!g_queue_is_empty (fb->chunks))
@@ -478,13 +676,13 @@ file_builder_serialise (FileBuilder          *fb,
 
       if (result->len != chunk->offset)
         {
-          gchar zero[8] = { 0, };
+          gsize len = result->len;
 
-          g_assert (chunk->offset > result->len);
-          g_assert (chunk->offset - result->len < 8);
+          g_assert (chunk->offset > len);
 
-          g_string_append_len (result, zero, chunk->offset - result->len);
-          g_assert (result->len == chunk->offset);
+          /* Alignment padding, up to a page for cache friendly files */
+          g_string_set_size (result, chunk->offset);
+          memset (result->str + len, 0, chunk->offset - len);
         }
 
       g_string_append_len (result, chunk->data, chunk->size);
@@ -494,6 +692,8 @@ file_builder_serialise (FileBuilder          *fb,
     }
 
   g_queue_free (fb->chunks);
+  if (fb->values)
+    g_hash_table_unref (fb->values);
   g_slice_free (FileBuilder, fb);
 
   return result;
@@ -504,13 +704,26 @@ gvdb_table_write_contents (GHashTable   *table,
                            const gchar  *filename,
                            gboolean      byteswap,
                            GError      **error)
+{
+  GvdbBuilderOptions options = { 0, };
+
+  options.byteswap = byteswap;
+
+  return gvdb_table_write_contents_full (table, filename, &options, error);
+}
+
+gboolean
+gvdb_table_write_contents_full (GHashTable                *table,
+                                const gchar               *filename,
+                                const GvdbBuilderOptions  *options,
+                                GError                   **error)
 {
   struct gvdb_pointer root;
   gboolean status;
   FileBuilder *fb;
   GString *str;
 
-  fb = file_builder_new (byteswap);
+  fb = file_builder_new (options);
   file_builder_add_hash (fb, table, &root);
   str = file_builder_serialise (fb, root);
 
@@ -519,3 +732,898 @@ gvdb_table_write_contents (GHashTable   *table,
 
   return status;
 }
+
+/* Streaming writer
+ *
+ * Data is appended through a small buffer, and each table's hash
+ * block is written after its keys and values, so nothing but the
+ * fixed size part of the table being written (about 32 bytes per
+ * item) is kept in memory.
+ */
+
+#define WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef struct
+{
+  gchar *key;
+  gchar type;
+  struct gvdb_pointer value;
+} WriterRootItem;
+
+struct _GvdbWriter
+{
+  gchar *filename;
+  gchar *tmp_filename;
+  int fd;
+  GvdbBuilderOptions options;
+
+  /* Everything before buffer_offset is on disk */
+  guint64 buffer_offset;
+  gsize buffer_len;
+  guchar *buffer;
+
+  GArray *root_items;
+
+  /* WriterValue for each distinct value, if deduplicating */
+  GHashTable *values;
+  GvdbBuilderStats stats;
+};
+
+/* Written values are found again by the hash and size of their data,
+ * which is then compared with what is in the file.
+ */
+typedef struct
+{
+  guint32 hash;
+  guint32 size;
+  guint32 start;
+} WriterValue;
+
+typedef struct
+{
+  guint32 n_items;
+  guint32 n_buckets;
+  gsize n_bloom_words;
+  guint bloom_shift;
+  guint32_le *bloom_filter;
+  guint32_le *buckets;
+  struct gvdb_hash_item *items;
+
+  /* Item index of the n:th key of the iteration */
+  guint32 *slots;
+} WriterTable;
+
+static gboolean
+writer_set_error (GvdbWriter   *writer,
+                  const gchar  *what,
+                  int           errsv,
+                  GError      **error)
+{
+  g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+               "Failed to %s '%s': %s",
+               what, writer->filename, g_strerror (errsv));
+  return FALSE;
+}
+
+static gboolean
+writer_pwritev (GvdbWriter    *writer,
+                struct iovec  *iov,
+                int            n_iov,
+                guint64        offset,
+                GError       **error)
+{
+  while (n_iov > 0)
+    {
+      ssize_t res;
+
+      if (iov->iov_len == 0)
+        {
+          iov++;
+          n_iov--;
+          continue;
+        }
+
+      res = pwritev (writer->fd, iov, n_iov, offset);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return writer_set_error (writer, "write", errno, error);
+        }
+
+      offset += res;
+      while (n_iov > 0 && (gsize) res >= iov->iov_len)
+        {
+          res -= iov->iov_len;
+          iov++;
+          n_iov--;
+        }
+
+      if (n_iov > 0)
+        {
+          iov->iov_base = (guchar *) iov->iov_base + res;
+          iov->iov_len -= res;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Writes out the buffer followed by @data, which doesn't need to go
+ * through the buffer.
+ */
+static gboolean
+writer_flush (GvdbWriter     *writer,
+              gconstpointer   data,
+              gsize           size,
+              GError        **error)
+{
+  struct iovec iov[2];
+
+  iov[0].iov_base = writer->buffer;
+  iov[0].iov_len = writer->buffer_len;
+  iov[1].iov_base = (gpointer) data;
+  iov[1].iov_len = size;
+
+  if (!writer_pwritev (writer, iov, G_N_ELEMENTS (iov),
+                       writer->buffer_offset, error))
+    return FALSE;
+
+  writer->buffer_offset += writer->buffer_len + size;
+  writer->buffer_len = 0;
+
+  return TRUE;
+}
+
+static guint64
+writer_get_offset (GvdbWriter *writer)
+{
+  return writer->buffer_offset + writer->buffer_len;
+}
+
+static gboolean
+writer_pad (GvdbWriter  *writer,
+            gsize        alignment,
+            GError     **error)
+{
+  gsize padding;
+
+  padding = (-writer_get_offset (writer)) & (alignment - 1);
+  if (writer->buffer_len + padding > WRITER_BUFFER_SIZE &&
+      !writer_flush (writer, NULL, 0, error))
+    return FALSE;
+
+  memset (writer->buffer + writer->buffer_len, 0, padding);
+  writer->buffer_len += padding;
+
+  return TRUE;
+}
+
+static gboolean
+writer_append (GvdbWriter     *writer,
+               gsize           alignment,
+               gconstpointer   data,
+               gsize           size,
+               guint32        *start,
+               GError        **error)
+{
+  guint64 offset;
+
+  if (!writer_pad (writer, alignment, error))
+    return FALSE;
+
+  offset = writer_get_offset (writer);
+  if (offset + size > G_MAXUINT32)
+    return writer_set_error (writer, "write", EFBIG, error);
+
+  *start = offset;
+
+  if (writer->buffer_len + size <= WRITER_BUFFER_SIZE)
+    {
+      memcpy (writer->buffer + writer->buffer_len, data, size);
+      writer->buffer_len += size;
+      return TRUE;
+    }
+
+  return writer_flush (writer, data, size, error);
+}
+
+static guint
+writer_value_hash (gconstpointer v)
+{
+  return ((const WriterValue *) v)->hash;
+}
+
+static gboolean
+writer_value_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const WriterValue *value_a = a, *value_b = b;
+
+  return value_a->hash == value_b->hash && value_a->size == value_b->size;
+}
+
+/* Whether the data at @start is @data.  A value is either all in the
+ * buffer or all on disk.
+ */
+static gboolean
+writer_data_equal (GvdbWriter    *writer,
+                   guint64        start,
+                   gconstpointer  data,
+                   gsize          size)
+{
+  gboolean equal;
+  guchar *tmp;
+
+  if (start >= writer->buffer_offset)
+    return memcmp (writer->buffer + (start - writer->buffer_offset), data, size) == 0;
+
+  tmp = g_malloc (size);
+  equal = pread (writer->fd, tmp, size, start) == (ssize_t) size &&
+          memcmp (tmp, data, size) == 0;
+  g_free (tmp);
+
+  return equal;
+}
+
+static gboolean
+writer_append_data (GvdbWriter     *writer,
+                    gconstpointer   data,
+                    gsize           size,
+                    guint32        *start,
+                    GError        **error)
+{
+  WriterValue key, *value;
+  gsize alignment = 8;
+
+  writer->stats.n_values++;
+
+  if (writer->options.cache_friendly)
+    alignment = layout_alignment (writer_get_offset (writer), alignment, size);
+
+  if (writer->values == NULL)
+    return writer_append (writer, alignment, data, size, start, error);
+
+  key.hash = gvdb_hash (GVDB_HASH_XXH32, data, size);
+  key.size = size;
+
+  value = g_hash_table_lookup (writer->values, &key);
+  if (value != NULL && writer_data_equal (writer, value->start, data, size))
+    {
+      writer->stats.n_shared_values++;
+      writer->stats.bytes_saved += size;
+      *start = value->start;
+      return TRUE;
+    }
+
+  if (!writer_append (writer, alignment, data, size, start, error))
+    return FALSE;
+
+  /* On a hash collision, the newer value replaces the older one */
+  value = g_new (WriterValue, 1);
+  *value = key;
+  value->start = *start;
+  g_hash_table_add (writer->values, value);
+
+  return TRUE;
+}
+
+/* Returns the value as stored in the file, wrapped in a variant */
+static GVariant *
+writer_get_normal_value (GvdbWriter *writer,
+                         GVariant   *value)
+{
+  GVariant *variant, *normal;
+
+  if (writer->options.byteswap)
+    {
+      value = g_variant_byteswap (value);
+      variant = g_variant_new_variant (value);
+      g_variant_unref (value);
+    }
+  else
+    variant = g_variant_new_variant (value);
+
+  normal = g_variant_get_normal_form (variant);
+  g_variant_unref (variant);
+
+  return normal;
+}
+
+static gboolean
+writer_append_value (GvdbWriter           *writer,
+                     GVariant             *normal,
+                     struct gvdb_pointer  *pointer,
+                     GError              **error)
+{
+  gsize size = g_variant_get_size (normal);
+  guint32 start;
+
+  if (!writer_append_data (writer, g_variant_get_data (normal), size, &start, error))
+    return FALSE;
+
+  pointer->start = guint32_to_le (start);
+  pointer->end = guint32_to_le (start + size);
+
+  return TRUE;
+}
+
+/* The key size field of a hash item is 16 bits */
+static gboolean
+writer_check_key (const gchar  *key,
+                  GError      **error)
+{
+  if (strlen (key) > G_MAXUINT16)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Key '%.32s...' is longer than %u bytes", key, G_MAXUINT16);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+writer_append_key (GvdbWriter              *writer,
+                   const gchar             *key,
+                   struct gvdb_hash_item   *entry,
+                   GError                 **error)
+{
+  gsize length = strlen (key);
+  guint32 start;
+
+  if (!writer_check_key (key, error) ||
+      !writer_append (writer, 1, key, length, &start, error))
+    return FALSE;
+
+  entry->key_start = guint32_to_le (start);
+  entry->key_size = guint16_to_le (length);
+
+  return TRUE;
+}
+
+static gboolean
+writer_append_item (GvdbWriter             *writer,
+                    struct gvdb_hash_item  *entry,
+                    const gchar            *key,
+                    GVariant               *value,
+                    GError                **error)
+{
+  GVariant *normal = writer_get_normal_value (writer, value);
+  gboolean res;
+
+  /* Keep the key together with the value, allowing for the padding
+   * between them.
+   */
+  if (key != NULL && writer->options.cache_friendly)
+    {
+      gsize alignment = layout_alignment (writer_get_offset (writer), 1,
+                                          strlen (key) + 7 + g_variant_get_size (normal));
+
+      if (!writer_pad (writer, alignment, error))
+        {
+          g_variant_unref (normal);
+          return FALSE;
+        }
+    }
+
+  entry->type = 'v';
+  res = (key == NULL || writer_append_key (writer, key, entry, error)) &&
+        writer_append_value (writer, normal, &entry->value.pointer, error);
+  g_variant_unref (normal);
+
+  return res;
+}
+
+static void
+writer_set_changed_error (const gchar  *key,
+                          GError      **error)
+{
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+               "Table '%s' changed while being written", key);
+}
+
+static guint32
+writer_hash_key (GvdbWriter  *writer,
+                 const gchar *key,
+                 guint32      uint_key)
+{
+  if (key == NULL)
+    return uint_key;
+
+  return gvdb_hash (writer->options.hash_type, key, strlen (key));
+}
+
+/* Lays out the hash block the same way the builder does, with a
+ * bucket per item and the items sorted by bucket.
+ */
+static void
+writer_table_init (WriterTable   *table,
+                   const guint32 *hashes,
+                   guint32        n_items,
+                   gdouble        bloom_false_positive_rate)
+{
+  guint32 *fill;
+  guint32 i;
+
+  table->n_items = n_items;
+  table->n_buckets = n_items;
+  table->n_bloom_words = bloom_filter_n_words (n_items, bloom_false_positive_rate);
+  table->bloom_shift = bloom_filter_shift (table->n_bloom_words);
+  table->bloom_filter = g_new0 (guint32_le, table->n_bloom_words);
+  table->buckets = g_new0 (guint32_le, table->n_buckets);
+  table->items = g_new0 (struct gvdb_hash_item, n_items);
+  table->slots = g_new (guint32, n_items);
+
+  /* Count the items in each bucket, then turn the counts into the
+   * index of the first item of each bucket.
+   */
+  fill = g_new0 (guint32, table->n_buckets + 1);
+  for (i = 0; i < n_items; i++)
+    fill[hashes[i] % table->n_buckets + 1]++;
+  for (i = 0; i < table->n_buckets; i++)
+    {
+      fill[i + 1] += fill[i];
+      table->buckets[i] = guint32_to_le (fill[i]);
+    }
+
+  for (i = 0; i < n_items; i++)
+    {
+      guint32 slot = fill[hashes[i] % table->n_buckets]++;
+      struct gvdb_hash_item *entry = &table->items[slot];
+
+      table->slots[i] = slot;
+      entry->hash_value = guint32_to_le (hashes[i]);
+      entry->parent = guint32_to_le (-1u);
+
+      if (table->n_bloom_words > 0)
+        bloom_filter_add (table->bloom_filter, table->n_bloom_words,
+                          table->bloom_shift, hashes[i]);
+    }
+
+  g_free (fill);
+}
+
+static void
+writer_table_clear (WriterTable *table)
+{
+  g_free (table->bloom_filter);
+  g_free (table->buckets);
+  g_free (table->items);
+  g_free (table->slots);
+}
+
+static gboolean
+writer_append_table (GvdbWriter           *writer,
+                     WriterTable          *table,
+                     struct gvdb_pointer  *pointer,
+                     GError              **error)
+{
+  guint32_le header[2];
+  guint32 start, unused;
+
+  g_assert (table->n_bloom_words < (1u << 27));
+
+  header[0] = guint32_to_le (table->bloom_shift << 27 | table->n_bloom_words);
+  header[1] = guint32_to_le (table->n_buckets);
+
+  /* All parts are multiples of 4 in size, so they end up contiguous */
+  if (!writer_append (writer, writer->options.cache_friendly ? CACHE_LINE_SIZE : 4,
+                      header, sizeof header, &start, error) ||
+      !writer_append (writer, 4, table->bloom_filter,
+                      table->n_bloom_words * sizeof (guint32_le), &unused, error) ||
+      !writer_append (writer, 4, table->buckets,
+                      table->n_buckets * sizeof (guint32_le), &unused, error) ||
+      !writer_append (writer, 4, table->items,
+                      table->n_items * sizeof (struct gvdb_hash_item), &unused, error))
+    return FALSE;
+
+  pointer->start = guint32_to_le (start);
+  pointer->end = guint32_to_le (writer_get_offset (writer));
+
+  return TRUE;
+}
+
+/**
+ * gvdb_writer_new:
+ * @filename: the file to write
+ * @options: the options to write with
+ * @error: return location for a #GError
+ *
+ * Starts writing a new file that will replace @filename when
+ * gvdb_writer_finish() is called.  Until then the data goes to an
+ * anonymous file if the filesystem supports it, or else to a
+ * temporary file next to @filename.
+ *
+ * Returns: a new #GvdbWriter, or %NULL on error
+ **/
+GvdbWriter *
+gvdb_writer_new (const gchar               *filename,
+                 const GvdbBuilderOptions  *options,
+                 GError                   **error)
+{
+  GvdbWriter *writer;
+
+  writer = g_slice_new0 (GvdbWriter);
+  writer->filename = g_strdup (filename);
+  writer->options = *options;
+  writer->buffer = g_malloc (WRITER_BUFFER_SIZE);
+  writer->buffer_offset = sizeof (struct gvdb_header);
+  writer->root_items = g_array_new (FALSE, FALSE, sizeof (WriterRootItem));
+  writer->fd = -1;
+  if (options->dedup_values)
+    writer->values = g_hash_table_new_full (writer_value_hash, writer_value_equal,
+                                            g_free, NULL);
+
+#ifdef O_TMPFILE
+  {
+    gchar *dirname = g_path_get_dirname (filename);
+
+    writer->fd = open (dirname, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    g_free (dirname);
+  }
+#endif
+
+  if (writer->fd < 0)
+    {
+      writer->tmp_filename = g_strdup_printf ("%s.XXXXXX", filename);
+      writer->fd = g_mkstemp_full (writer->tmp_filename, O_RDWR, 0666);
+      if (writer->fd < 0)
+        {
+          writer_set_error (writer, "create temporary file for", errno, error);
+          g_clear_pointer (&writer->tmp_filename, g_free);
+          gvdb_writer_free (writer);
+          return NULL;
+        }
+    }
+
+  return writer;
+}
+
+/**
+ * gvdb_writer_add_value:
+ * @writer: a #GvdbWriter
+ * @key: the key in the root table
+ * @value: the value
+ * @error: return location for a #GError
+ *
+ * Adds a value to the root table.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gvdb_writer_add_value (GvdbWriter   *writer,
+                       const gchar  *key,
+                       GVariant     *value,
+                       GError      **error)
+{
+  WriterRootItem item;
+  GVariant *normal;
+  gboolean res;
+
+  g_variant_ref_sink (value);
+  normal = writer_get_normal_value (writer, value);
+  res = writer_append_value (writer, normal, &item.value, error);
+  g_variant_unref (normal);
+  g_variant_unref (value);
+
+  if (!res)
+    return FALSE;
+
+  item.key = g_strdup (key);
+  item.type = 'v';
+  g_array_append_val (writer->root_items, item);
+
+  return TRUE;
+}
+
+/**
+ * gvdb_writer_add_table:
+ * @writer: a #GvdbWriter
+ * @key: the key in the root table
+ * @funcs: the iterator over the contents
+ * @user_data: data for @funcs
+ * @error: return location for a #GError
+ *
+ * Adds a table of values to the root table.  The iterator is run
+ * twice: first to hash the keys and lay out the table, then to write
+ * the keys and values.  Keys must either all be strings or all be
+ * integers, and string keys can't be longer than 65535 bytes.  For
+ * cache friendly files, an iterator that can seek is visited in bucket
+ * order the second time.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gvdb_writer_add_table (GvdbWriter                 *writer,
+                       const gchar                *key,
+                       const GvdbWriterIterFuncs  *funcs,
+                       gpointer                    user_data,
+                       GError                    **error)
+{
+  WriterTable table = { 0, };
+  WriterRootItem root_item;
+  gboolean uint_keys = FALSE;
+  gboolean bucket_order;
+  const gchar *item_key;
+  guint32 uint_key, position;
+  GVariant *value;
+  GArray *hashes, *positions = NULL;
+  guint32 *slot_positions = NULL;
+  gboolean res = FALSE;
+  guint32 i;
+
+  bucket_order = writer->options.cache_friendly &&
+                 funcs->tell != NULL && funcs->seek != NULL;
+
+  hashes = g_array_new (FALSE, FALSE, sizeof (guint32));
+  if (bucket_order)
+    positions = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  funcs->reset (user_data);
+  for (;;)
+    {
+      guint32 hash_value;
+
+      position = bucket_order ? funcs->tell (user_data) : 0;
+      if (!funcs->next (user_data, &item_key, &uint_key, NULL))
+        break;
+
+      hash_value = writer_hash_key (writer, item_key, uint_key);
+
+      if (hashes->len == 0)
+        uint_keys = item_key == NULL;
+      else if (uint_keys != (item_key == NULL))
+        {
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                       "Table '%s' mixes string and integer keys", key);
+          g_array_free (hashes, TRUE);
+          if (positions)
+            g_array_free (positions, TRUE);
+          return FALSE;
+        }
+
+      /* Fail before anything of the table is written */
+      if (item_key != NULL && !writer_check_key (item_key, error))
+        {
+          g_array_free (hashes, TRUE);
+          if (positions)
+            g_array_free (positions, TRUE);
+          return FALSE;
+        }
+
+      g_array_append_val (hashes, hash_value);
+      if (positions)
+        g_array_append_val (positions, position);
+    }
+
+  writer_table_init (&table, (guint32 *) hashes->data, hashes->len,
+                     writer->options.bloom_false_positive_rate);
+  g_array_free (hashes, TRUE);
+
+  if (positions)
+    {
+      slot_positions = g_new (guint32, table.n_items);
+      for (i = 0; i < table.n_items; i++)
+        slot_positions[table.slots[i]] = g_array_index (positions, guint32, i);
+      g_array_free (positions, TRUE);
+    }
+
+  funcs->reset (user_data);
+  for (i = 0; i < table.n_items; i++)
+    {
+      struct gvdb_hash_item *entry;
+      gboolean ok;
+
+      if (slot_positions)
+        {
+          funcs->seek (user_data, slot_positions[i]);
+          entry = &table.items[i];
+        }
+      else
+        entry = &table.items[table.slots[i]];
+
+      if (!funcs->next (user_data, &item_key, &uint_key, &value))
+        {
+          writer_set_changed_error (key, error);
+          goto out;
+        }
+
+      if (guint32_from_le (entry->hash_value) !=
+          writer_hash_key (writer, item_key, uint_key))
+        {
+          g_variant_unref (value);
+          writer_set_changed_error (key, error);
+          goto out;
+        }
+
+      ok = writer_append_item (writer, entry, item_key, value, error);
+      g_variant_unref (value);
+
+      if (!ok)
+        goto out;
+    }
+
+  if (slot_positions == NULL &&
+      funcs->next (user_data, &item_key, &uint_key, &value))
+    {
+      g_variant_unref (value);
+      writer_set_changed_error (key, error);
+      goto out;
+    }
+
+  if (!writer_append_table (writer, &table, &root_item.value, error))
+    goto out;
+
+  root_item.key = g_strdup (key);
+  root_item.type = uint_keys ? 'I' : 'H';
+  g_array_append_val (writer->root_items, root_item);
+
+  res = TRUE;
+
+ out:
+  g_free (slot_positions);
+  writer_table_clear (&table);
+  return res;
+}
+
+/* Gives an anonymous file a temporary name next to the target */
+static gboolean
+writer_link_tmpfile (GvdbWriter  *writer,
+                     GError     **error)
+{
+  gchar proc_path[64];
+  int tries;
+
+  g_snprintf (proc_path, sizeof proc_path, "/proc/self/fd/%d", writer->fd);
+
+  for (tries = 0; tries < 100; tries++)
+    {
+      gchar *tmp_filename;
+
+      tmp_filename = g_strdup_printf ("%s.%08x", writer->filename, g_random_int ());
+      if (linkat (AT_FDCWD, proc_path, AT_FDCWD, tmp_filename, AT_SYMLINK_FOLLOW) == 0)
+        {
+          writer->tmp_filename = tmp_filename;
+          return TRUE;
+        }
+
+      g_free (tmp_filename);
+      if (errno != EEXIST)
+        break;
+    }
+
+  return writer_set_error (writer, "link temporary file for", errno, error);
+}
+
+/**
+ * gvdb_writer_finish:
+ * @writer: a #GvdbWriter
+ * @error: return location for a #GError
+ *
+ * Writes the root table and the header, and atomically replaces the
+ * target file with the new one.  @writer must still be freed with
+ * gvdb_writer_free() afterwards.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+gvdb_writer_finish (GvdbWriter  *writer,
+                    GError     **error)
+{
+  WriterTable table = { 0, };
+  struct gvdb_pointer root;
+  struct gvdb_header header;
+  struct iovec iov;
+  guint32 *hashes;
+  gboolean res = FALSE;
+  guint i;
+
+  /* The root table only has a few items, so it's fine to have them in
+   * memory.
+   */
+  hashes = g_new (guint32, writer->root_items->len);
+  for (i = 0; i < writer->root_items->len; i++)
+    {
+      WriterRootItem *item = &g_array_index (writer->root_items, WriterRootItem, i);
+      hashes[i] = writer_hash_key (writer, item->key, 0);
+    }
+
+  writer_table_init (&table, hashes, writer->root_items->len,
+                     writer->options.bloom_false_positive_rate);
+  g_free (hashes);
+
+  for (i = 0; i < writer->root_items->len; i++)
+    {
+      WriterRootItem *item = &g_array_index (writer->root_items, WriterRootItem, i);
+      struct gvdb_hash_item *entry = &table.items[table.slots[i]];
+
+      if (!writer_append_key (writer, item->key, entry, error))
+        goto out;
+
+      entry->type = item->type;
+      entry->value.pointer = item->value;
+    }
+
+  if (!writer_append_table (writer, &table, &root, error) ||
+      !writer_flush (writer, NULL, 0, error))
+    goto out;
+
+  header_init (&header, writer->options.byteswap, writer->options.hash_type, root);
+  iov.iov_base = &header;
+  iov.iov_len = sizeof header;
+  if (!writer_pwritev (writer, &iov, 1, 0, error))
+    goto out;
+
+  if (fsync (writer->fd) != 0)
+    {
+      writer_set_error (writer, "sync", errno, error);
+      goto out;
+    }
+
+  if (writer->tmp_filename == NULL &&
+      !writer_link_tmpfile (writer, error))
+    goto out;
+
+  if (rename (writer->tmp_filename, writer->filename) != 0)
+    {
+      writer_set_error (writer, "rename temporary file to", errno, error);
+      goto out;
+    }
+
+  g_clear_pointer (&writer->tmp_filename, g_free);
+  res = TRUE;
+
+ out:
+  writer_table_clear (&table);
+  return res;
+}
+
+/**
+ * gvdb_writer_get_stats:
+ * @writer: a #GvdbWriter
+ * @stats: return location for the stats
+ *
+ * Gets the number of values written so far, and how many of them,
+ * and how many bytes, were saved by sharing the data of identical
+ * values.
+ **/
+void
+gvdb_writer_get_stats (GvdbWriter       *writer,
+                       GvdbBuilderStats *stats)
+{
+  *stats = writer->stats;
+}
+
+/**
+ * gvdb_writer_free:
+ * @writer: a #GvdbWriter
+ *
+ * Frees @writer.  If gvdb_writer_finish() was not called or failed,
+ * the target file is left untouched.
+ **/
+void
+gvdb_writer_free (GvdbWriter *writer)
+{
+  guint i;
+
+  if (writer->fd >= 0)
+    close (writer->fd);
+
+  if (writer->tmp_filename)
+    {
+      unlink (writer->tmp_filename);
+      g_free (writer->tmp_filename);
+    }
+
+  for (i = 0; i < writer->root_items->len; i++)
+    g_free (g_array_index (writer->root_items, WriterRootItem, i).key);
+  g_array_free (writer->root_items, TRUE);
+
+  if (writer->values)
+    g_hash_table_unref (writer->values);
+
+  g_free (writer->buffer);
+  g_free (writer->filename);
+  g_slice_free (GvdbWriter, writer);
+}
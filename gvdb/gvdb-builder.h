@@ -22,8 +22,45 @@
 
 #include <gio/gio.h>
 
+#include "gvdb-format.h"
+
 typedef struct _GvdbItem GvdbItem;
 
+typedef struct
+{
+  gboolean byteswap;
+
+  /* Target false positive rate of the bloom filter emitted for each
+   * hash table, or 0 for no bloom filter.
+   */
+  gdouble bloom_false_positive_rate;
+
+  /* GVDB_HASH_DJB, the default, can be read by all readers.  Other
+   * hashes are faster but need a reader that knows version 1 files.
+   */
+  GvdbHashType hash_type;
+
+  /* Store identical values once, with all the items that have them
+   * pointing at the same data.
+   */
+  gboolean dedup_values;
+
+  /* Lay the file out for few cache misses and page faults per lookup:
+   * hash tables start on a cache line, and small keys and values are
+   * padded so that they don't straddle cache lines or pages.  The
+   * streaming writer also writes the values of a table in bucket
+   * order, if its iterator can seek.
+   */
+  gboolean cache_friendly;
+} GvdbBuilderOptions;
+
+typedef struct
+{
+  guint64 n_values;
+  guint64 n_shared_values;
+  guint64 bytes_saved;
+} GvdbBuilderStats;
+
 G_GNUC_INTERNAL
 GHashTable *            gvdb_hash_table_new                             (GHashTable    *parent,
                                                                          const gchar   *key);
@@ -32,6 +69,9 @@ G_GNUC_INTERNAL
 GvdbItem *              gvdb_hash_table_insert                          (GHashTable    *table,
                                                                          const gchar   *key);
 G_GNUC_INTERNAL
+GvdbItem *              gvdb_hash_table_insert_uint                     (GHashTable    *table,
+                                                                         guint32        key);
+G_GNUC_INTERNAL
 void                    gvdb_hash_table_insert_string                   (GHashTable    *table,
                                                                          const gchar   *key,
                                                                          const gchar   *value);
@@ -51,5 +91,70 @@ gboolean                gvdb_table_write_contents                       (GHashTa
                                                                          const gchar    *filename,
                                                                          gboolean        byteswap,
                                                                          GError        **error);
+G_GNUC_INTERNAL
+gboolean                gvdb_table_write_contents_full                  (GHashTable                *table,
+                                                                         const gchar               *filename,
+                                                                         const GvdbBuilderOptions  *options,
+                                                                         GError                   **error);
+
+/* Streaming writer
+ *
+ * Writes a file with a root table holding values and tables of
+ * values, without keeping the contents in memory.  Each table is
+ * read through an iterator, once for the keys and once more for the
+ * values, and written straight to a temporary file that replaces
+ * @filename when finished.
+ */
+typedef struct _GvdbWriter GvdbWriter;
+
+typedef struct
+{
+  /* Restarts the iteration.  Every pass must produce the same keys in
+   * the same order, with no duplicates.
+   */
+  void     (*reset) (gpointer      user_data);
+
+  /* Returns the next entry, or %FALSE at the end.  String keys are
+   * returned in @key, integer keys in @uint_key with @key set to
+   * %NULL; the key only needs to stay valid until the next call.
+   * @value is %NULL on the pass that only looks at the keys, else it
+   * receives a new reference.
+   */
+  gboolean (*next)  (gpointer      user_data,
+                     const gchar **key,
+                     guint32      *uint_key,
+                     GVariant    **value);
+
+  /* Optional.  Returns the position of the entry that the next call
+   * to next() will return, and goes back to such a position.
+   */
+  guint32  (*tell)  (gpointer      user_data);
+  void     (*seek)  (gpointer      user_data,
+                     guint32       position);
+} GvdbWriterIterFuncs;
+
+G_GNUC_INTERNAL
+GvdbWriter *            gvdb_writer_new                                 (const gchar               *filename,
+                                                                         const GvdbBuilderOptions  *options,
+                                                                         GError                   **error);
+G_GNUC_INTERNAL
+gboolean                gvdb_writer_add_value                           (GvdbWriter                *writer,
+                                                                         const gchar               *key,
+                                                                         GVariant                  *value,
+                                                                         GError                   **error);
+G_GNUC_INTERNAL
+gboolean                gvdb_writer_add_table                           (GvdbWriter                *writer,
+                                                                         const gchar               *key,
+                                                                         const GvdbWriterIterFuncs *funcs,
+                                                                         gpointer                   user_data,
+                                                                         GError                   **error);
+G_GNUC_INTERNAL
+gboolean                gvdb_writer_finish                              (GvdbWriter                *writer,
+                                                                         GError                   **error);
+G_GNUC_INTERNAL
+void                    gvdb_writer_get_stats                           (GvdbWriter                *writer,
+                                                                         GvdbBuilderStats          *stats);
+G_GNUC_INTERNAL
+void                    gvdb_writer_free                                (GvdbWriter                *writer);
 
 #endif /* __gvdb_builder_h__ */
@@ -21,6 +21,7 @@
 #define __gvdb_format_h__
 
 #include <glib.h>
+#include <string.h>
 
 typedef struct { guint16 value; } guint16_le;
 typedef struct { guint32 value; } guint32_le;
@@ -35,6 +36,10 @@ struct gvdb_hash_header {
   guint32_le n_buckets;
 };
 
+/* type is one of 'v' (value), 'L' (list of child items), 'H' (hash
+ * table) or 'I' (hash table with integer keys).  The items of an 'I'
+ * table have no key string, the key is stored as the hash value.
+ */
 struct gvdb_hash_item {
   guint32_le hash_value;
   guint32_le parent;
@@ -51,6 +56,17 @@ struct gvdb_hash_item {
   } value;
 };
 
+/* Version 0 files hash keys with djb.  In version 1 files, the low
+ * byte of options says which hash is used.
+ */
+typedef enum
+{
+  GVDB_HASH_DJB = 0,
+  GVDB_HASH_XXH32 = 1
+} GvdbHashType;
+
+#define GVDB_OPTIONS_HASH_MASK 0xff
+
 struct gvdb_header {
   guint32 signature[2];
   guint32_le version;
@@ -77,6 +93,95 @@ static inline guint16 guint16_from_le (guint16_le value) {
   return GUINT16_FROM_LE (value.value);
 }
 
+static inline guint32 gvdb_hash_djb (const gchar *key, gsize length) {
+  guint32 hash_value = 5381;
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    hash_value = hash_value * 33 + ((signed char *) key)[i];
+
+  return hash_value;
+}
+
+/* xxHash32 (https://github.com/Cyan4973/xxHash) with a seed of 0 */
+#define GVDB_XXH_PRIME1 0x9E3779B1u
+#define GVDB_XXH_PRIME2 0x85EBCA77u
+#define GVDB_XXH_PRIME3 0xC2B2AE3Du
+#define GVDB_XXH_PRIME4 0x27D4EB2Fu
+#define GVDB_XXH_PRIME5 0x165667B1u
+#define GVDB_XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static inline guint32 gvdb_xxh_read32 (const guchar *p) {
+  guint32 value;
+
+  memcpy (&value, p, sizeof value);
+  return GUINT32_FROM_LE (value);
+}
+
+static inline guint32 gvdb_xxh_round (guint32 acc, guint32 input) {
+  acc += input * GVDB_XXH_PRIME2;
+  acc = GVDB_XXH_ROTL (acc, 13);
+  return acc * GVDB_XXH_PRIME1;
+}
+
+static inline guint32 gvdb_hash_xxh32 (const gchar *key, gsize length) {
+  const guchar *p = (const guchar *) key;
+  const guchar *end = p + length;
+  guint32 h;
+
+  if (length >= 16)
+    {
+      guint32 v1 = GVDB_XXH_PRIME1 + GVDB_XXH_PRIME2;
+      guint32 v2 = GVDB_XXH_PRIME2;
+      guint32 v3 = 0;
+      guint32 v4 = -GVDB_XXH_PRIME1;
+
+      do
+        {
+          v1 = gvdb_xxh_round (v1, gvdb_xxh_read32 (p));
+          v2 = gvdb_xxh_round (v2, gvdb_xxh_read32 (p + 4));
+          v3 = gvdb_xxh_round (v3, gvdb_xxh_read32 (p + 8));
+          v4 = gvdb_xxh_round (v4, gvdb_xxh_read32 (p + 12));
+          p += 16;
+        }
+      while (p + 16 <= end);
+
+      h = GVDB_XXH_ROTL (v1, 1) + GVDB_XXH_ROTL (v2, 7) +
+          GVDB_XXH_ROTL (v3, 12) + GVDB_XXH_ROTL (v4, 18);
+    }
+  else
+    h = GVDB_XXH_PRIME5;
+
+  h += (guint32) length;
+
+  for (; p + 4 <= end; p += 4)
+    {
+      h += gvdb_xxh_read32 (p) * GVDB_XXH_PRIME3;
+      h = GVDB_XXH_ROTL (h, 17) * GVDB_XXH_PRIME4;
+    }
+
+  for (; p < end; p++)
+    {
+      h += *p * GVDB_XXH_PRIME5;
+      h = GVDB_XXH_ROTL (h, 11) * GVDB_XXH_PRIME1;
+    }
+
+  h ^= h >> 15;
+  h *= GVDB_XXH_PRIME2;
+  h ^= h >> 13;
+  h *= GVDB_XXH_PRIME3;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static inline guint32 gvdb_hash (GvdbHashType type, const gchar *key, gsize length) {
+  if (type == GVDB_HASH_XXH32)
+    return gvdb_hash_xxh32 (key, length);
+
+  return gvdb_hash_djb (key, length);
+}
+
 #define GVDB_SIGNATURE0 1918981703
 #define GVDB_SIGNATURE1 1953390953
 #define GVDB_SWAPPED_SIGNATURE0 GUINT32_SWAP_LE_BE (GVDB_SIGNATURE0)
@@ -30,6 +30,8 @@ struct _GvdbTable {
 
   gboolean byteswapped;
   gboolean trusted;
+  gboolean uint_keys;
+  GvdbHashType hash_type;
 
   const guint32_le *bloom_words;
   guint32 n_bloom_words;
@@ -96,6 +98,7 @@ gvdb_table_setup_root (GvdbTable                 *file,
 
   n_bloom_words = guint32_from_le (header->n_bloom_words);
   n_buckets = guint32_from_le (header->n_buckets);
+  file->bloom_shift = n_bloom_words >> 27;
   n_bloom_words &= (1u << 27) - 1;
 
   if G_UNLIKELY (n_bloom_words * sizeof (guint32_le) > size)
@@ -141,6 +144,7 @@ gvdb_table_new_from_bytes (GBytes    *bytes,
 {
   const struct gvdb_header *header;
   GvdbTable *file;
+  guint32 version;
 
   file = g_slice_new0 (GvdbTable);
   file->bytes = g_bytes_ref (bytes);
@@ -151,20 +155,34 @@ gvdb_table_new_from_bytes (GBytes    *bytes,
     goto invalid;
 
   header = (gpointer) file->data;
+  version = guint32_from_le (header->version);
 
   if (header->signature[0] == GVDB_SIGNATURE0 &&
-      header->signature[1] == GVDB_SIGNATURE1 &&
-      guint32_from_le (header->version) == 0)
+      header->signature[1] == GVDB_SIGNATURE1)
     file->byteswapped = FALSE;
 
   else if (header->signature[0] == GVDB_SWAPPED_SIGNATURE0 &&
-           header->signature[1] == GVDB_SWAPPED_SIGNATURE1 &&
-           guint32_from_le (header->version) == 0)
+           header->signature[1] == GVDB_SWAPPED_SIGNATURE1)
     file->byteswapped = TRUE;
 
   else
     goto invalid;
 
+  if (version == 0)
+    file->hash_type = GVDB_HASH_DJB;
+
+  else if (version == 1)
+    {
+      file->hash_type = guint32_from_le (header->options) & GVDB_OPTIONS_HASH_MASK;
+
+      if (file->hash_type != GVDB_HASH_DJB &&
+          file->hash_type != GVDB_HASH_XXH32)
+        goto invalid;
+    }
+
+  else
+    goto invalid;
+
   gvdb_table_setup_root (file, &header->root);
 
   return file;
@@ -265,17 +283,18 @@ gvdb_table_lookup (GvdbTable   *file,
                    const gchar *key,
                    gchar        type)
 {
-  guint32 hash_value = 5381;
+  guint32 hash_value;
   guint key_length;
   guint32 bucket;
   guint32 lastno;
   guint32 itemno;
 
-  if G_UNLIKELY (file->n_buckets == 0 || file->n_hash_items == 0)
+  if G_UNLIKELY (file->n_buckets == 0 || file->n_hash_items == 0 ||
+                 file->uint_keys)
     return NULL;
 
-  for (key_length = 0; key[key_length]; key_length++)
-    hash_value = (hash_value * 33) + ((signed char *) key)[key_length];
+  key_length = strlen (key);
+  hash_value = gvdb_hash (file->hash_type, key, key_length);
 
   if (!gvdb_table_bloom_filter (file, hash_value))
     return NULL;
@@ -302,6 +321,45 @@ gvdb_table_lookup (GvdbTable   *file,
   return NULL;
 }
 
+/* In tables with integer keys the key is stored as the hash value,
+ * and there is no key string.
+ */
+static const struct gvdb_hash_item *
+gvdb_table_lookup_uint (GvdbTable *file,
+                        guint32    key,
+                        gchar      type)
+{
+  guint32 bucket;
+  guint32 lastno;
+  guint32 itemno;
+
+  if G_UNLIKELY (file->n_buckets == 0 || file->n_hash_items == 0 ||
+                 !file->uint_keys)
+    return NULL;
+
+  if (!gvdb_table_bloom_filter (file, key))
+    return NULL;
+
+  bucket = key % file->n_buckets;
+  itemno = guint32_from_le (file->hash_buckets[bucket]);
+
+  if (bucket == file->n_buckets - 1 ||
+      (lastno = guint32_from_le(file->hash_buckets[bucket + 1])) > file->n_hash_items)
+    lastno = file->n_hash_items;
+
+  while G_LIKELY (itemno < lastno)
+    {
+      struct gvdb_hash_item *item = &file->hash_items[itemno];
+
+      if (key == guint32_from_le (item->hash_value) && item->type == type)
+        return item;
+
+      itemno++;
+    }
+
+  return NULL;
+}
+
 static gboolean
 gvdb_table_list_from_item (GvdbTable                    *table,
                            const struct gvdb_hash_item  *item,
@@ -470,6 +528,49 @@ gvdb_table_get_names (GvdbTable *table,
   return names;
 }
 
+/**
+ * gvdb_table_get_uint_names:
+ * @table: a #GvdbTable with integer keys
+ * @length: the number of items returned, or %NULL
+ *
+ * Gets a list of all keys contained in @table, which must have been
+ * written with gvdb_hash_table_insert_uint().
+ *
+ * Returns: a 0-terminated array of keys, of length @length
+ **/
+guint32 *
+gvdb_table_get_uint_names (GvdbTable *table,
+                           gint      *length)
+{
+  guint32 *names;
+  gint n_names = 0;
+  guint32 i;
+
+  names = g_new (guint32, table->n_hash_items + 1);
+
+  if (table->uint_keys)
+    for (i = 0; i < table->n_hash_items; i++)
+      names[n_names++] = guint32_from_le (table->hash_items[i].hash_value);
+
+  names[n_names] = 0;
+
+  if (length)
+    *length = n_names;
+
+  return names;
+}
+
+/**
+ * gvdb_table_has_uint_keys:
+ * @table: a #GvdbTable
+ * @returns: %TRUE if the keys of @table are integers
+ **/
+gboolean
+gvdb_table_has_uint_keys (GvdbTable *table)
+{
+  return table->uint_keys;
+}
+
 /**
  * gvdb_table_list:
  * @file: a #GvdbTable
@@ -548,7 +649,7 @@ gboolean
 gvdb_table_has_value (GvdbTable    *file,
                       const gchar  *key)
 {
-  static const struct gvdb_hash_item *item;
+  const struct gvdb_hash_item *item;
   gsize size;
 
   item = gvdb_table_lookup (file, key, 'v');
@@ -582,6 +683,27 @@ gvdb_table_value_from_item (GvdbTable                   *table,
   return value;
 }
 
+/* Like gvdb_table_value_from_item(), in host byte order */
+static GVariant *
+gvdb_table_native_value_from_item (GvdbTable                   *file,
+                                   const struct gvdb_hash_item *item)
+{
+  GVariant *value;
+
+  value = gvdb_table_value_from_item (file, item);
+
+  if (value && file->byteswapped)
+    {
+      GVariant *tmp;
+
+      tmp = g_variant_byteswap (value);
+      g_variant_unref (value);
+      value = tmp;
+    }
+
+  return value;
+}
+
 /**
  * gvdb_table_get_value:
  * @file: a #GvdbTable
@@ -602,23 +724,117 @@ gvdb_table_get_value (GvdbTable    *file,
                       const gchar  *key)
 {
   const struct gvdb_hash_item *item;
-  GVariant *value;
 
   if ((item = gvdb_table_lookup (file, key, 'v')) == NULL)
     return NULL;
 
-  value = gvdb_table_value_from_item (file, item);
+  return gvdb_table_native_value_from_item (file, item);
+}
 
-  if (value && file->byteswapped)
-    {
-      GVariant *tmp;
+/**
+ * gvdb_table_get_value_uint:
+ * @file: a #GvdbTable with integer keys
+ * @key: an integer key
+ * @returns: a #GVariant, or %NULL
+ *
+ * Like gvdb_table_get_value(), for tables written with
+ * gvdb_hash_table_insert_uint().
+ **/
+GVariant *
+gvdb_table_get_value_uint (GvdbTable *file,
+                           guint32    key)
+{
+  const struct gvdb_hash_item *item;
 
-      tmp = g_variant_byteswap (value);
-      g_variant_unref (value);
-      value = tmp;
-    }
+  if ((item = gvdb_table_lookup_uint (file, key, 'v')) == NULL)
+    return NULL;
 
-  return value;
+  return gvdb_table_native_value_from_item (file, item);
+}
+
+/**
+ * gvdb_table_get_raw_data_uint:
+ * @file: a #GvdbTable with integer keys
+ * @key: an integer key
+ * @size: return location for the size of the data
+ * @returns: a pointer to the serialised value, or %NULL
+ *
+ * Looks up a value named @key in @file and returns its serialised
+ * form, which is that of a "v" #GVariant, in the byte order of the
+ * file (see gvdb_table_is_byteswapped()).
+ *
+ * The data points into the storage of @file and is only valid for
+ * as long as @file is.  Nothing is allocated, so this is suitable
+ * for callers that want to parse values in place.
+ **/
+gconstpointer
+gvdb_table_get_raw_data_uint (GvdbTable *file,
+                              guint32    key,
+                              gsize     *size)
+{
+  const struct gvdb_hash_item *item;
+
+  if ((item = gvdb_table_lookup_uint (file, key, 'v')) == NULL)
+    return NULL;
+
+  return gvdb_table_dereference (file, &item->value.pointer, 8, size);
+}
+
+/**
+ * gvdb_table_get_raw_data:
+ * @file: a #GvdbTable
+ * @key: a string
+ * @size: return location for the size of the data
+ * @returns: a pointer to the serialised value, or %NULL
+ *
+ * Like gvdb_table_get_raw_data_uint(), for string keys.
+ **/
+gconstpointer
+gvdb_table_get_raw_data (GvdbTable   *file,
+                         const gchar *key,
+                         gsize       *size)
+{
+  const struct gvdb_hash_item *item;
+
+  if ((item = gvdb_table_lookup (file, key, 'v')) == NULL)
+    return NULL;
+
+  return gvdb_table_dereference (file, &item->value.pointer, 8, size);
+}
+
+/**
+ * gvdb_table_is_byteswapped:
+ * @file: a #GvdbTable
+ * @returns: %TRUE if @file is not in host byte order
+ **/
+gboolean
+gvdb_table_is_byteswapped (GvdbTable *file)
+{
+  return file->byteswapped;
+}
+
+/**
+ * gvdb_table_has_value_uint:
+ * @file: a #GvdbTable with integer keys
+ * @key: an integer key
+ * @returns: %TRUE if @key is in the table
+ *
+ * Like gvdb_table_has_value(), for tables written with
+ * gvdb_hash_table_insert_uint().
+ **/
+gboolean
+gvdb_table_has_value_uint (GvdbTable *file,
+                           guint32    key)
+{
+  const struct gvdb_hash_item *item;
+  gsize size;
+
+  item = gvdb_table_lookup_uint (file, key, 'v');
+
+  if (item == NULL)
+    return FALSE;
+
+  return gvdb_table_dereference (file, &item->value.pointer, 8, &size) != NULL;
 }
 
 /**
@@ -668,10 +884,17 @@ gvdb_table_get_table (GvdbTable   *file,
                       const gchar *key)
 {
   const struct gvdb_hash_item *item;
+  gboolean uint_keys = FALSE;
   GvdbTable *new;
 
   item = gvdb_table_lookup (file, key, 'H');
 
+  if (item == NULL)
+    {
+      item = gvdb_table_lookup (file, key, 'I');
+      uint_keys = TRUE;
+    }
+
   if (item == NULL)
     return NULL;
 
@@ -679,6 +902,8 @@ gvdb_table_get_table (GvdbTable   *file,
   new->bytes = g_bytes_ref (file->bytes);
   new->byteswapped = file->byteswapped;
   new->trusted = file->trusted;
+  new->uint_keys = uint_keys;
+  new->hash_type = file->hash_type;
   new->data = file->data;
   new->size = file->size;
 
@@ -40,6 +40,11 @@ G_GNUC_INTERNAL
 gchar **                gvdb_table_get_names                            (GvdbTable    *table,
                                                                          gint         *length);
 G_GNUC_INTERNAL
+guint32 *               gvdb_table_get_uint_names                       (GvdbTable    *table,
+                                                                         gint         *length);
+G_GNUC_INTERNAL
+gboolean                gvdb_table_has_uint_keys                        (GvdbTable    *table);
+G_GNUC_INTERNAL
 gchar **                gvdb_table_list                                 (GvdbTable    *table,
                                                                          const gchar  *key);
 G_GNUC_INTERNAL
@@ -51,11 +56,28 @@ GVariant *              gvdb_table_get_raw_value                        (GvdbTab
 G_GNUC_INTERNAL
 GVariant *              gvdb_table_get_value                            (GvdbTable    *table,
                                                                          const gchar  *key);
+G_GNUC_INTERNAL
+GVariant *              gvdb_table_get_value_uint                       (GvdbTable    *table,
+                                                                         guint32       key);
+
+G_GNUC_INTERNAL
+gconstpointer           gvdb_table_get_raw_data                         (GvdbTable    *table,
+                                                                         const gchar  *key,
+                                                                         gsize        *size);
+G_GNUC_INTERNAL
+gconstpointer           gvdb_table_get_raw_data_uint                    (GvdbTable    *table,
+                                                                         guint32       key,
+                                                                         gsize        *size);
+G_GNUC_INTERNAL
+gboolean                gvdb_table_is_byteswapped                       (GvdbTable    *table);
 
 G_GNUC_INTERNAL
 gboolean                gvdb_table_has_value                            (GvdbTable    *table,
                                                                          const gchar  *key);
 G_GNUC_INTERNAL
+gboolean                gvdb_table_has_value_uint                       (GvdbTable    *table,
+                                                                         guint32       key);
+G_GNUC_INTERNAL
 gboolean                gvdb_table_is_valid                             (GvdbTable    *table);
 
 G_END_DECLS
@@ -29,7 +29,7 @@ do_add_local (int argc, char *argv[])
 
   if (argc < 1)
     {
-      g_printerr ("Usage: xdp add FILE [APPID]\n");
+      g_printerr ("Usage: xdp add-local FILE [APPID]\n");
       return 1;
     }
 
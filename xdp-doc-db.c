@@ -1,6 +1,9 @@
 #include "config.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <glib/gprintf.h>
 #include <gio/gio.h>
 
@@ -8,29 +11,163 @@
 #include "gvdb/gvdb-builder.h"
 
 #include "xdp-doc-db.h"
-
-struct _XdpDocDb {
-  GObject parent;
-  GVariant *no_doc;
-
-  char *filename;
+#include "xdp-metrics.h"
+
+#define CHANGE_RING_SIZE 4096
+
+/* Most fuse lookups of unknown names, and permission checks for apps
+   with no docs, are misses. The bloom filter answers those without
+   walking the hash chains. */
+#define BLOOM_FALSE_POSITIVE_RATE 0.01
+
+/* Docs are spread over this many files by the low bits of their id,
+   so that a save only rewrites the shards that have changed docs */
+#define N_DOC_SHARDS 16
+
+/* The dirs no doc refers to anymore are dropped when the dirs table
+   has doubled since it was last pruned, and has at least this many */
+#define DIRS_PRUNE_MIN 64
+
+/* Docs are stored in the files as (dir id, uri relative to the dir,
+   permissions), with the dir uris (up to and including the last
+   slash) in a table of their own. Dir id 0 means the uri is stored
+   whole. The permissions refer to the apps by their numeric id. Docs
+   in memory, and in files from before this, are (uri, permissions). */
+#define STORED_DOC_TYPE "(usa(uu))"
+#define DOC_TYPE "(sa(su))"
+
+/* The numeric ids of the apps, which the stored docs and the fuse
+   inodes refer to the apps by. They are saved in the manifest, id N
+   being the N:th app id, and never reused. This is the immutable
+   table of the ids in a file; ids given out since are in the
+   snapshot overlays. */
+typedef struct {
+  gint ref_count;
+  GHashTable *nums;
+  GPtrArray *names;
+} XdpAppNums;
+
+/* One of the files the db is stored in, and the table in it. The
+   uris file also has the keys of the table in sorted order, for
+   prefix queries. */
+typedef struct {
+  char *name;
   GvdbTable *gvdb;
-
-  /* Map document id => GVariant (uri, title, array[(appid, perms)]) */
-  GvdbTable *doc_table;
+  GvdbTable *table;
+  GVariant *sorted_keys;
+} XdpDocDbPart;
+
+/* The on-disk part of a snapshot, shared by all the snapshots made
+   between two saves. The main file is a manifest naming the files
+   with the doc shards and the app, uri and dir tables, which live
+   next to it. Old style main files have all the tables in
+   themselves. */
+typedef struct {
+  gint ref_count;
+  GvdbTable *gvdb;
+  XdpAppNums *app_nums;
+  /* Set if apps from before the numeric ids were given one on load */
+  gboolean new_app_nums;
+  guint n_doc_shards;
+  XdpDocDbPart *doc_shards;
+  XdpDocDbPart apps;
+  XdpDocDbPart uris;
+  XdpDocDbPart dirs;
+  /* The dirs in the dirs table, and how many of them were in use when
+     it was last pruned */
+  guint32 n_dirs;
+  guint32 n_live_dirs;
+} XdpDocDbFile;
+
+/* An immutable version of the db contents. Readers grab a ref to the
+   current snapshot without taking any lock, and can keep using it
+   even if a new one is published meanwhile.
+
+   The overlays of changes since the file are split in levels: a
+   snapshot only has the changes made since its parent, and falls
+   back to the parent for the rest, so a write doesn't copy what it
+   doesn't change. Levels are merged on publish when the newest one
+   gets to half the size of the one below, which keeps the chain
+   logarithmic in the number of changes and copies each change a
+   logarithmic number of times. */
+typedef struct _XdpDocDbSnapshot XdpDocDbSnapshot;
+struct _XdpDocDbSnapshot {
+  gint ref_count;
+  XdpDocDbFile *file;
+  XdpDocDbSnapshot *parent;
+
+  /* Map document id (as an integer) => GVariant (uri, title, array[(appid, perms)]) */
   GHashTable *doc_updates;
 
   /* (reverse) Map app id => [ document id ]*/
-  GvdbTable *app_table;
   GHashTable *app_updates;
 
   /* (reverse) Map uri (with no title) => [ document id ]*/
-  GvdbTable *uri_table;
   GHashTable *uri_updates;
 
+  /* The numeric ids given out since the file, app id => u and
+     numeric id (as an integer) => s. n_app_nums counts all ids. */
+  GHashTable *app_num_updates;
+  GHashTable *app_name_updates;
+  guint32 n_app_nums;
+};
+
+#define DOC_UPDATES G_STRUCT_OFFSET (XdpDocDbSnapshot, doc_updates)
+#define APP_UPDATES G_STRUCT_OFFSET (XdpDocDbSnapshot, app_updates)
+#define URI_UPDATES G_STRUCT_OFFSET (XdpDocDbSnapshot, uri_updates)
+#define APP_NUM_UPDATES G_STRUCT_OFFSET (XdpDocDbSnapshot, app_num_updates)
+#define APP_NAME_UPDATES G_STRUCT_OFFSET (XdpDocDbSnapshot, app_name_updates)
+
+/* The db is used both from the dbus thread, which does all the
+   changes, and from the fuse thread, which only reads. Readers use
+   the published snapshot. Writers serialize on write_lock, and make
+   their changes to a private copy of the snapshot (next), which is
+   published when the change (or transaction) is done. The _unlocked
+   functions expect the caller to hold write_lock.
+
+   A replaced snapshot is only unreffed once no reader can still be
+   about to ref it. Readers count themselves in n_readers of the
+   epoch they start in, and what is replaced in an epoch is kept in
+   retired until the readers of that epoch are gone. */
+struct _XdpDocDb {
+  GObject parent;
+
+  char *filename;
+
+  XdpDocDbSnapshot *snapshot;
+  gint reader_epoch;
+  gint n_readers[2];
+  GPtrArray *retired[2];
+
+  GMutex write_lock;
+  XdpDocDbSnapshot *next;
+
+  /* While in a transaction, the app reverse map is not updated
+     directly, instead we collect app id => (doc id => added) and
+     rewrite each app once on commit */
+  int transaction_depth;
+  GHashTable *pending_app_docs;
+
+  /* Bumped for every change and stored in the db. The doc changed
+     in generation N is at change_ring[N % CHANGE_RING_SIZE], for
+     the generations after change_ring_base that still fit. */
+  guint64 generation;
+  guint64 change_ring_base;
+  guint32 change_ring[CHANGE_RING_SIZE];
+
   gboolean dirty;
 };
 
+enum {
+  DOC_CHANGED,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+/* Stored in doc_updates for deleted docs */
+static GVariant *no_doc = NULL;
+
 G_DEFINE_TYPE(XdpDocDb, xdp_doc_db, G_TYPE_OBJECT)
 
 static GVariant *
@@ -40,20 +177,18 @@ xdp_doc_new (const char *uri,
   return g_variant_new ("(&s@a(su))", uri, permissions);
 }
 
+/* The prefix of the uris of all the files inside the directory
+   @path, escaped the same way as the uris of docs */
 char *
-xdp_doc_dup_basename (GVariant *doc)
+xdp_doc_dir_uri_prefix (const char *path)
 {
-  g_autoptr(GFile) file = g_file_new_for_uri (xdp_doc_get_uri (doc));
-
-  return g_file_get_basename (file);
-}
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autofree char *uri = g_file_get_uri (file);
 
-char *
-xdp_doc_dup_dirname (GVariant *doc)
-{
-  g_autofree char *path = xdp_doc_dup_path (doc);
+  if (g_str_has_suffix (uri, "/"))
+    return g_steal_pointer (&uri);
 
-  return g_path_get_dirname (path);
+  return g_strconcat (uri, "/", NULL);
 }
 
 guint32
@@ -68,6 +203,117 @@ xdb_doc_name_from_id (guint32 doc_id)
   return g_strdup_printf ("%x", doc_id);
 }
 
+/* The decoded path of a document never changes for a given uri, so
+   it is kept in a cache of the most recently used uris. Each thread
+   has its own cache, so lookups don't lock. Entries are refcounted:
+   views hold a ref to the entry they got their strings from, so the
+   strings stay valid until the view is cleared even if the entry is
+   evicted meanwhile. */
+#define DOC_PATH_CACHE_SIZE 4096
+
+typedef struct {
+  gint ref_count;
+  GList link;
+  char *uri;
+  char *path;
+  char *basename;
+  char *dirname;
+} XdpDocPath;
+
+typedef struct {
+  GHashTable *paths;
+  /* Most recently used first */
+  GQueue lru;
+} XdpDocPathCache;
+
+static void xdp_doc_path_cache_free (gpointer data);
+
+static GPrivate doc_path_cache = G_PRIVATE_INIT (xdp_doc_path_cache_free);
+
+static XdpDocPath *
+xdp_doc_path_ref (XdpDocPath *doc_path)
+{
+  g_atomic_int_inc (&doc_path->ref_count);
+  return doc_path;
+}
+
+static void
+xdp_doc_path_unref (XdpDocPath *doc_path)
+{
+  if (!g_atomic_int_dec_and_test (&doc_path->ref_count))
+    return;
+
+  g_free (doc_path->uri);
+  g_free (doc_path->path);
+  g_free (doc_path->basename);
+  g_free (doc_path->dirname);
+  g_free (doc_path);
+}
+
+static void
+xdp_doc_path_cache_free (gpointer data)
+{
+  XdpDocPathCache *cache = data;
+  XdpDocPath *doc_path;
+
+  while ((doc_path = g_queue_peek_head (&cache->lru)) != NULL)
+    {
+      g_queue_unlink (&cache->lru, &doc_path->link);
+      xdp_doc_path_unref (doc_path);
+    }
+
+  g_hash_table_unref (cache->paths);
+  g_free (cache);
+}
+
+/* Returns a new ref */
+static XdpDocPath *
+xdp_doc_get_doc_path (const char *uri)
+{
+  XdpDocPathCache *cache = g_private_get (&doc_path_cache);
+  XdpDocPath *doc_path;
+
+  if (cache == NULL)
+    {
+      cache = g_new0 (XdpDocPathCache, 1);
+      cache->paths = g_hash_table_new (g_str_hash, g_str_equal);
+      g_queue_init (&cache->lru);
+      g_private_set (&doc_path_cache, cache);
+    }
+
+  doc_path = g_hash_table_lookup (cache->paths, uri);
+  if (doc_path != NULL)
+    g_queue_unlink (&cache->lru, &doc_path->link);
+  else
+    {
+      g_autoptr(GFile) file = g_file_new_for_uri (uri);
+
+      if (cache->lru.length >= DOC_PATH_CACHE_SIZE)
+        {
+          XdpDocPath *oldest = g_queue_peek_tail (&cache->lru);
+
+          g_queue_unlink (&cache->lru, &oldest->link);
+          g_hash_table_remove (cache->paths, oldest->uri);
+          xdp_doc_path_unref (oldest);
+        }
+
+      doc_path = g_new0 (XdpDocPath, 1);
+      doc_path->ref_count = 1;
+      doc_path->link.data = doc_path;
+      doc_path->uri = g_strdup (uri);
+      doc_path->path = g_file_get_path (file);
+      doc_path->basename = g_file_get_basename (file);
+      if (doc_path->path)
+        doc_path->dirname = g_path_get_dirname (doc_path->path);
+
+      g_hash_table_insert (cache->paths, doc_path->uri, doc_path);
+    }
+
+  g_queue_push_head_link (&cache->lru, &doc_path->link);
+
+  return xdp_doc_path_ref (doc_path);
+}
+
 char *
 xdp_doc_dup_path (GVariant *doc)
 {
@@ -85,404 +331,2213 @@ xdp_doc_get_uri (GVariant *doc)
   return res;
 }
 
-static void
-xdp_doc_db_finalize (GObject *object)
+static XdpAppNums *
+xdp_app_nums_new (void)
 {
-  XdpDocDb *db = (XdpDocDb *)object;
-
-  g_clear_pointer (&db->filename, g_free);
-  g_clear_pointer (&db->no_doc, g_variant_unref);
+  XdpAppNums *app_nums = g_new0 (XdpAppNums, 1);
 
-  g_clear_pointer (&db->gvdb, gvdb_table_free);
-  g_clear_pointer (&db->doc_table, gvdb_table_free);
-  g_clear_pointer (&db->app_table, gvdb_table_free);
-  g_clear_pointer (&db->uri_table, gvdb_table_free);
+  app_nums->ref_count = 1;
+  app_nums->nums = g_hash_table_new (g_str_hash, g_str_equal);
+  app_nums->names = g_ptr_array_new_with_free_func (g_free);
 
-  g_clear_pointer (&db->doc_updates, g_hash_table_unref);
-  g_clear_pointer (&db->app_updates, g_hash_table_unref);
-  g_clear_pointer (&db->uri_updates, g_hash_table_unref);
-
-  G_OBJECT_CLASS (xdp_doc_db_parent_class)->finalize (object);
+  return app_nums;
 }
 
+/* Gives @name the next id. Only while loading, the table is
+   immutable once in a file. */
 static void
-xdp_doc_db_class_init (XdpDocDbClass *klass)
+xdp_app_nums_append (XdpAppNums *app_nums,
+                     const char *name)
 {
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  char *myname = g_strdup (name);
 
-  object_class->finalize = xdp_doc_db_finalize;
+  g_ptr_array_add (app_nums->names, myname);
+  g_hash_table_insert (app_nums->nums, myname,
+                       GUINT_TO_POINTER (app_nums->names->len));
 }
 
 static void
-xdp_doc_db_init (XdpDocDb *db)
+xdp_app_nums_unref (XdpAppNums *app_nums)
 {
-  db->no_doc =  xdp_doc_new ("NONE",
-                             g_variant_new_array (G_VARIANT_TYPE ("(su)"), NULL, 0));
+  if (!g_atomic_int_dec_and_test (&app_nums->ref_count))
+    return;
+
+  g_hash_table_unref (app_nums->nums);
+  g_ptr_array_unref (app_nums->names);
+  g_free (app_nums);
 }
 
-XdpDocDb *
-xdp_doc_db_new (const char *filename,
-                GError **error)
+/* Returns 0 if the app has no id in the table */
+static guint32
+xdp_app_nums_get_num (XdpAppNums *app_nums,
+                      const char *app_id)
 {
-  XdpDocDb *db = g_object_new (XDP_TYPE_DOC_DB, NULL);
-  GvdbTable *gvdb;
-  GError *my_error = NULL;
-
-  gvdb = gvdb_table_new (filename, TRUE, &my_error);
-  if (gvdb == NULL)
-    {
-      if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
-        g_error_free (my_error);
-      else
-        {
-          g_propagate_error (error, my_error);
-          return NULL;
-        }
-    }
-
-  db->filename = g_strdup (filename);
-  db->gvdb = gvdb;
-
-  if (gvdb)
-    {
-      db->doc_table = gvdb_table_get_table (gvdb, "docs");
-      db->app_table = gvdb_table_get_table (gvdb, "apps");
-      db->uri_table = gvdb_table_get_table (gvdb, "uris");
-    }
+  return GPOINTER_TO_UINT (g_hash_table_lookup (app_nums->nums, app_id));
+}
 
-  db->doc_updates =
-    g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify)g_variant_unref);
-  db->app_updates =
-    g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify)g_variant_unref);
-  db->uri_updates =
-    g_hash_table_new_full (g_str_hash, g_str_equal,
-                           g_free, (GDestroyNotify)g_variant_unref);
+static const char *
+xdp_app_nums_get_name (XdpAppNums *app_nums,
+                       guint32 num)
+{
+  if (num == 0 || num > app_nums->names->len)
+    return NULL;
 
-  return db;
+  return g_ptr_array_index (app_nums->names, num - 1);
 }
 
-static gboolean
-uri_empty (GVariant *uri)
+static void
+xdp_doc_db_part_clear (XdpDocDbPart *part)
 {
-  g_autoptr(GVariant) doc_array = g_variant_get_child_value (uri, 0);
-  return g_variant_n_children (doc_array) == 0;
+  g_clear_pointer (&part->sorted_keys, g_variant_unref);
+  g_clear_pointer (&part->table, gvdb_table_free);
+  g_clear_pointer (&part->gvdb, gvdb_table_free);
+  g_clear_pointer (&part->name, g_free);
 }
 
 static gboolean
-app_empty (GVariant *app)
+xdp_doc_db_part_open (XdpDocDbPart *part,
+                      const char *dirname,
+                      const char *name,
+                      const char *table_name,
+                      GError **error)
 {
-  g_autoptr(GVariant) doc_array = g_variant_get_child_value (app, 0);
-  return g_variant_n_children (doc_array) == 0;
+  g_autofree char *path = g_build_filename (dirname, name, NULL);
+
+  part->name = g_strdup (name);
+  part->gvdb = gvdb_table_new (path, TRUE, error);
+  if (part->gvdb == NULL)
+    return FALSE;
+
+  part->table = gvdb_table_get_table (part->gvdb, table_name);
+
+  part->sorted_keys = gvdb_table_get_value (part->gvdb, "sorted-keys");
+  if (part->sorted_keys &&
+      !g_variant_is_of_type (part->sorted_keys, G_VARIANT_TYPE_STRING_ARRAY))
+    g_clear_pointer (&part->sorted_keys, g_variant_unref);
+
+  return TRUE;
 }
 
-gboolean
-xdp_doc_db_save (XdpDocDb *db,
-                 GError **error)
+static void
+xdp_doc_db_file_unref (XdpDocDbFile *file)
 {
-  GHashTable *root, *docs, *apps, *uris;
-  GvdbTable *gvdb;
-  guint32 *doc_ids;
-  char **keys;
-  int i;
-
-  root = gvdb_hash_table_new (NULL, NULL);
-  docs = gvdb_hash_table_new (root, "docs");
-  apps = gvdb_hash_table_new (root, "apps");
-  uris = gvdb_hash_table_new (root, "uris");
-  g_hash_table_unref (docs);
-  g_hash_table_unref (apps);
-  g_hash_table_unref (uris);
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&file->ref_count))
+    return;
+
+  for (i = 0; i < file->n_doc_shards; i++)
+    xdp_doc_db_part_clear (&file->doc_shards[i]);
+  g_free (file->doc_shards);
+  xdp_doc_db_part_clear (&file->apps);
+  xdp_doc_db_part_clear (&file->uris);
+  xdp_doc_db_part_clear (&file->dirs);
+  g_clear_pointer (&file->gvdb, gvdb_table_free);
+  xdp_app_nums_unref (file->app_nums);
+  g_free (file);
+}
 
-  doc_ids = xdp_doc_db_list_docs (db);
-  for (i = 0; doc_ids[i] != 0; i++)
+/* The ids saved in the manifest. Files from before the numeric ids
+   have none, their apps are given ids here. */
+static gboolean
+xdp_doc_db_file_load_app_nums (XdpDocDbFile *file,
+                               GError **error)
+{
+  g_autoptr(GVariant) names = NULL;
+  GVariantIter iter;
+  const char *name;
+  char **apps;
+  guint i;
+
+  /* Two apps with the same id, or an id at XDP_APP_NUM_MAX, would
+     mix up permissions and fuse dirs */
+  names = gvdb_table_get_value (file->gvdb, "app-ids");
+  if (names != NULL)
     {
-      g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, doc_ids[i]);
-      if (doc != NULL)
-        {
-          char id_num[9];
-          GvdbItem *item;
+      if (!g_variant_is_of_type (names, G_VARIANT_TYPE_STRING_ARRAY) ||
+          g_variant_n_children (names) >= XDP_APP_NUM_MAX)
+        goto invalid;
 
-          g_sprintf (id_num, "%x", (guint32)doc_ids[i]);
-          item = gvdb_hash_table_insert (docs, id_num);
-          gvdb_item_set_value (item, doc);
+      g_variant_iter_init (&iter, names);
+      while (g_variant_iter_next (&iter, "&s", &name))
+        {
+          if (xdp_app_nums_get_num (file->app_nums, name) != 0)
+            goto invalid;
+          xdp_app_nums_append (file->app_nums, name);
         }
+
+      return TRUE;
     }
-  g_free (doc_ids);
 
-  keys = xdp_doc_db_list_apps (db);
-  for (i = 0; keys[i] != NULL; i++)
+  if (file->apps.table == NULL)
+    return TRUE;
+
+  apps = gvdb_table_get_names (file->apps.table, NULL);
+  for (i = 0; apps[i] != NULL; i++)
     {
-      g_autoptr(GVariant) app = xdp_doc_db_lookup_app (db, keys[i]);
-      if (!app_empty (app))
+      if (xdp_app_nums_get_num (file->app_nums, apps[i]) != 0)
+        continue;
+
+      if (file->app_nums->names->len + 1 >= XDP_APP_NUM_MAX)
         {
-          GvdbItem *item = gvdb_hash_table_insert (apps, keys[i]);
-          gvdb_item_set_value (item, app);
+          g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_NOSPC,
+                       "No numeric id left for app %s", apps[i]);
+          g_strfreev (apps);
+          return FALSE;
         }
+
+      xdp_app_nums_append (file->app_nums, apps[i]);
+      file->new_app_nums = TRUE;
     }
-  g_strfreev (keys);
+  g_strfreev (apps);
 
-  keys = xdp_doc_db_list_uris (db);
-  for (i = 0; keys[i] != NULL; i++)
+  return TRUE;
+
+ invalid:
+  g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+               "Invalid app ids in doc db manifest");
+  return FALSE;
+}
+
+/* Takes ownership of gvdb, which may be NULL for a new db */
+static XdpDocDbFile *
+xdp_doc_db_file_new (const char *dirname,
+                     GvdbTable *gvdb,
+                     GError **error)
+{
+  XdpDocDbFile *file = g_new0 (XdpDocDbFile, 1);
+  g_autoptr(GVariant) shards = NULL;
+  g_autoptr(GVariant) apps = NULL;
+  g_autoptr(GVariant) uris = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  g_autoptr(GVariant) n_dirs = NULL;
+  g_autoptr(GVariant) n_live_dirs = NULL;
+  guint i;
+
+  file->ref_count = 1;
+  file->gvdb = gvdb;
+  file->app_nums = xdp_app_nums_new ();
+  if (gvdb == NULL)
+    return file;
+
+  shards = gvdb_table_get_value (gvdb, "doc-shards");
+  if (shards == NULL)
     {
-      g_autoptr(GVariant) uri = xdp_doc_db_lookup_uri (db, keys[i]);
-      if (!uri_empty (uri))
-        {
-          GvdbItem *item = gvdb_hash_table_insert (uris, keys[i]);
-          gvdb_item_set_value (item, uri);
-        }
+      /* Files from before the docs were sharded */
+      file->n_doc_shards = 1;
+      file->doc_shards = g_new0 (XdpDocDbPart, 1);
+      file->doc_shards[0].table = gvdb_table_get_table (gvdb, "docs");
+      file->apps.table = gvdb_table_get_table (gvdb, "apps");
+      file->uris.table = gvdb_table_get_table (gvdb, "uris");
+      goto done;
     }
-  g_strfreev (keys);
 
-  if (!gvdb_table_write_contents (root, db->filename, FALSE, error))
+  apps = gvdb_table_get_value (gvdb, "apps-file");
+  uris = gvdb_table_get_value (gvdb, "uris-file");
+  if (!g_variant_is_of_type (shards, G_VARIANT_TYPE_STRING_ARRAY) ||
+      g_variant_n_children (shards) == 0 ||
+      apps == NULL || !g_variant_is_of_type (apps, G_VARIANT_TYPE_STRING) ||
+      uris == NULL || !g_variant_is_of_type (uris, G_VARIANT_TYPE_STRING))
     {
-      g_hash_table_unref (root);
-      return FALSE;
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                   "Invalid doc db manifest");
+      goto fail;
     }
 
-  g_hash_table_unref (root);
+  file->n_doc_shards = g_variant_n_children (shards);
+  file->doc_shards = g_new0 (XdpDocDbPart, file->n_doc_shards);
+  for (i = 0; i < file->n_doc_shards; i++)
+    {
+      const char *name;
 
-  gvdb = gvdb_table_new (db->filename, TRUE, error);
-  if (gvdb == NULL)
-    return FALSE;
+      g_variant_get_child (shards, i, "&s", &name);
+      if (!xdp_doc_db_part_open (&file->doc_shards[i], dirname, name, "docs", error))
+        goto fail;
+    }
 
-  g_clear_pointer (&db->gvdb, gvdb_table_free);
-  g_clear_pointer (&db->doc_table, gvdb_table_free);
-  g_clear_pointer (&db->app_table, gvdb_table_free);
-  g_clear_pointer (&db->uri_table, gvdb_table_free);
+  if (!xdp_doc_db_part_open (&file->apps, dirname,
+                             g_variant_get_string (apps, NULL), "apps", error) ||
+      !xdp_doc_db_part_open (&file->uris, dirname,
+                             g_variant_get_string (uris, NULL), "uris", error))
+    goto fail;
+
+  /* Files from before the uris were split have no dirs */
+  dirs = gvdb_table_get_value (gvdb, "dirs-file");
+  if (dirs != NULL && g_variant_is_of_type (dirs, G_VARIANT_TYPE_STRING) &&
+      !xdp_doc_db_part_open (&file->dirs, dirname,
+                             g_variant_get_string (dirs, NULL), "dirs", error))
+    goto fail;
+
+  /* Files from before the dirs were pruned don't have the counts */
+  n_dirs = gvdb_table_get_value (gvdb, "n-dirs");
+  n_live_dirs = gvdb_table_get_value (gvdb, "n-live-dirs");
+  if (n_dirs != NULL && g_variant_is_of_type (n_dirs, G_VARIANT_TYPE_UINT32) &&
+      n_live_dirs != NULL && g_variant_is_of_type (n_live_dirs, G_VARIANT_TYPE_UINT32))
+    {
+      file->n_dirs = g_variant_get_uint32 (n_dirs);
+      file->n_live_dirs = g_variant_get_uint32 (n_live_dirs);
+    }
+  else if (file->dirs.table)
+    {
+      gint n;
+      g_autofree guint32 *ids = gvdb_table_get_uint_names (file->dirs.table, &n);
 
-  g_hash_table_remove_all (db->doc_updates);
-  g_hash_table_remove_all (db->app_updates);
-  g_hash_table_remove_all (db->uri_updates);
+      file->n_dirs = n;
+      file->n_live_dirs = n;
+    }
 
-  db->gvdb = gvdb;
-  db->doc_table = gvdb_table_get_table (gvdb, "docs");
-  db->app_table = gvdb_table_get_table (gvdb, "apps");
-  db->uri_table = gvdb_table_get_table (gvdb, "uris");
+ done:
+  if (!xdp_doc_db_file_load_app_nums (file, error))
+    goto fail;
 
-  db->dirty = FALSE;
+  return file;
 
-  return TRUE;
+ fail:
+  xdp_doc_db_file_unref (file);
+  return NULL;
 }
 
-gboolean
-xdp_doc_db_is_dirty (XdpDocDb *db)
+static XdpDocDbFile *
+xdp_doc_db_file_ref (XdpDocDbFile *file)
 {
-  return db->dirty;
+  g_atomic_int_inc (&file->ref_count);
+  return file;
 }
 
-void
-xdp_doc_db_dump (XdpDocDb *db)
+static GvdbTable *
+xdp_doc_db_file_get_doc_table (XdpDocDbFile *file,
+                               guint32 doc_id)
 {
-  int i;
-  guint32 *docs;
-  char **apps, **uris;
+  if (file->n_doc_shards == 0)
+    return NULL;
 
-  g_print ("docs:\n");
-  docs = xdp_doc_db_list_docs (db);
-  for (i = 0; docs[i] != 0; i++)
-    {
-      g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, docs[i]);
-      if (doc)
-        g_print (" %x: %s\n", docs[i], g_variant_print (doc, FALSE));
-    }
-  g_free (docs);
+  return file->doc_shards[doc_id % file->n_doc_shards].table;
+}
 
-  g_print ("apps:\n");
-  apps = xdp_doc_db_list_apps (db);
-  for (i = 0; apps[i] != NULL; i++)
-    {
-      g_autoptr(GVariant) app = xdp_doc_db_lookup_app (db, apps[i]);
-      g_print (" %s: %s\n", apps[i], g_variant_print (app, FALSE));
-    }
-  g_strfreev (apps);
+/* Returns the uri of a dir, pointing into the file. The value is a
+   string in a variant: the string, its nul, a nul and "s". */
+static const char *
+xdp_doc_db_file_lookup_dir (XdpDocDbFile *file,
+                            guint32 dir_id)
+{
+  const char *data;
+  gsize size;
 
-  g_print ("uris:\n");
-  uris = xdp_doc_db_list_apps (db);
-  for (i = 0; apps[i] != NULL; i++)
-    {
-      g_autoptr(GVariant) uri = xdp_doc_db_lookup_uri (db, uris[i]);
-      g_print (" %s: %s\n", uris[i], g_variant_print (uri, FALSE));
-    }
-  g_strfreev (uris);
+  if (file->dirs.table == NULL)
+    return NULL;
+
+  data = gvdb_table_get_raw_data_uint (file->dirs.table, dir_id, &size);
+  if (data == NULL || size < 3 ||
+      data[size - 1] != 's' || data[size - 2] != 0 || data[size - 3] != 0)
+    return NULL;
+
+  return data;
 }
 
-GVariant *
-xdp_doc_db_lookup_doc_name (XdpDocDb *db, const char *doc_id)
+/* Turns a doc as stored in the file into the in-memory form */
+static GVariant *
+xdp_doc_db_file_decode_doc (XdpDocDbFile *file,
+                            GVariant *stored)
 {
-  GVariant *res;
+  g_autoptr(GVariant) stored_perms = NULL;
+  g_autofree char *uri = NULL;
+  const char *name, *dir, *app_id;
+  GVariantBuilder perms;
+  GVariantIter iter;
+  guint32 dir_id, num, app_perms;
 
-  res = g_hash_table_lookup (db->doc_updates, doc_id);
-  if (res)
+  if (!g_variant_is_of_type (stored, G_VARIANT_TYPE (STORED_DOC_TYPE)))
+    return stored;
+
+  g_variant_get (stored, "(u&s@a(uu))", &dir_id, &name, &stored_perms);
+
+  g_variant_builder_init (&perms, G_VARIANT_TYPE ("a(su)"));
+  g_variant_iter_init (&iter, stored_perms);
+  while (g_variant_iter_next (&iter, "(uu)", &num, &app_perms))
     {
-      if (res == db->no_doc)
-        return NULL;
-      return g_variant_ref (res);
+      app_id = xdp_app_nums_get_name (file->app_nums, num);
+      if (app_id == NULL)
+        g_warning ("Doc refers to unknown app %u", num);
+      else
+        g_variant_builder_add (&perms, "(&su)", app_id, app_perms);
     }
 
-  if (db->doc_table)
+  if (dir_id == 0)
+    dir = "";
+  else
+    dir = xdp_doc_db_file_lookup_dir (file, dir_id);
+
+  if (dir == NULL)
     {
-      res = gvdb_table_get_value (db->doc_table, doc_id);
-      if (res)
-        return g_variant_ref (res);
+      g_warning ("Doc refers to unknown dir %x", dir_id);
+      g_variant_builder_clear (&perms);
+      g_variant_unref (stored);
+      return NULL;
     }
 
-  return NULL;
+  uri = g_strconcat (dir, name, NULL);
+  g_variant_unref (stored);
+
+  return g_variant_ref_sink (xdp_doc_new (uri, g_variant_builder_end (&perms)));
 }
 
-GVariant *
-xdp_doc_db_lookup_doc (XdpDocDb            *db,
-                       guint32              doc_id)
+static GHashTable *
+updates_new (void)
 {
-  char id_num[9];
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify)g_variant_unref);
+}
 
-  g_sprintf (id_num, "%x", (guint32)doc_id);
-  return xdp_doc_db_lookup_doc_name (db, id_num);
+/* The doc and app name overlays are keyed by integers */
+static GHashTable *
+doc_updates_new (void)
+{
+  return g_hash_table_new_full (NULL, NULL,
+                                NULL, (GDestroyNotify)g_variant_unref);
 }
 
-guint32 *
-xdp_doc_db_list_docs (XdpDocDb *db)
+static gboolean
+updates_have_uint_keys (glong table_offset)
+{
+  return table_offset == DOC_UPDATES || table_offset == APP_NAME_UPDATES;
+}
+
+/* Adds the entries of @src to @dest, replacing those with the same
+   key. The values are immutable and shared. */
+static void
+updates_merge (GHashTable *dest,
+               GHashTable *src,
+               glong table_offset)
 {
   GHashTableIter iter;
   gpointer key, value;
-  GArray *res;
 
-  res = g_array_new (TRUE, FALSE, sizeof (guint32));
-
-  g_hash_table_iter_init (&iter, db->doc_updates);
+  g_hash_table_iter_init (&iter, src);
   while (g_hash_table_iter_next (&iter, &key, &value))
-    {
-      guint32 doc_id = xdb_doc_id_from_name (key);
-      g_array_append_val (res, doc_id);
-    }
-
-  if (db->doc_table)
-    {
-      char **table_docs = gvdb_table_get_names (db->doc_table, NULL);
-      int i;
-
-      for (i = 0; table_docs[i] != NULL; i++)
-        {
-          char *doc = table_docs[i];
+    g_hash_table_insert (dest,
+                         updates_have_uint_keys (table_offset) ? key : g_strdup (key),
+                         g_variant_ref (value));
+}
 
-          if (g_hash_table_lookup (db->doc_updates, doc) == NULL)
-            {
-              guint32 doc_id = xdb_doc_id_from_name (doc);
-              g_array_append_val (res, doc_id);
-            }
-        }
-      g_strfreev (table_docs);
-    }
+static XdpDocDbSnapshot *
+xdp_doc_db_snapshot_new (XdpDocDbFile *file)
+{
+  XdpDocDbSnapshot *snapshot = g_new0 (XdpDocDbSnapshot, 1);
+
+  snapshot->ref_count = 1;
+  snapshot->file = file;
+  snapshot->doc_updates = doc_updates_new ();
+  snapshot->app_updates = updates_new ();
+  snapshot->uri_updates = updates_new ();
+  snapshot->app_num_updates = updates_new ();
+  snapshot->app_name_updates = doc_updates_new ();
+  snapshot->n_app_nums = file->app_nums->names->len;
+
+  return snapshot;
+}
 
-  return (guint32 *)g_array_free (res, FALSE);
+static XdpDocDbSnapshot *
+xdp_doc_db_snapshot_ref (XdpDocDbSnapshot *snapshot)
+{
+  g_atomic_int_inc (&snapshot->ref_count);
+  return snapshot;
 }
 
-char **
-xdp_doc_db_list_apps (XdpDocDb *db)
+/* A new level on top of @old, which it shares everything with */
+static XdpDocDbSnapshot *
+xdp_doc_db_snapshot_new_child (XdpDocDbSnapshot *old)
 {
-  GHashTableIter iter;
-  gpointer key, value;
-  GPtrArray *res;
+  XdpDocDbSnapshot *snapshot;
 
-  res = g_ptr_array_new ();
+  snapshot = xdp_doc_db_snapshot_new (xdp_doc_db_file_ref (old->file));
+  snapshot->parent = xdp_doc_db_snapshot_ref (old);
+  snapshot->n_app_nums = old->n_app_nums;
 
-  g_hash_table_iter_init (&iter, db->app_updates);
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    g_ptr_array_add (res, g_strdup (key));
+  return snapshot;
+}
 
-  if (db->app_table)
-    {
-      char **table_apps = gvdb_table_get_names (db->app_table, NULL);
-      int i;
+static guint
+xdp_doc_db_snapshot_get_level_size (XdpDocDbSnapshot *snapshot)
+{
+  return g_hash_table_size (snapshot->doc_updates) +
+    g_hash_table_size (snapshot->app_updates) +
+    g_hash_table_size (snapshot->uri_updates) +
+    g_hash_table_size (snapshot->app_num_updates);
+}
 
-      for (i = 0; table_apps[i] != NULL; i++)
-        {
-          char *app = table_apps[i];
+/* Looks @key up in the overlay at @table_offset, newest level first */
+static gpointer
+xdp_doc_db_snapshot_lookup_update (XdpDocDbSnapshot *snapshot,
+                                   glong table_offset,
+                                   gconstpointer key)
+{
+  gpointer res;
 
-          if (g_hash_table_lookup (db->app_updates, app) != NULL)
-            g_free (app);
-          else
-            g_ptr_array_add (res, app);
-        }
-      g_free (table_apps);
+  for (; snapshot != NULL; snapshot = snapshot->parent)
+    {
+      res = g_hash_table_lookup (G_STRUCT_MEMBER (GHashTable *, snapshot, table_offset),
+                                 key);
+      if (res != NULL)
+        return res;
+    }
+
+  return NULL;
+}
+
+/* The overlay at @table_offset with all the levels merged, for the
+   callers that go through all of it. Returns a new ref. */
+static GHashTable *
+xdp_doc_db_snapshot_get_updates (XdpDocDbSnapshot *snapshot,
+                                 glong table_offset)
+{
+  g_autoptr(GPtrArray) levels = g_ptr_array_new ();
+  GHashTable *res;
+  guint i;
+
+  if (snapshot->parent == NULL)
+    return g_hash_table_ref (G_STRUCT_MEMBER (GHashTable *, snapshot, table_offset));
+
+  for (; snapshot != NULL; snapshot = snapshot->parent)
+    g_ptr_array_add (levels, snapshot);
+
+  res = updates_have_uint_keys (table_offset) ? doc_updates_new () : updates_new ();
+  for (i = levels->len; i > 0; i--)
+    updates_merge (res,
+                   G_STRUCT_MEMBER (GHashTable *, g_ptr_array_index (levels, i - 1),
+                                    table_offset),
+                   table_offset);
+
+  return res;
+}
+
+/* Returns 0 if the app has no numeric id in @snapshot */
+static guint32
+xdp_doc_db_snapshot_get_app_num (XdpDocDbSnapshot *snapshot,
+                                 const char *app_id)
+{
+  GVariant *num;
+  guint32 res;
+
+  res = xdp_app_nums_get_num (snapshot->file->app_nums, app_id);
+  if (res != 0)
+    return res;
+
+  num = xdp_doc_db_snapshot_lookup_update (snapshot, APP_NUM_UPDATES, app_id);
+  return num ? g_variant_get_uint32 (num) : 0;
+}
+
+/* Returns NULL for unknown ids. The name lives as long as @snapshot. */
+static const char *
+xdp_doc_db_snapshot_get_app_name (XdpDocDbSnapshot *snapshot,
+                                  guint32 num)
+{
+  GVariant *name;
+  const char *res;
+
+  res = xdp_app_nums_get_name (snapshot->file->app_nums, num);
+  if (res != NULL)
+    return res;
+
+  name = xdp_doc_db_snapshot_lookup_update (snapshot, APP_NAME_UPDATES,
+                                            GUINT_TO_POINTER (num));
+  return name ? g_variant_get_string (name, NULL) : NULL;
+}
+
+static void
+xdp_doc_db_snapshot_unref (XdpDocDbSnapshot *snapshot)
+{
+  if (!g_atomic_int_dec_and_test (&snapshot->ref_count))
+    return;
+
+  xdp_doc_db_file_unref (snapshot->file);
+  if (snapshot->parent)
+    xdp_doc_db_snapshot_unref (snapshot->parent);
+  g_hash_table_unref (snapshot->doc_updates);
+  g_hash_table_unref (snapshot->app_updates);
+  g_hash_table_unref (snapshot->uri_updates);
+  g_hash_table_unref (snapshot->app_num_updates);
+  g_hash_table_unref (snapshot->app_name_updates);
+  g_free (snapshot);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (XdpDocDbSnapshot, xdp_doc_db_snapshot_unref)
+
+/* Merges @snapshot into its parent while it has grown to half the
+   size of the parent. Takes ownership of @snapshot, which must not
+   have been published. */
+static XdpDocDbSnapshot *
+xdp_doc_db_snapshot_compact (XdpDocDbSnapshot *snapshot)
+{
+  XdpDocDbSnapshot *parent, *merged;
+
+  while (snapshot->parent != NULL &&
+         xdp_doc_db_snapshot_get_level_size (snapshot) * 2 >=
+         xdp_doc_db_snapshot_get_level_size (snapshot->parent))
+    {
+      parent = snapshot->parent;
+
+      merged = xdp_doc_db_snapshot_new (xdp_doc_db_file_ref (snapshot->file));
+      if (parent->parent)
+        merged->parent = xdp_doc_db_snapshot_ref (parent->parent);
+      merged->n_app_nums = snapshot->n_app_nums;
+
+      updates_merge (merged->doc_updates, parent->doc_updates, DOC_UPDATES);
+      updates_merge (merged->doc_updates, snapshot->doc_updates, DOC_UPDATES);
+      updates_merge (merged->app_updates, parent->app_updates, APP_UPDATES);
+      updates_merge (merged->app_updates, snapshot->app_updates, APP_UPDATES);
+      updates_merge (merged->uri_updates, parent->uri_updates, URI_UPDATES);
+      updates_merge (merged->uri_updates, snapshot->uri_updates, URI_UPDATES);
+      updates_merge (merged->app_num_updates, parent->app_num_updates, APP_NUM_UPDATES);
+      updates_merge (merged->app_num_updates, snapshot->app_num_updates, APP_NUM_UPDATES);
+      updates_merge (merged->app_name_updates, parent->app_name_updates, APP_NAME_UPDATES);
+      updates_merge (merged->app_name_updates, snapshot->app_name_updates, APP_NAME_UPDATES);
+
+      xdp_doc_db_snapshot_unref (snapshot);
+      snapshot = merged;
+    }
+
+  return snapshot;
+}
+
+/* The view parses the GVariant serialisation of a (sa(su)) or
+   (usa(uu)) doc by hand. Framing offsets are little endian and sized
+   by the size of their container, the u values are in the byte order
+   of the data. Anything that doesn't look like a normal form doc is
+   rejected. */
+
+static guint
+xdp_doc_view_offset_size (gsize size)
+{
+  if (size <= G_MAXUINT8)
+    return 1;
+  if (size <= G_MAXUINT16)
+    return 2;
+  return 4;
+}
+
+static gsize
+xdp_doc_view_read_offset (const guint8 *data,
+                          guint offset_size)
+{
+  gsize res = 0;
+  guint i;
+
+  for (i = 0; i < offset_size; i++)
+    res |= (gsize)data[i] << (8 * i);
+
+  return res;
+}
+
+static gsize
+xdp_doc_view_align (gsize offset)
+{
+  return (offset + 3) & ~(gsize)3;
+}
+
+/* Stored docs start with the dir id, and the dir and the apps are
+   looked up in @file */
+static gboolean
+xdp_doc_view_init (XdpDocView *view,
+                   const guint8 *data,
+                   gsize size,
+                   gboolean byteswapped,
+                   XdpDocDbFile *file)
+{
+  guint offset_size;
+  gsize uri_start = 0, uri_end, perms_start, perms_end;
+
+  memset (view, 0, sizeof *view);
+
+  if (size > G_MAXUINT32)
+    return FALSE;
+
+  /* (sa(su)): the uri, padding, the perms array and the end of the
+     uri as the only framing offset. (usa(uu)) has the dir id first. */
+  if (file != NULL)
+    {
+      guint32 dir_id;
+
+      view->app_nums = file->app_nums;
+      uri_start = sizeof dir_id;
+      if (size < uri_start)
+        return FALSE;
+
+      memcpy (&dir_id, data, sizeof dir_id);
+      if (byteswapped)
+        dir_id = GUINT32_SWAP_LE_BE (dir_id);
+
+      if (dir_id != 0)
+        {
+          view->dir = xdp_doc_db_file_lookup_dir (file, dir_id);
+          if (view->dir == NULL)
+            return FALSE;
+        }
+    }
+
+  offset_size = xdp_doc_view_offset_size (size);
+  if (size <= uri_start + offset_size)
+    goto invalid;
+
+  perms_end = size - offset_size;
+  uri_end = xdp_doc_view_read_offset (data + perms_end, offset_size);
+  if (uri_end <= uri_start || uri_end > perms_end || data[uri_end - 1] != 0)
+    goto invalid;
+
+  perms_start = xdp_doc_view_align (uri_end);
+  if (perms_start > perms_end)
+    goto invalid;
+
+  view->uri = (const char *)data + uri_start;
+  view->perms = data + perms_start;
+  view->perms_size = perms_end - perms_start;
+  view->byteswapped = byteswapped;
+
+  /* a(uu): fixed size elements and no framing offsets */
+  if (view->app_nums != NULL)
+    {
+      if (view->perms_size % (2 * sizeof (guint32)) != 0)
+        goto invalid;
+
+      view->n_perms = view->perms_size / (2 * sizeof (guint32));
+    }
+  /* a(su): the elements, then one framing offset per element */
+  else if (view->perms_size > 0)
+    {
+      view->offset_size = xdp_doc_view_offset_size (view->perms_size);
+      if (view->perms_size < view->offset_size)
+        goto invalid;
+
+      view->perms_offsets =
+        xdp_doc_view_read_offset (view->perms + view->perms_size - view->offset_size,
+                                  view->offset_size);
+      if (view->perms_offsets >= view->perms_size ||
+          (view->perms_size - view->perms_offsets) % view->offset_size != 0)
+        goto invalid;
+
+      view->n_perms = (view->perms_size - view->perms_offsets) / view->offset_size;
+    }
+
+  return TRUE;
+
+ invalid:
+  memset (view, 0, sizeof *view);
+  return FALSE;
+}
+
+/* Strips the variant wrapper that gvdb stores values in, returning
+   the size of the doc or 0 if it isn't of the given type */
+static gsize
+xdp_doc_view_unwrap (const guint8 *data,
+                     gsize size,
+                     const char *doc_type)
+{
+  gsize type_len = strlen (doc_type);
+  gsize type_start;
+
+  if (size <= type_len)
+    return 0;
+
+  type_start = size - type_len;
+  if (data[type_start - 1] != 0 ||
+      memcmp (data + type_start, doc_type, type_len) != 0)
+    return 0;
+
+  return type_start - 1;
+}
+
+void
+xdp_doc_view_clear (XdpDocView *view)
+{
+  if (view->snapshot)
+    xdp_doc_db_snapshot_unref (view->snapshot);
+  if (view->doc_path)
+    xdp_doc_path_unref (view->doc_path);
+  memset (view, 0, sizeof *view);
+}
+
+void
+xdp_doc_view_move (XdpDocView *dest,
+                   XdpDocView *src)
+{
+  xdp_doc_view_clear (dest);
+  *dest = *src;
+  memset (src, 0, sizeof *src);
+}
+
+gboolean
+xdp_doc_view_is_set (XdpDocView *view)
+{
+  return view->uri != NULL;
+}
+
+/* The paths are cached by the whole uri, which is put together on
+   the stack for docs stored relative to a dir. The view keeps the
+   entry until it is cleared. */
+static const XdpDocPath *
+xdp_doc_view_get_doc_path (XdpDocView *view)
+{
+  g_autofree char *heap_uri = NULL;
+  char stack_uri[1024];
+  gsize dir_len, uri_len;
+
+  if (view->doc_path != NULL)
+    return view->doc_path;
+
+  if (view->dir == NULL)
+    view->doc_path = xdp_doc_get_doc_path (view->uri);
+  else
+    {
+      dir_len = strlen (view->dir);
+      uri_len = strlen (view->uri);
+      if (dir_len + uri_len < sizeof stack_uri)
+        {
+          memcpy (stack_uri, view->dir, dir_len);
+          memcpy (stack_uri + dir_len, view->uri, uri_len + 1);
+          view->doc_path = xdp_doc_get_doc_path (stack_uri);
+        }
+      else
+        {
+          heap_uri = g_strconcat (view->dir, view->uri, NULL);
+          view->doc_path = xdp_doc_get_doc_path (heap_uri);
+        }
+    }
+
+  return view->doc_path;
+}
+
+const char *
+xdp_doc_view_get_uri (XdpDocView *view)
+{
+  if (view->dir == NULL)
+    return view->uri;
+
+  return xdp_doc_view_get_doc_path (view)->uri;
+}
+
+guint
+xdp_doc_view_get_n_perms (XdpDocView *view)
+{
+  return view->n_perms;
+}
+
+/* For stored docs, returns the numeric app id of the index:th entry */
+static guint32
+xdp_doc_view_get_perm_num (XdpDocView *view,
+                           guint index,
+                           XdpPermissionFlags *permissions)
+{
+  guint32 elem[2];
+
+  memcpy (elem, view->perms + index * sizeof elem, sizeof elem);
+  if (view->byteswapped)
+    {
+      elem[0] = GUINT32_SWAP_LE_BE (elem[0]);
+      elem[1] = GUINT32_SWAP_LE_BE (elem[1]);
+    }
+
+  if (permissions)
+    *permissions = elem[1];
+
+  return elem[0];
+}
+
+/* Returns the app id of the index:th entry, or NULL if the entry is
+   malformed */
+const char *
+xdp_doc_view_get_perm (XdpDocView *view,
+                       guint index,
+                       XdpPermissionFlags *permissions)
+{
+  const guint8 *offsets = view->perms + view->perms_offsets;
+  const guint8 *elem;
+  gsize start, end, elem_size, app_end, perms_pos;
+  guint offset_size;
+  guint32 perms;
+
+  g_return_val_if_fail (index < view->n_perms, NULL);
+
+  if (view->app_nums != NULL)
+    {
+      guint32 num;
+
+      num = xdp_doc_view_get_perm_num (view, index, permissions);
+      return xdp_app_nums_get_name (view->app_nums, num);
+    }
+
+  start = 0;
+  if (index > 0)
+    start = xdp_doc_view_align (xdp_doc_view_read_offset (offsets + (index - 1) * view->offset_size,
+                                                          view->offset_size));
+  end = xdp_doc_view_read_offset (offsets + index * view->offset_size,
+                                  view->offset_size);
+  if (start > end || end > view->perms_offsets)
+    return NULL;
+
+  /* (su): the app id, padding, the permissions and the end of the
+     app id */
+  elem = view->perms + start;
+  elem_size = end - start;
+  offset_size = xdp_doc_view_offset_size (elem_size);
+  if (elem_size <= offset_size)
+    return NULL;
+
+  app_end = xdp_doc_view_read_offset (elem + elem_size - offset_size, offset_size);
+  perms_pos = xdp_doc_view_align (app_end);
+  if (app_end == 0 || elem[app_end - 1] != 0 ||
+      perms_pos + sizeof perms > elem_size - offset_size)
+    return NULL;
+
+  if (permissions)
+    {
+      memcpy (&perms, elem + perms_pos, sizeof perms);
+      if (view->byteswapped)
+        perms = GUINT32_SWAP_LE_BE (perms);
+      *permissions = perms;
+    }
+
+  return (const char *)elem;
+}
+
+XdpPermissionFlags
+xdp_doc_view_get_permissions (XdpDocView *view,
+                              const char *app_id)
+{
+  guint32 num;
+  guint i;
+
+  if (strcmp (app_id, "") == 0)
+    return XDP_PERMISSION_FLAGS_ALL;
+
+  /* Stored docs are checked by the numeric id, without looking at
+     the names */
+  if (view->app_nums != NULL)
+    {
+      num = xdp_app_nums_get_num (view->app_nums, app_id);
+      if (num == 0)
+        return 0;
+
+      for (i = 0; i < view->n_perms; i++)
+        {
+          XdpPermissionFlags perms;
+
+          if (xdp_doc_view_get_perm_num (view, i, &perms) == num)
+            return perms;
+        }
+
+      return 0;
+    }
+
+  for (i = 0; i < view->n_perms; i++)
+    {
+      XdpPermissionFlags perms;
+      const char *child_app_id = xdp_doc_view_get_perm (view, i, &perms);
+
+      if (child_app_id != NULL && strcmp (app_id, child_app_id) == 0)
+        return perms;
+    }
+
+  return 0;
+}
+
+gboolean
+xdp_doc_view_has_permissions (XdpDocView *view,
+                              const char *app_id,
+                              XdpPermissionFlags perms)
+{
+  XdpPermissionFlags current_perms;
+
+  current_perms = xdp_doc_view_get_permissions (view, app_id);
+  return (current_perms & perms) == perms;
+}
+
+/* Like g_str_has_prefix() on the uri, without putting it together */
+gboolean
+xdp_doc_view_has_uri_prefix (XdpDocView *view,
+                             const char *prefix)
+{
+  gsize dir_len;
+
+  if (view->dir == NULL)
+    return g_str_has_prefix (view->uri, prefix);
+
+  dir_len = strlen (view->dir);
+  if (strncmp (view->dir, prefix, dir_len) != 0)
+    return strncmp (view->dir, prefix, strlen (prefix)) == 0;
+
+  return g_str_has_prefix (view->uri, prefix + dir_len);
+}
+
+const char *
+xdp_doc_view_get_path (XdpDocView *view)
+{
+  return xdp_doc_view_get_doc_path (view)->path;
+}
+
+const char *
+xdp_doc_view_get_basename (XdpDocView *view)
+{
+  return xdp_doc_view_get_doc_path (view)->basename;
+}
+
+const char *
+xdp_doc_view_get_dirname (XdpDocView *view)
+{
+  return xdp_doc_view_get_doc_path (view)->dirname;
+}
+
+/* The app with the numeric id @num, as of when the doc was read.
+   Returns NULL for unknown ids. The name lives as long as the view. */
+const char *
+xdp_doc_view_get_app_name (XdpDocView *view,
+                           guint32 num)
+{
+  g_return_val_if_fail (view->snapshot != NULL, NULL);
+
+  return xdp_doc_db_snapshot_get_app_name (view->snapshot, num);
+}
+
+/* Readers announce themselves in n_readers while they load the
+   pointer and take their ref. That window is a few instructions
+   long, the rest of the read is done on the reader's own ref. */
+static XdpDocDbSnapshot *
+xdp_doc_db_get_snapshot (XdpDocDb *db)
+{
+  XdpDocDbSnapshot *snapshot;
+  guint epoch;
+
+  epoch = g_atomic_int_get (&db->reader_epoch) & 1;
+  g_atomic_int_inc (&db->n_readers[epoch]);
+  snapshot = xdp_doc_db_snapshot_ref (g_atomic_pointer_get (&db->snapshot));
+  g_atomic_int_dec_and_test (&db->n_readers[epoch]);
+
+  return snapshot;
+}
+
+/* What the writer sees: its pending changes if any, else the
+   published snapshot. Needs the write lock. */
+static XdpDocDbSnapshot *
+xdp_doc_db_get_writer_snapshot (XdpDocDb *db)
+{
+  return db->next ? db->next : db->snapshot;
+}
+
+/* A new level on top of the published snapshot, which only gets the
+   changes. Needs the write lock. */
+static XdpDocDbSnapshot *
+xdp_doc_db_get_writable_snapshot (XdpDocDb *db)
+{
+  if (db->next == NULL)
+    db->next = xdp_doc_db_snapshot_new_child (db->snapshot);
+
+  return db->next;
+}
+
+/* Readers counted in the previous epoch may have loaded a snapshot
+   retired in it before it was replaced. Once they are all gone, those
+   snapshots are unreffed and the current epoch ends, so that what was
+   retired in it is next. Readers still around are not waited for,
+   this is tried again on the next replace. Needs the write lock. */
+static void
+xdp_doc_db_reclaim (XdpDocDb *db)
+{
+  guint epoch = db->reader_epoch & 1;
+  guint prev = epoch ^ 1;
+
+  if (g_atomic_int_get (&db->n_readers[prev]) != 0)
+    return;
+
+  g_ptr_array_set_size (db->retired[prev], 0);
+
+  if (db->retired[epoch]->len > 0)
+    g_atomic_int_inc (&db->reader_epoch);
+}
+
+static void
+xdp_doc_db_replace_snapshot (XdpDocDb *db,
+                             XdpDocDbSnapshot *snapshot)
+{
+  XdpDocDbSnapshot *old = db->snapshot;
+
+  g_atomic_pointer_set (&db->snapshot, snapshot);
+  g_ptr_array_add (db->retired[db->reader_epoch & 1], old);
+  xdp_doc_db_reclaim (db);
+}
+
+/* Makes the pending changes visible to readers. Needs the write
+   lock, and does nothing inside a transaction. */
+static void
+xdp_doc_db_publish (XdpDocDb *db)
+{
+  XdpDocDbSnapshot *next = db->next;
+
+  if (next == NULL || db->transaction_depth > 0)
+    return;
+
+  db->next = NULL;
+  xdp_doc_db_replace_snapshot (db, xdp_doc_db_snapshot_compact (next));
+}
+
+static void
+xdp_doc_db_finalize (GObject *object)
+{
+  XdpDocDb *db = (XdpDocDb *)object;
+
+  g_clear_pointer (&db->filename, g_free);
+
+  g_clear_pointer (&db->snapshot, xdp_doc_db_snapshot_unref);
+  g_clear_pointer (&db->next, xdp_doc_db_snapshot_unref);
+  g_clear_pointer (&db->pending_app_docs, g_hash_table_unref);
+  g_clear_pointer (&db->retired[0], g_ptr_array_unref);
+  g_clear_pointer (&db->retired[1], g_ptr_array_unref);
+
+  g_mutex_clear (&db->write_lock);
+
+  G_OBJECT_CLASS (xdp_doc_db_parent_class)->finalize (object);
+}
+
+static void
+xdp_doc_db_class_init (XdpDocDbClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = xdp_doc_db_finalize;
+
+  signals[DOC_CHANGED] =
+    g_signal_new ("doc-changed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0,
+                  NULL, NULL,
+                  NULL,
+                  G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_UINT64);
+
+  no_doc = g_variant_ref_sink (xdp_doc_new ("NONE",
+                                            g_variant_new_array (G_VARIANT_TYPE ("(su)"), NULL, 0)));
+}
+
+static void
+xdp_doc_db_init (XdpDocDb *db)
+{
+  g_mutex_init (&db->write_lock);
+  db->retired[0] = g_ptr_array_new_with_free_func ((GDestroyNotify)xdp_doc_db_snapshot_unref);
+  db->retired[1] = g_ptr_array_new_with_free_func ((GDestroyNotify)xdp_doc_db_snapshot_unref);
+}
+
+XdpDocDb *
+xdp_doc_db_new (const char *filename,
+                GError **error)
+{
+  g_autofree char *dirname = g_path_get_dirname (filename);
+  XdpDocDbFile *file;
+  XdpDocDb *db;
+  GvdbTable *gvdb;
+  GError *my_error = NULL;
+
+  gvdb = gvdb_table_new (filename, TRUE, &my_error);
+  if (gvdb == NULL)
+    {
+      if (g_error_matches (my_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_error_free (my_error);
+      else
+        {
+          g_propagate_error (error, my_error);
+          return NULL;
+        }
+    }
+
+  file = xdp_doc_db_file_new (dirname, gvdb, error);
+  if (file == NULL)
+    return NULL;
+
+  db = g_object_new (XDP_TYPE_DOC_DB, NULL);
+  db->filename = g_strdup (filename);
+
+  /* Save the ids given to apps from before the ids */
+  db->dirty = file->new_app_nums;
+
+  if (gvdb)
+    {
+      g_autoptr(GVariant) generation = NULL;
+
+      generation = gvdb_table_get_value (gvdb, "generation");
+      if (generation != NULL &&
+          g_variant_is_of_type (generation, G_VARIANT_TYPE_UINT64))
+        db->generation = g_variant_get_uint64 (generation);
+    }
+
+  db->snapshot = xdp_doc_db_snapshot_new (file);
+
+  /* We don't know what changed before we started */
+  db->change_ring_base = db->generation;
+
+  db->pending_app_docs =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           g_free, (GDestroyNotify)g_hash_table_unref);
+
+  return db;
+}
+
+static GVariant *
+xdp_doc_db_snapshot_lookup_doc (XdpDocDbSnapshot *snapshot,
+                                guint32 doc_id)
+{
+  GvdbTable *doc_table = xdp_doc_db_file_get_doc_table (snapshot->file, doc_id);
+  GVariant *res;
+
+  res = xdp_doc_db_snapshot_lookup_update (snapshot, DOC_UPDATES,
+                                           GUINT_TO_POINTER (doc_id));
+  if (res)
+    {
+      if (res == no_doc)
+        return NULL;
+      return g_variant_ref (res);
+    }
+
+  if (doc_table == NULL)
+    return NULL;
+
+  if (gvdb_table_has_uint_keys (doc_table))
+    res = gvdb_table_get_value_uint (doc_table, doc_id);
+  else
+    {
+      /* Files from before the docs table had integer keys */
+      char id_num[9];
+
+      g_sprintf (id_num, "%x", (guint32)doc_id);
+      res = gvdb_table_get_value (doc_table, id_num);
+    }
+
+  if (res == NULL)
+    return NULL;
+
+  return xdp_doc_db_file_decode_doc (snapshot->file, res);
+}
+
+static GVariant *
+xdp_doc_db_snapshot_lookup_doc_name (XdpDocDbSnapshot *snapshot,
+                                     const char *doc_id)
+{
+  return xdp_doc_db_snapshot_lookup_doc (snapshot, xdb_doc_id_from_name (doc_id));
+}
+
+static void
+xdp_doc_db_list_table_docs (GvdbTable *doc_table,
+                            GHashTable *doc_updates,
+                            GArray *res)
+{
+  int i;
+
+  if (gvdb_table_has_uint_keys (doc_table))
+    {
+      g_autofree guint32 *table_docs = gvdb_table_get_uint_names (doc_table, NULL);
+
+      for (i = 0; table_docs[i] != 0; i++)
+        {
+          if (!g_hash_table_contains (doc_updates,
+                                      GUINT_TO_POINTER (table_docs[i])))
+            g_array_append_val (res, table_docs[i]);
+        }
+    }
+  else
+    {
+      char **table_docs = gvdb_table_get_names (doc_table, NULL);
+
+      for (i = 0; table_docs[i] != NULL; i++)
+        {
+          guint32 doc_id = xdb_doc_id_from_name (table_docs[i]);
+
+          if (!g_hash_table_contains (doc_updates,
+                                      GUINT_TO_POINTER (doc_id)))
+            g_array_append_val (res, doc_id);
+        }
+      g_strfreev (table_docs);
+    }
+}
+
+static guint32 *
+xdp_doc_db_snapshot_list_docs (XdpDocDbSnapshot *snapshot)
+{
+  g_autoptr(GHashTable) doc_updates = xdp_doc_db_snapshot_get_updates (snapshot, DOC_UPDATES);
+  XdpDocDbFile *file = snapshot->file;
+  GHashTableIter iter;
+  gpointer key, value;
+  GArray *res;
+  guint i;
+
+  res = g_array_new (TRUE, FALSE, sizeof (guint32));
+
+  g_hash_table_iter_init (&iter, doc_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      guint32 doc_id = GPOINTER_TO_UINT (key);
+      g_array_append_val (res, doc_id);
+    }
+
+  for (i = 0; i < file->n_doc_shards; i++)
+    {
+      if (file->doc_shards[i].table)
+        xdp_doc_db_list_table_docs (file->doc_shards[i].table,
+                                    doc_updates, res);
+    }
+
+  return (guint32 *)g_array_free (res, FALSE);
+}
+
+static char **
+xdp_doc_db_snapshot_list_apps (XdpDocDbSnapshot *snapshot)
+{
+  g_autoptr(GHashTable) app_updates = xdp_doc_db_snapshot_get_updates (snapshot, APP_UPDATES);
+  GHashTableIter iter;
+  gpointer key, value;
+  GPtrArray *res;
+
+  res = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, app_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_ptr_array_add (res, g_strdup (key));
+
+  if (snapshot->file->apps.table)
+    {
+      char **table_apps = gvdb_table_get_names (snapshot->file->apps.table, NULL);
+      int i;
+
+      for (i = 0; table_apps[i] != NULL; i++)
+        {
+          char *app = table_apps[i];
+
+          if (g_hash_table_lookup (app_updates, app) != NULL)
+            g_free (app);
+          else
+            g_ptr_array_add (res, app);
+        }
+      g_free (table_apps);
     }
 
   g_ptr_array_add (res, NULL);
   return (char **)g_ptr_array_free (res, FALSE);
 }
 
-char **
-xdp_doc_db_list_uris (XdpDocDb *db)
+static char **
+xdp_doc_db_snapshot_list_uris (XdpDocDbSnapshot *snapshot)
+{
+  g_autoptr(GHashTable) uri_updates = xdp_doc_db_snapshot_get_updates (snapshot, URI_UPDATES);
+  GHashTableIter iter;
+  gpointer key, value;
+  GPtrArray *res;
+
+  res = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, uri_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_ptr_array_add (res, g_strdup (key));
+
+  if (snapshot->file->uris.table)
+    {
+      char **table_uris = gvdb_table_get_names (snapshot->file->uris.table, NULL);
+      int i;
+
+      for (i = 0; table_uris[i] != NULL; i++)
+        {
+          char *uri = table_uris[i];
+
+          if (g_hash_table_lookup (uri_updates, uri) != NULL)
+            g_free (uri);
+          else
+            g_ptr_array_add (res, uri);
+        }
+      g_free (table_uris);
+    }
+
+  g_ptr_array_add (res, NULL);
+  return (char **)g_ptr_array_free (res, FALSE);
+}
+
+static GVariant *
+xdp_doc_db_snapshot_lookup_app (XdpDocDbSnapshot *snapshot,
+                                const char *app_id)
+{
+  GVariant *res;
+
+  res = xdp_doc_db_snapshot_lookup_update (snapshot, APP_UPDATES, app_id);
+  if (res)
+    return g_variant_ref (res);
+
+  if (snapshot->file->apps.table)
+    return gvdb_table_get_value (snapshot->file->apps.table, app_id);
+
+  return NULL;
+}
+
+static GVariant *
+xdp_doc_db_snapshot_lookup_uri (XdpDocDbSnapshot *snapshot,
+                                const char *uri)
+{
+  GVariant *res;
+
+  res = xdp_doc_db_snapshot_lookup_update (snapshot, URI_UPDATES, uri);
+  if (res)
+    return g_variant_ref (res);
+
+  if (snapshot->file->uris.table)
+    return gvdb_table_get_value (snapshot->file->uris.table, uri);
+
+  return NULL;
+}
+
+static void
+add_uri_docs (GArray *res,
+              GVariant *uri)
+{
+  g_autoptr(GVariant) doc_array = g_variant_get_child_value (uri, 0);
+  const guint32 *doc_ids;
+  gsize n_docs;
+
+  doc_ids = g_variant_get_fixed_array (doc_array, &n_docs, sizeof (guint32));
+  g_array_append_vals (res, doc_ids, n_docs);
+}
+
+/* Returns the index of the first of the sorted keys that is not less
+   than @key */
+static gsize
+sorted_keys_lower_bound (GVariant *sorted_keys,
+                         const char *key)
+{
+  gsize lo = 0, hi = g_variant_n_children (sorted_keys);
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+      const char *mid_key;
+
+      g_variant_get_child (sorted_keys, mid, "&s", &mid_key);
+      if (strcmp (mid_key, key) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* The uris in the file that start with @prefix are found by binary
+   search in the sorted keys, the changed ones by going through the
+   overlay */
+static guint32 *
+xdp_doc_db_snapshot_list_docs_with_prefix (XdpDocDbSnapshot *snapshot,
+                                           const char *prefix)
+{
+  g_autoptr(GHashTable) uri_updates = xdp_doc_db_snapshot_get_updates (snapshot, URI_UPDATES);
+  XdpDocDbPart *uris = &snapshot->file->uris;
+  GHashTableIter iter;
+  gpointer key, value;
+  GArray *res;
+  gsize i, n;
+
+  res = g_array_new (TRUE, FALSE, sizeof (guint32));
+
+  g_hash_table_iter_init (&iter, uri_updates);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (g_str_has_prefix (key, prefix))
+        add_uri_docs (res, value);
+    }
+
+  if (uris->sorted_keys)
+    {
+      n = g_variant_n_children (uris->sorted_keys);
+      for (i = sorted_keys_lower_bound (uris->sorted_keys, prefix); i < n; i++)
+        {
+          g_autoptr(GVariant) uri_docs = NULL;
+          const char *uri;
+
+          g_variant_get_child (uris->sorted_keys, i, "&s", &uri);
+          if (!g_str_has_prefix (uri, prefix))
+            break;
+
+          if (g_hash_table_contains (uri_updates, uri))
+            continue;
+
+          uri_docs = gvdb_table_get_value (uris->table, uri);
+          if (uri_docs)
+            add_uri_docs (res, uri_docs);
+        }
+    }
+  else if (uris->table)
+    {
+      /* Files from before the sorted keys */
+      char **table_uris = gvdb_table_get_names (uris->table, NULL);
+
+      for (i = 0; table_uris[i] != NULL; i++)
+        {
+          g_autoptr(GVariant) uri_docs = NULL;
+
+          if (!g_str_has_prefix (table_uris[i], prefix) ||
+              g_hash_table_contains (uri_updates, table_uris[i]))
+            continue;
+
+          uri_docs = gvdb_table_get_value (uris->table, table_uris[i]);
+          if (uri_docs)
+            add_uri_docs (res, uri_docs);
+        }
+      g_strfreev (table_uris);
+    }
+
+  return (guint32 *)g_array_free (res, FALSE);
+}
+
+static gboolean
+uri_empty (GVariant *uri)
+{
+  g_autoptr(GVariant) doc_array = g_variant_get_child_value (uri, 0);
+  return g_variant_n_children (doc_array) == 0;
+}
+
+static gboolean
+app_empty (GVariant *app)
+{
+  g_autoptr(GVariant) doc_array = g_variant_get_child_value (app, 0);
+  return g_variant_n_children (doc_array) == 0;
+}
+
+/* Feeds the contents of a snapshot to the gvdb writer, one table at
+   a time, looking up each value only when it's written. Only the keys
+   are listed up front. */
+typedef struct {
+  XdpDocDbSnapshot *snapshot;
+  guint32 *doc_ids;
+  char **keys;
+  GVariant *(*lookup) (XdpDocDbSnapshot *snapshot,
+                       const char *key);
+  gboolean (*empty) (GVariant *value);
+  guint shard;
+  int i;
+  guint64 bytes_saved;
+
+  /* Map dir id => dir uri, for the dirs not in the old file */
+  GHashTable *new_dirs;
+  /* The dir ids the written docs refer to, when pruning the dirs */
+  GHashTable *used_dirs;
+} XdpDocDbSaveIter;
+
+/* Dir ids are a hash of the dir uri, moving on to the next id on
+   collisions, so the id of a dir is found by probing the dirs table
+   and there is no need for a table mapping dirs to ids */
+static guint32
+save_iter_get_dir_id (XdpDocDbSaveIter *iter,
+                      const char *dir)
+{
+  guint32 dir_id = g_str_hash (dir);
+  const char *existing;
+
+  for (;; dir_id++)
+    {
+      if (dir_id == 0)
+        continue;
+
+      existing = g_hash_table_lookup (iter->new_dirs, GUINT_TO_POINTER (dir_id));
+      if (existing == NULL)
+        existing = xdp_doc_db_file_lookup_dir (iter->snapshot->file, dir_id);
+
+      if (existing == NULL)
+        {
+          g_hash_table_insert (iter->new_dirs, GUINT_TO_POINTER (dir_id), g_strdup (dir));
+          break;
+        }
+      if (strcmp (existing, dir) == 0)
+        break;
+    }
+
+  if (iter->used_dirs)
+    g_hash_table_add (iter->used_dirs, GUINT_TO_POINTER (dir_id));
+
+  return dir_id;
+}
+
+/* Turns an in-memory doc into the form it is stored in */
+static GVariant *
+save_iter_encode_doc (XdpDocDbSaveIter *iter,
+                      GVariant *doc)
+{
+  g_autoptr(GVariant) app_array = g_variant_get_child_value (doc, 1);
+  g_autofree char *dir = NULL;
+  const char *uri = xdp_doc_get_uri (doc);
+  const char *name = strrchr (uri, '/');
+  const char *app_id;
+  GVariantBuilder perms;
+  GVariantIter perms_iter;
+  guint32 dir_id = 0, num, app_perms;
+
+  if (name == NULL)
+    name = uri;
+  else
+    {
+      name++;
+      dir = g_strndup (uri, name - uri);
+      dir_id = save_iter_get_dir_id (iter, dir);
+    }
+
+  g_variant_builder_init (&perms, G_VARIANT_TYPE ("a(uu)"));
+  g_variant_iter_init (&perms_iter, app_array);
+  while (g_variant_iter_next (&perms_iter, "(&su)", &app_id, &app_perms))
+    {
+      /* Apps get their id when granted, or when loaded from a file
+         from before the ids, so this only happens with a broken db */
+      num = xdp_doc_db_snapshot_get_app_num (iter->snapshot, app_id);
+      if (num == 0)
+        {
+          g_warning ("No numeric id for app %s, not saving its permissions", app_id);
+          continue;
+        }
+      g_variant_builder_add (&perms, "(uu)", num, app_perms);
+    }
+
+  return g_variant_ref_sink (g_variant_new ("(u&s@a(uu))", dir_id, name,
+                                             g_variant_builder_end (&perms)));
+}
+
+static void
+save_iter_reset (gpointer user_data)
+{
+  XdpDocDbSaveIter *iter = user_data;
+
+  iter->i = 0;
+}
+
+static guint32
+save_iter_tell (gpointer user_data)
+{
+  XdpDocDbSaveIter *iter = user_data;
+
+  return iter->i;
+}
+
+static void
+save_iter_seek (gpointer user_data,
+                guint32 position)
+{
+  XdpDocDbSaveIter *iter = user_data;
+
+  iter->i = position;
+}
+
+static gboolean
+save_iter_next_doc (gpointer user_data,
+                    const char **key,
+                    guint32 *uint_key,
+                    GVariant **value)
+{
+  XdpDocDbSaveIter *iter = user_data;
+
+  while (iter->doc_ids[iter->i] != 0)
+    {
+      guint32 doc_id = iter->doc_ids[iter->i++];
+      GVariant *doc;
+
+      if (doc_id % N_DOC_SHARDS != iter->shard)
+        continue;
+
+      doc = xdp_doc_db_snapshot_lookup_doc (iter->snapshot, doc_id);
+      if (doc == NULL)
+        continue;
+
+      *key = NULL;
+      *uint_key = doc_id;
+      if (value)
+        *value = save_iter_encode_doc (iter, doc);
+      g_variant_unref (doc);
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+save_iter_next_key (gpointer user_data,
+                    const char **key,
+                    guint32 *uint_key,
+                    GVariant **value)
+{
+  XdpDocDbSaveIter *iter = user_data;
+
+  while (iter->keys[iter->i] != NULL)
+    {
+      const char *name = iter->keys[iter->i++];
+      GVariant *res = iter->lookup (iter->snapshot, name);
+
+      if (res == NULL || iter->empty (res))
+        {
+          g_clear_pointer (&res, g_variant_unref);
+          continue;
+        }
+
+      *key = name;
+      if (value)
+        *value = res;
+      else
+        g_variant_unref (res);
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+save_iter_next_dir (gpointer user_data,
+                    const char **key,
+                    guint32 *uint_key,
+                    GVariant **value)
+{
+  XdpDocDbSaveIter *iter = user_data;
+  guint32 dir_id = iter->doc_ids[iter->i];
+  const char *dir;
+
+  if (dir_id == 0)
+    return FALSE;
+
+  iter->i++;
+
+  *key = NULL;
+  *uint_key = dir_id;
+  if (value)
+    {
+      dir = g_hash_table_lookup (iter->new_dirs, GUINT_TO_POINTER (dir_id));
+      if (dir == NULL)
+        dir = xdp_doc_db_file_lookup_dir (iter->snapshot->file, dir_id);
+      *value = g_variant_ref_sink (g_variant_new_string (dir ? dir : ""));
+    }
+
+  return TRUE;
+}
+
+static const GvdbWriterIterFuncs save_dir_funcs = {
+  save_iter_reset,
+  save_iter_next_dir,
+  save_iter_tell,
+  save_iter_seek,
+};
+
+static const GvdbWriterIterFuncs save_doc_funcs = {
+  save_iter_reset,
+  save_iter_next_doc,
+  save_iter_tell,
+  save_iter_seek,
+};
+
+static const GvdbWriterIterFuncs save_key_funcs = {
+  save_iter_reset,
+  save_iter_next_key,
+  save_iter_tell,
+  save_iter_seek,
+};
+
+/* The docs that go in the given shard of the new file, and maybe
+   some more if the current file has another layout */
+static guint32 *
+xdp_doc_db_snapshot_list_shard_docs (XdpDocDbSnapshot *snapshot,
+                                     guint shard)
 {
+  g_autoptr(GHashTable) doc_updates = NULL;
+  XdpDocDbFile *file = snapshot->file;
   GHashTableIter iter;
-  gpointer key, value;
-  GPtrArray *res;
+  gpointer key;
+  GArray *res;
 
-  res = g_ptr_array_new ();
+  if (file->n_doc_shards != N_DOC_SHARDS)
+    return xdp_doc_db_snapshot_list_docs (snapshot);
 
-  g_hash_table_iter_init (&iter, db->uri_updates);
-  while (g_hash_table_iter_next (&iter, &key, &value))
-    g_ptr_array_add (res, g_strdup (key));
+  res = g_array_new (TRUE, FALSE, sizeof (guint32));
 
-  if (db->uri_table)
+  doc_updates = xdp_doc_db_snapshot_get_updates (snapshot, DOC_UPDATES);
+  g_hash_table_iter_init (&iter, doc_updates);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
     {
-      char **table_uris = gvdb_table_get_names (db->uri_table, NULL);
-      int i;
+      guint32 doc_id = GPOINTER_TO_UINT (key);
 
-      for (i = 0; table_uris[i] != NULL; i++)
+      if (doc_id % N_DOC_SHARDS == shard)
+        g_array_append_val (res, doc_id);
+    }
+
+  if (file->doc_shards[shard].table)
+    xdp_doc_db_list_table_docs (file->doc_shards[shard].table,
+                                doc_updates, res);
+
+  return (guint32 *)g_array_free (res, FALSE);
+}
+
+static void
+xdp_doc_db_get_writer_options (GvdbBuilderOptions *options)
+{
+  memset (options, 0, sizeof *options);
+  options->bloom_false_positive_rate = BLOOM_FALSE_POSITIVE_RATE;
+  /* The uris table has long keys */
+  options->hash_type = GVDB_HASH_XXH32;
+  options->dedup_values = TRUE;
+  /* Few page faults per lookup right after login, when the db is
+     not in the page cache yet */
+  options->cache_friendly = TRUE;
+}
+
+static int
+compare_keys (const void *a,
+              const void *b)
+{
+  return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/* Writes the file for a part. If @sorted_keys is given, it's stored
+   next to the table. */
+static gboolean
+xdp_doc_db_write_part (const char *dirname,
+                       const char *name,
+                       const char *table_name,
+                       const GvdbWriterIterFuncs *funcs,
+                       XdpDocDbSaveIter *iter,
+                       GVariant *sorted_keys,
+                       GError **error)
+{
+  g_autofree char *path = g_build_filename (dirname, name, NULL);
+  GvdbBuilderOptions options;
+  GvdbBuilderStats stats;
+  GvdbWriter *writer;
+  gboolean res;
+
+  xdp_doc_db_get_writer_options (&options);
+
+  writer = gvdb_writer_new (path, &options, error);
+  if (writer == NULL)
+    return FALSE;
+
+  res = gvdb_writer_add_table (writer, table_name, funcs, iter, error) &&
+    (sorted_keys == NULL ||
+     gvdb_writer_add_value (writer, "sorted-keys", sorted_keys, error)) &&
+    gvdb_writer_finish (writer, error);
+
+  gvdb_writer_get_stats (writer, &stats);
+  iter->bytes_saved += stats.bytes_saved;
+  g_debug ("Wrote %s: %" G_GUINT64_FORMAT " values, %" G_GUINT64_FORMAT
+           " shared, %" G_GUINT64_FORMAT " bytes saved",
+           name, stats.n_values, stats.n_shared_values, stats.bytes_saved);
+
+  gvdb_writer_free (writer);
+
+  return res;
+}
+
+/* Writes new files for the parts that changed since the file the
+   snapshot is based on, and then the manifest pointing to them.
+   Returns the names of all the parts in use. */
+/* All the app ids, in the order of their numeric ids */
+static GVariant *
+xdp_doc_db_snapshot_serialize_app_nums (XdpDocDbSnapshot *snapshot)
+{
+  g_autofree const char **names = g_new (const char *, snapshot->n_app_nums);
+  guint32 num;
+
+  for (num = 1; num <= snapshot->n_app_nums; num++)
+    names[num - 1] = xdp_doc_db_snapshot_get_app_name (snapshot, num);
+
+  return g_variant_new_strv (names, snapshot->n_app_nums);
+}
+
+static GPtrArray *
+xdp_doc_db_write (XdpDocDb *db,
+                  XdpDocDbSnapshot *snapshot,
+                  GError **error)
+{
+  XdpDocDbFile *file = snapshot->file;
+  g_autoptr(GHashTable) doc_updates = xdp_doc_db_snapshot_get_updates (snapshot, DOC_UPDATES);
+  g_autoptr(GHashTable) app_updates = xdp_doc_db_snapshot_get_updates (snapshot, APP_UPDATES);
+  g_autoptr(GHashTable) uri_updates = xdp_doc_db_snapshot_get_updates (snapshot, URI_UPDATES);
+  g_autofree char *dirname = g_path_get_dirname (db->filename);
+  g_autofree char *basename = g_path_get_basename (db->filename);
+  g_autoptr(GPtrArray) names = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GHashTable) new_dirs = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  g_autoptr(GHashTable) used_dirs = NULL;
+  gboolean dirty_shards[N_DOC_SHARDS] = { FALSE, };
+  XdpDocDbSaveIter iter = { snapshot, };
+  g_autoptr(GVariant) app_nums = NULL;
+  GvdbBuilderOptions options;
+  GHashTableIter updates;
+  gboolean rewrite_all;
+  GvdbWriter *writer;
+  guint32 n_dirs, n_live_dirs;
+  gboolean prune_dirs;
+  gpointer key;
+  gboolean res;
+  char *name;
+  guint i;
+
+  /* Old style files, or ones with another number of shards, are
+     converted by writing everything */
+  rewrite_all = file->n_doc_shards != N_DOC_SHARDS ||
+    file->doc_shards[0].name == NULL;
+
+  /* Finding the dirs still in use needs all the docs to be written */
+  prune_dirs = file->n_dirs >= DIRS_PRUNE_MIN &&
+    file->n_dirs / 2 >= file->n_live_dirs;
+  if (prune_dirs)
+    rewrite_all = TRUE;
+
+  iter.new_dirs = new_dirs;
+  if (rewrite_all)
+    {
+      used_dirs = g_hash_table_new (NULL, NULL);
+      iter.used_dirs = used_dirs;
+    }
+
+  g_hash_table_iter_init (&updates, doc_updates);
+  while (g_hash_table_iter_next (&updates, &key, NULL))
+    dirty_shards[GPOINTER_TO_UINT (key) % N_DOC_SHARDS] = TRUE;
+
+  for (i = 0; i < N_DOC_SHARDS; i++)
+    {
+      if (!rewrite_all && !dirty_shards[i])
         {
-          char *uri = table_uris[i];
+          g_ptr_array_add (names, g_strdup (file->doc_shards[i].name));
+          continue;
+        }
 
-          if (g_hash_table_lookup (db->uri_updates, uri) != NULL)
-            g_free (uri);
-          else
-            g_ptr_array_add (res, uri);
+      name = g_strdup_printf ("%s.docs-%x.%" G_GUINT64_FORMAT,
+                              basename, i, db->generation);
+      g_ptr_array_add (names, name);
+
+      iter.doc_ids = xdp_doc_db_snapshot_list_shard_docs (snapshot, i);
+      iter.shard = i;
+      res = xdp_doc_db_write_part (dirname, name, "docs", &save_doc_funcs, &iter, NULL, error);
+      g_clear_pointer (&iter.doc_ids, g_free);
+
+      if (!res)
+        return NULL;
+    }
+
+  if (rewrite_all || g_hash_table_size (app_updates) > 0)
+    {
+      name = g_strdup_printf ("%s.apps.%" G_GUINT64_FORMAT, basename, db->generation);
+      g_ptr_array_add (names, name);
+
+      iter.keys = xdp_doc_db_snapshot_list_apps (snapshot);
+      iter.lookup = xdp_doc_db_snapshot_lookup_app;
+      iter.empty = app_empty;
+      res = xdp_doc_db_write_part (dirname, name, "apps", &save_key_funcs, &iter, NULL, error);
+      g_clear_pointer (&iter.keys, g_strfreev);
+
+      if (!res)
+        return NULL;
+    }
+  else
+    g_ptr_array_add (names, g_strdup (file->apps.name));
+
+  if (rewrite_all || g_hash_table_size (uri_updates) > 0)
+    {
+      name = g_strdup_printf ("%s.uris.%" G_GUINT64_FORMAT, basename, db->generation);
+      g_ptr_array_add (names, name);
+
+      iter.keys = xdp_doc_db_snapshot_list_uris (snapshot);
+      iter.lookup = xdp_doc_db_snapshot_lookup_uri;
+      iter.empty = uri_empty;
+      qsort (iter.keys, g_strv_length (iter.keys), sizeof (char *), compare_keys);
+      res = xdp_doc_db_write_part (dirname, name, "uris", &save_key_funcs, &iter,
+                                   g_variant_new_strv ((const char * const *)iter.keys, -1),
+                                   error);
+      g_clear_pointer (&iter.keys, g_strfreev);
+
+      if (!res)
+        return NULL;
+    }
+  else
+    g_ptr_array_add (names, g_strdup (file->uris.name));
+
+  /* Written after the docs, which add the dirs they need. When all
+     the docs were written, only the dirs they use are kept. */
+  n_dirs = file->n_dirs;
+  n_live_dirs = file->n_live_dirs;
+  if (rewrite_all || file->dirs.name == NULL ||
+      g_hash_table_size (new_dirs) > 0)
+    {
+      GArray *dir_ids = g_array_new (TRUE, FALSE, sizeof (guint32));
+      GHashTableIter dirs_iter;
+
+      if (used_dirs == NULL && file->dirs.table)
+        {
+          gint n_old;
+          g_autofree guint32 *old = gvdb_table_get_uint_names (file->dirs.table, &n_old);
+
+          g_array_append_vals (dir_ids, old, n_old);
         }
-      g_free (table_uris);
+
+      g_hash_table_iter_init (&dirs_iter, used_dirs ? used_dirs : new_dirs);
+      while (g_hash_table_iter_next (&dirs_iter, &key, NULL))
+        {
+          guint32 dir_id = GPOINTER_TO_UINT (key);
+          g_array_append_val (dir_ids, dir_id);
+        }
+
+      n_dirs = dir_ids->len;
+      if (used_dirs)
+        n_live_dirs = n_dirs;
+
+      name = g_strdup_printf ("%s.dirs.%" G_GUINT64_FORMAT, basename, db->generation);
+      g_ptr_array_add (names, name);
+
+      iter.doc_ids = (guint32 *)g_array_free (dir_ids, FALSE);
+      res = xdp_doc_db_write_part (dirname, name, "dirs", &save_dir_funcs, &iter, NULL, error);
+      g_clear_pointer (&iter.doc_ids, g_free);
+
+      if (!res)
+        return NULL;
     }
+  else
+    g_ptr_array_add (names, g_strdup (file->dirs.name));
+
+  xdp_metrics_set_gauge ("db.save_dedup_bytes", iter.bytes_saved);
+
+  app_nums = g_variant_ref_sink (xdp_doc_db_snapshot_serialize_app_nums (snapshot));
+
+  /* The parts are all on disk before the manifest replaces the old
+     one, so a crash leaves either the old or the new db */
+  xdp_doc_db_get_writer_options (&options);
+  writer = gvdb_writer_new (db->filename, &options, error);
+  if (writer == NULL)
+    return NULL;
+
+  res =
+    gvdb_writer_add_value (writer, "doc-shards",
+                           g_variant_new_strv ((const char * const *)names->pdata,
+                                               N_DOC_SHARDS),
+                           error) &&
+    gvdb_writer_add_value (writer, "apps-file",
+                           g_variant_new_string (g_ptr_array_index (names, N_DOC_SHARDS)),
+                           error) &&
+    gvdb_writer_add_value (writer, "uris-file",
+                           g_variant_new_string (g_ptr_array_index (names, N_DOC_SHARDS + 1)),
+                           error) &&
+    gvdb_writer_add_value (writer, "dirs-file",
+                           g_variant_new_string (g_ptr_array_index (names, N_DOC_SHARDS + 2)),
+                           error) &&
+    gvdb_writer_add_value (writer, "generation",
+                           g_variant_new_uint64 (db->generation),
+                           error) &&
+    gvdb_writer_add_value (writer, "n-dirs",
+                           g_variant_new_uint32 (n_dirs),
+                           error) &&
+    gvdb_writer_add_value (writer, "n-live-dirs",
+                           g_variant_new_uint32 (n_live_dirs),
+                           error) &&
+    gvdb_writer_add_value (writer, "app-ids", app_nums, error) &&
+    gvdb_writer_finish (writer, error);
+
+  gvdb_writer_free (writer);
+
+  if (!res)
+    return NULL;
+
+  return g_steal_pointer (&names);
+}
 
-  g_ptr_array_add (res, NULL);
-  return (char **)g_ptr_array_free (res, FALSE);
+static const char *
+skip_chars (const char *p,
+            gboolean (*is_char) (gchar c),
+            gsize min_len,
+            gsize max_len)
+{
+  gsize len = 0;
+
+  while (len < max_len && p[len] && is_char (p[len]))
+    len++;
+
+  return len >= min_len ? p + len : NULL;
 }
 
-GVariant *
-xdp_doc_db_lookup_app (XdpDocDb *db,
-                       const char *app_id)
+static gboolean
+is_xdigit (gchar c)
 {
-  GVariant *res;
+  return g_ascii_isxdigit (c);
+}
 
-  res = g_hash_table_lookup (db->app_updates, app_id);
-  if (res)
-    return g_variant_ref (res);
+static gboolean
+is_digit (gchar c)
+{
+  return g_ascii_isdigit (c);
+}
+
+static gboolean
+is_alnum (gchar c)
+{
+  return g_ascii_isalnum (c);
+}
+
+/* Whether name is one of the parts written by xdp_doc_db_write, or a
+   temporary file left over while writing one */
+static gboolean
+is_part_name (const char *name,
+              const char *basename)
+{
+  const char *suffix;
+  const char *p;
+
+  if (!g_str_has_prefix (name, basename) || name[strlen (basename)] != '.')
+    return FALSE;
+  p = name + strlen (basename) + 1;
+
+  if (g_str_has_prefix (p, "docs-"))
+    p = skip_chars (p + strlen ("docs-"), is_xdigit, 1, 8);
+  else if (g_str_has_prefix (p, "apps") ||
+           g_str_has_prefix (p, "uris") ||
+           g_str_has_prefix (p, "dirs"))
+    p += 4;
+  else
+    return FALSE;
 
-  if (db->app_table)
+  if (p == NULL || *p++ != '.')
+    return FALSE;
+
+  p = skip_chars (p, is_digit, 1, 20);
+  if (p == NULL)
+    return FALSE;
+
+  if (*p == 0)
+    return TRUE;
+
+  /* The mkstemp and link suffixes of gvdb_writer */
+  if (*p++ != '.')
+    return FALSE;
+  suffix = p;
+  p = skip_chars (p, is_alnum, 6, 8);
+
+  return p != NULL && *p == 0 && p - suffix != 7;
+}
+
+/* Removes the parts that are no longer in use, and anything left
+   over from failed saves. Returns the size of the files in use. */
+static goffset
+xdp_doc_db_remove_old_parts (XdpDocDb *db,
+                             GPtrArray *names)
+{
+  g_autofree char *dirname = g_path_get_dirname (db->filename);
+  g_autofree char *basename = g_path_get_basename (db->filename);
+  goffset size = 0;
+  const char *name;
+  GDir *dir;
+  guint i;
+
+  dir = g_dir_open (dirname, 0, NULL);
+  if (dir == NULL)
+    return 0;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
     {
-      res = gvdb_table_get_value (db->app_table, app_id);
-      if (res)
-        return g_variant_ref (res);
+      g_autofree char *path = NULL;
+      gboolean in_use;
+      struct stat st_buf;
+
+      in_use = strcmp (name, basename) == 0;
+      for (i = 0; !in_use && i < names->len; i++)
+        in_use = strcmp (name, g_ptr_array_index (names, i)) == 0;
+
+      if (!in_use && !is_part_name (name, basename))
+        continue;
+
+      path = g_build_filename (dirname, name, NULL);
+      if (!in_use)
+        unlink (path);
+      else if (stat (path, &st_buf) == 0)
+        size += st_buf.st_size;
     }
 
-  return NULL;
+  g_dir_close (dir);
+
+  return size;
 }
 
-GVariant *
-xdp_doc_db_lookup_uri (XdpDocDb *db, const char *uri)
+static gboolean
+xdp_doc_db_save_unlocked (XdpDocDb *db,
+                          GError **error)
 {
-  GVariant *res;
+  g_autofree char *dirname = g_path_get_dirname (db->filename);
+  g_autoptr(GPtrArray) names = NULL;
+  XdpDocDbSnapshot *snapshot = xdp_doc_db_get_writer_snapshot (db);
+  XdpDocDbFile *file;
+  GvdbTable *gvdb;
+  gint64 start = g_get_monotonic_time ();
 
-  res = g_hash_table_lookup (db->uri_updates, uri);
-  if (res)
-    return g_variant_ref (res);
+  names = xdp_doc_db_write (db, snapshot, error);
+  if (names == NULL)
+    {
+      xdp_metrics_record ("db.save", g_get_monotonic_time () - start, TRUE);
+      return FALSE;
+    }
 
-  if (db->uri_table)
+  gvdb = gvdb_table_new (db->filename, TRUE, error);
+  file = gvdb ? xdp_doc_db_file_new (dirname, gvdb, error) : NULL;
+  if (file == NULL)
     {
-      res = gvdb_table_get_value (db->uri_table, uri);
-      if (res)
-        return g_variant_ref (res);
+      xdp_metrics_record ("db.save", g_get_monotonic_time () - start, TRUE);
+      return FALSE;
     }
 
-  return NULL;
+  xdp_metrics_record ("db.save", g_get_monotonic_time () - start, FALSE);
+  xdp_metrics_set_gauge ("db.size", xdp_doc_db_remove_old_parts (db, names));
+
+  /* The new file has everything, so start over with empty overlays.
+     Any pending changes are in the file too. */
+  g_clear_pointer (&db->next, xdp_doc_db_snapshot_unref);
+  xdp_doc_db_replace_snapshot (db, xdp_doc_db_snapshot_new (file));
+
+  db->dirty = FALSE;
+
+  return TRUE;
+}
+
+gboolean
+xdp_doc_db_is_dirty (XdpDocDb *db)
+{
+  gboolean dirty;
+
+  g_mutex_lock (&db->write_lock);
+  dirty = db->dirty;
+  g_mutex_unlock (&db->write_lock);
+
+  return dirty;
+}
+
+void
+xdp_doc_db_dump (XdpDocDb *db)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+  int i;
+  guint32 *docs;
+  char **apps, **uris;
+
+  g_print ("docs:\n");
+  docs = xdp_doc_db_snapshot_list_docs (snapshot);
+  for (i = 0; docs[i] != 0; i++)
+    {
+      g_autoptr(GVariant) doc = xdp_doc_db_snapshot_lookup_doc (snapshot, docs[i]);
+      if (doc)
+        g_print (" %x: %s\n", docs[i], g_variant_print (doc, FALSE));
+    }
+  g_free (docs);
+
+  g_print ("apps:\n");
+  apps = xdp_doc_db_snapshot_list_apps (snapshot);
+  for (i = 0; apps[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) app = xdp_doc_db_snapshot_lookup_app (snapshot, apps[i]);
+      g_print (" %s: %s\n", apps[i], g_variant_print (app, FALSE));
+    }
+  g_strfreev (apps);
+
+  g_print ("uris:\n");
+  uris = xdp_doc_db_snapshot_list_uris (snapshot);
+  for (i = 0; uris[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) uri = xdp_doc_db_snapshot_lookup_uri (snapshot, uris[i]);
+      g_print (" %s: %s\n", uris[i], g_variant_print (uri, FALSE));
+    }
+  g_strfreev (uris);
 }
 
 static void
@@ -498,7 +2553,8 @@ xdp_doc_db_update_uri_docs (XdpDocDb *db,
   GVariant *res, *array;
   g_autoptr(GVariant) doc_array = NULL;
 
-  old_uri = xdp_doc_db_lookup_app (db, uri);
+  old_uri = xdp_doc_db_snapshot_lookup_uri (xdp_doc_db_get_writer_snapshot (db),
+                                            uri);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
 
@@ -518,18 +2574,95 @@ xdp_doc_db_update_uri_docs (XdpDocDb *db,
           else
             g_variant_builder_add_value (&builder, child);
 
-          g_variant_unref (child);
-        }
+          g_variant_unref (child);
+        }
+    }
+
+  if (added)
+    g_variant_builder_add (&builder, "u", doc_id);
+
+  array = g_variant_builder_end (&builder);
+  res = g_variant_new_tuple (&array, 1);
+
+  g_hash_table_insert (xdp_doc_db_get_writable_snapshot (db)->uri_updates,
+                       g_strdup (uri),
+                       g_variant_ref_sink (res));
+}
+
+static void
+xdp_doc_db_note_change (XdpDocDb *db,
+                        guint32 doc_id)
+{
+  db->dirty = TRUE;
+  db->generation++;
+  db->change_ring[db->generation % CHANGE_RING_SIZE] = doc_id;
+}
+
+/* The changes are published and the signal is emitted after
+   unlocking, so that handlers can use the db */
+static void
+xdp_doc_db_unlock_and_notify (XdpDocDb *db,
+                              guint64 old_generation,
+                              guint32 doc_id)
+{
+  guint64 generation = db->generation;
+
+  xdp_doc_db_publish (db);
+  g_mutex_unlock (&db->write_lock);
+
+  if (generation != old_generation)
+    g_signal_emit (db, signals[DOC_CHANGED], 0, doc_id, generation);
+}
+
+guint64
+xdp_doc_db_get_generation (XdpDocDb *db)
+{
+  guint64 generation;
+
+  g_mutex_lock (&db->write_lock);
+  generation = db->generation;
+  g_mutex_unlock (&db->write_lock);
+
+  return generation;
+}
+
+/* Returns the ids of the docs changed after generation @since, or
+   NULL if that is too far back to know */
+guint32 *
+xdp_doc_db_get_changes_since (XdpDocDb *db,
+                              guint64 since)
+{
+  g_autoptr(GHashTable) seen = NULL;
+  guint64 oldest;
+  guint64 gen;
+  GArray *res;
+
+  g_mutex_lock (&db->write_lock);
+
+  oldest = db->change_ring_base;
+  if (db->generation > CHANGE_RING_SIZE)
+    oldest = MAX (oldest, db->generation - CHANGE_RING_SIZE);
+
+  if (since < oldest || since > db->generation)
+    {
+      g_mutex_unlock (&db->write_lock);
+      return NULL;
     }
 
-  if (added)
-    g_variant_builder_add (&builder, "u", doc_id);
+  seen = g_hash_table_new (NULL, NULL);
+  res = g_array_new (TRUE, FALSE, sizeof (guint32));
 
-  array = g_variant_builder_end (&builder);
-  res = g_variant_new_tuple (&array, 1);
+  for (gen = since + 1; gen <= db->generation; gen++)
+    {
+      guint32 doc_id = db->change_ring[gen % CHANGE_RING_SIZE];
 
-  g_hash_table_insert (db->uri_updates, g_strdup (uri),
-                       g_variant_ref_sink (res));
+      if (g_hash_table_add (seen, GUINT_TO_POINTER (doc_id)))
+        g_array_append_val (res, doc_id);
+    }
+
+  g_mutex_unlock (&db->write_lock);
+
+  return (guint32 *)g_array_free (res, FALSE);
 }
 
 static void
@@ -537,23 +2670,25 @@ xdp_doc_db_insert_doc (XdpDocDb *db,
                        guint32 doc_id,
                        GVariant *doc)
 {
-  g_hash_table_insert (db->doc_updates, xdb_doc_name_from_id (doc_id),
+  g_hash_table_insert (xdp_doc_db_get_writable_snapshot (db)->doc_updates,
+                       GUINT_TO_POINTER (doc_id),
                        g_variant_ref_sink (doc));
   db->dirty = TRUE;
 
   xdp_doc_db_update_uri_docs (db, xdp_doc_get_uri (doc), doc_id, TRUE);
 }
 
-guint32
-xdp_doc_db_create_doc (XdpDocDb *db,
-                       const char *uri)
+static guint32
+xdp_doc_db_create_doc_unlocked (XdpDocDb *db,
+                                const char *uri)
 {
   GVariant *doc;
   guint32 doc_id;
   g_autoptr (GVariant) uri_v = NULL;
 
   /* Reuse pre-existing entry with same uri */
-  uri_v = xdp_doc_db_lookup_uri (db, uri);
+  uri_v = xdp_doc_db_snapshot_lookup_uri (xdp_doc_db_get_writer_snapshot (db),
+                                          uri);
   if (uri_v != NULL)
     {
       g_autoptr(GVariant) doc_array = g_variant_get_child_value (uri_v, 0);
@@ -570,7 +2705,8 @@ xdp_doc_db_create_doc (XdpDocDb *db,
 
       doc_id = (guint32)g_random_int ();
 
-      existing_doc = xdp_doc_db_lookup_doc (db, doc_id);
+      existing_doc = xdp_doc_db_snapshot_lookup_doc (xdp_doc_db_get_writer_snapshot (db),
+                                                     doc_id);
       if (existing_doc == NULL)
         break;
     }
@@ -578,24 +2714,29 @@ xdp_doc_db_create_doc (XdpDocDb *db,
   doc = xdp_doc_new (uri,
                      g_variant_new_array (G_VARIANT_TYPE ("(su)"), NULL, 0));
   xdp_doc_db_insert_doc (db, doc_id, doc);
+  xdp_doc_db_note_change (db, doc_id);
 
   return doc_id;
 }
 
+/* Applies a set of doc id => added changes to the reverse map of
+   one app */
 static void
-xdp_doc_db_update_app_docs (XdpDocDb *db,
-                            const char *app_id,
-                            guint32 doc_id,
-                            gboolean added)
+xdp_doc_db_rewrite_app_docs (XdpDocDb *db,
+                             const char *app_id,
+                             GHashTable *changes)
 {
   g_autoptr(GVariant) old_app = NULL;
   GVariantBuilder builder;
   GVariantIter iter;
+  GHashTableIter changes_iter;
+  gpointer key, value;
   GVariant *child;
   GVariant *res, *array;
   g_autoptr(GVariant) doc_array = NULL;
 
-  old_app = xdp_doc_db_lookup_app (db, app_id);
+  old_app = xdp_doc_db_snapshot_lookup_app (xdp_doc_db_get_writer_snapshot (db),
+                                            app_id);
 
   g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
 
@@ -607,9 +2748,10 @@ xdp_doc_db_update_app_docs (XdpDocDb *db,
         {
           guint32 child_doc_id = g_variant_get_uint32 (child);
 
-          if (doc_id == child_doc_id)
+          if (g_hash_table_lookup_extended (changes, GUINT_TO_POINTER (child_doc_id),
+                                            NULL, &value))
             {
-              if (added)
+              if (GPOINTER_TO_INT (value))
                 g_warning ("added doc already exist");
             }
           else
@@ -620,19 +2762,113 @@ xdp_doc_db_update_app_docs (XdpDocDb *db,
 
     }
 
-  if (added)
-    g_variant_builder_add (&builder, "u", doc_id);
+  g_hash_table_iter_init (&changes_iter, changes);
+  while (g_hash_table_iter_next (&changes_iter, &key, &value))
+    {
+      if (GPOINTER_TO_INT (value))
+        g_variant_builder_add (&builder, "u", GPOINTER_TO_UINT (key));
+    }
 
   array = g_variant_builder_end (&builder);
   res = g_variant_new_tuple (&array, 1);
 
-  g_hash_table_insert (db->app_updates, g_strdup (app_id),
+  g_hash_table_insert (xdp_doc_db_get_writable_snapshot (db)->app_updates,
+                       g_strdup (app_id),
                        g_variant_ref_sink (res));
 }
 
-gboolean
-xdp_doc_db_delete_doc (XdpDocDb *db,
-                       guint32   doc_id)
+static void
+xdp_doc_db_update_app_docs (XdpDocDb *db,
+                            const char *app_id,
+                            guint32 doc_id,
+                            gboolean added)
+{
+  GHashTable *changes;
+
+  if (db->transaction_depth > 0)
+    {
+      changes = g_hash_table_lookup (db->pending_app_docs, app_id);
+      if (changes == NULL)
+        {
+          changes = g_hash_table_new (NULL, NULL);
+          g_hash_table_insert (db->pending_app_docs, g_strdup (app_id), changes);
+        }
+
+      /* An add and a remove of the same doc cancel out */
+      if (g_hash_table_contains (changes, GUINT_TO_POINTER (doc_id)))
+        g_hash_table_remove (changes, GUINT_TO_POINTER (doc_id));
+      else
+        g_hash_table_insert (changes, GUINT_TO_POINTER (doc_id), GINT_TO_POINTER (added));
+    }
+  else
+    {
+      changes = g_hash_table_new (NULL, NULL);
+      g_hash_table_insert (changes, GUINT_TO_POINTER (doc_id), GINT_TO_POINTER (added));
+      xdp_doc_db_rewrite_app_docs (db, app_id, changes);
+      g_hash_table_unref (changes);
+    }
+}
+
+/* Groups a set of changes, so that the reverse app map is rewritten
+   only once per app, on the outermost commit. Readers don't see any
+   of the changes until the commit. Transactions can be nested. */
+void
+xdp_doc_db_begin (XdpDocDb *db)
+{
+  g_mutex_lock (&db->write_lock);
+  /* Nothing from before is pending, so an abort only drops the
+     changes of the transaction */
+  xdp_doc_db_publish (db);
+  db->transaction_depth++;
+  g_mutex_unlock (&db->write_lock);
+}
+
+void
+xdp_doc_db_commit (XdpDocDb *db)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_mutex_lock (&db->write_lock);
+
+  if (db->transaction_depth == 0)
+    g_critical ("xdp_doc_db_commit without begin");
+  else if (--db->transaction_depth == 0)
+    {
+      g_hash_table_iter_init (&iter, db->pending_app_docs);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        xdp_doc_db_rewrite_app_docs (db, key, value);
+
+      g_hash_table_remove_all (db->pending_app_docs);
+      xdp_doc_db_publish (db);
+    }
+
+  g_mutex_unlock (&db->write_lock);
+}
+
+/* Ends the outermost transaction, dropping its changes. The
+   generation stays bumped, so change listeners may look at docs that
+   are as they were. */
+void
+xdp_doc_db_abort (XdpDocDb *db)
+{
+  g_mutex_lock (&db->write_lock);
+
+  if (db->transaction_depth != 1)
+    g_critical ("xdp_doc_db_abort outside of an outermost transaction");
+  else
+    {
+      db->transaction_depth = 0;
+      g_hash_table_remove_all (db->pending_app_docs);
+      g_clear_pointer (&db->next, xdp_doc_db_snapshot_unref);
+    }
+
+  g_mutex_unlock (&db->write_lock);
+}
+
+static gboolean
+xdp_doc_db_delete_doc_unlocked (XdpDocDb *db,
+                                guint32   doc_id)
 {
   g_autoptr(GVariant) old_doc = NULL;
   g_autoptr(GVariant) old_perms = NULL;
@@ -640,14 +2876,15 @@ xdp_doc_db_delete_doc (XdpDocDb *db,
   GVariant *child;
   GVariantIter iter;
 
-  old_doc = xdp_doc_db_lookup_doc (db, doc_id);
+  old_doc = xdp_doc_db_snapshot_lookup_doc (xdp_doc_db_get_writer_snapshot (db),
+                                            doc_id);
   if (old_doc == NULL)
     {
       g_warning ("no doc %x found", doc_id);
       return FALSE;
     }
 
-  xdp_doc_db_insert_doc (db, doc_id, db->no_doc);
+  xdp_doc_db_insert_doc (db, doc_id, no_doc);
 
   app_array = g_variant_get_child_value (old_doc, 1);
   g_variant_iter_init (&iter, app_array);
@@ -663,15 +2900,45 @@ xdp_doc_db_delete_doc (XdpDocDb *db,
 
   xdp_doc_db_update_uri_docs (db, xdp_doc_get_uri (old_doc),
                               doc_id, FALSE);
+  xdp_doc_db_note_change (db, doc_id);
+
   return TRUE;
 }
 
-gboolean
-xdp_doc_db_set_permissions (XdpDocDb *db,
-                            guint32 doc_id,
-                            const char *app_id,
-                            XdpPermissionFlags permissions,
-                            gboolean merge)
+/* Returns the numeric id of the app, giving it the next one if it has
+   none, or 0 if the ids have run out */
+static guint32
+xdp_doc_db_add_app_unlocked (XdpDocDb *db,
+                             const char *app_id)
+{
+  XdpDocDbSnapshot *snapshot = xdp_doc_db_get_writer_snapshot (db);
+  guint32 num;
+
+  num = xdp_doc_db_snapshot_get_app_num (snapshot, app_id);
+  if (num != 0)
+    return num;
+
+  /* XDP_APP_NUM_MAX itself is the fuse homedir dir */
+  if (snapshot->n_app_nums + 1 >= XDP_APP_NUM_MAX)
+    return 0;
+
+  snapshot = xdp_doc_db_get_writable_snapshot (db);
+  num = ++snapshot->n_app_nums;
+  g_hash_table_insert (snapshot->app_num_updates, g_strdup (app_id),
+                       g_variant_ref_sink (g_variant_new_uint32 (num)));
+  g_hash_table_insert (snapshot->app_name_updates, GUINT_TO_POINTER (num),
+                       g_variant_ref_sink (g_variant_new_string (app_id)));
+  db->dirty = TRUE;
+
+  return num;
+}
+
+static gboolean
+xdp_doc_db_set_permissions_unlocked (XdpDocDb *db,
+                                     guint32 doc_id,
+                                     const char *app_id,
+                                     XdpPermissionFlags permissions,
+                                     gboolean merge)
 {
   g_autoptr(GVariant) old_doc;
   g_autoptr (GVariant) app_array = NULL;
@@ -681,13 +2948,23 @@ xdp_doc_db_set_permissions (XdpDocDb *db,
   GVariantBuilder builder;
   gboolean found = FALSE;
 
-  old_doc = xdp_doc_db_lookup_doc (db, doc_id);
+  old_doc = xdp_doc_db_snapshot_lookup_doc (xdp_doc_db_get_writer_snapshot (db),
+                                            doc_id);
   if (old_doc == NULL)
     {
       g_warning ("no doc %x found", doc_id);
       return FALSE;
     }
 
+  /* The permissions are stored under the numeric id of the app, so
+     granting fails if there is none to give */
+  if (permissions != 0 &&
+      xdp_doc_db_add_app_unlocked (db, app_id) == 0)
+    {
+      g_warning ("No numeric id left for app %s", app_id);
+      return FALSE;
+    }
+
   g_variant_builder_init (&builder, G_VARIANT_TYPE_ARRAY);
 
   app_array = g_variant_get_child_value (old_doc, 1);
@@ -719,7 +2996,8 @@ xdp_doc_db_set_permissions (XdpDocDb *db,
 
   doc = xdp_doc_new (xdp_doc_get_uri (old_doc),
                      g_variant_builder_end (&builder));
-  g_hash_table_insert (db->doc_updates, xdb_doc_name_from_id (doc_id),
+  g_hash_table_insert (xdp_doc_db_get_writable_snapshot (db)->doc_updates,
+                       GUINT_TO_POINTER (doc_id),
                        g_variant_ref_sink (doc));
 
   if (found && permissions == 0)
@@ -727,42 +3005,303 @@ xdp_doc_db_set_permissions (XdpDocDb *db,
   else if (!found && permissions != 0)
     xdp_doc_db_update_app_docs (db, app_id, doc_id, TRUE);
 
-  db->dirty = TRUE;
+  xdp_doc_db_note_change (db, doc_id);
 
   return TRUE;
 }
 
-XdpPermissionFlags
-xdp_doc_get_permissions (GVariant *doc,
-                         const char *app_id)
+gboolean
+xdp_doc_db_save (XdpDocDb *db,
+                 GError **error)
 {
-  g_autoptr(GVariant) app_array = NULL;
-  GVariantIter iter;
-  GVariant *child;
+  gboolean res;
 
-  if (strcmp (app_id, "") == 0)
-    return XDP_PERMISSION_FLAGS_ALL;
+  g_mutex_lock (&db->write_lock);
+  res = xdp_doc_db_save_unlocked (db, error);
+  g_mutex_unlock (&db->write_lock);
 
-  app_array = g_variant_get_child_value (doc, 1);
+  return res;
+}
 
-  g_variant_iter_init (&iter, app_array);
-  while ((child = g_variant_iter_next_value (&iter)))
+GVariant *
+xdp_doc_db_lookup_doc_name (XdpDocDb *db,
+                            const char *doc_id)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_lookup_doc_name (snapshot, doc_id);
+}
+
+GVariant *
+xdp_doc_db_lookup_doc (XdpDocDb *db,
+                       guint32 doc_id)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_lookup_doc (snapshot, doc_id);
+}
+
+static gboolean
+xdp_doc_db_snapshot_lookup_doc_view (XdpDocDbSnapshot *snapshot,
+                                     guint32 doc_id,
+                                     XdpDocView *view)
+{
+  GvdbTable *doc_table = xdp_doc_db_file_get_doc_table (snapshot->file, doc_id);
+  XdpDocDbFile *file = NULL;
+  const guint8 *data = NULL;
+  gboolean byteswapped = FALSE;
+  GVariant *doc;
+  gsize size = 0;
+  gsize doc_size;
+
+  doc = xdp_doc_db_snapshot_lookup_update (snapshot, DOC_UPDATES,
+                                           GUINT_TO_POINTER (doc_id));
+  if (doc)
     {
-      const char *child_app_id;
-      guint32 perms;
+      if (doc != no_doc)
+        {
+          data = g_variant_get_data (doc);
+          size = g_variant_get_size (doc);
+        }
+    }
+  else if (doc_table != NULL)
+    {
+      if (gvdb_table_has_uint_keys (doc_table))
+        data = gvdb_table_get_raw_data_uint (doc_table, doc_id, &size);
+      else
+        {
+          char id_num[9];
 
-      g_variant_get_child (child, 0, "&s", &child_app_id);
+          g_sprintf (id_num, "%x", (guint32)doc_id);
+          data = gvdb_table_get_raw_data (doc_table, id_num, &size);
+        }
 
-      if (strcmp (app_id, child_app_id) == 0)
+      if (data)
         {
-          g_variant_get_child (child, 1, "u", &perms);
-          return perms;
+          doc_size = xdp_doc_view_unwrap (data, size, STORED_DOC_TYPE);
+          if (doc_size > 0)
+            file = snapshot->file;
+          else
+            doc_size = xdp_doc_view_unwrap (data, size, DOC_TYPE);
+          size = doc_size;
         }
+      byteswapped = gvdb_table_is_byteswapped (doc_table);
+    }
 
-      g_variant_unref (child);
+  if (data == NULL ||
+      !xdp_doc_view_init (view, data, size, byteswapped, file))
+    {
+      memset (view, 0, sizeof *view);
+      return FALSE;
     }
 
-  return 0;
+  view->snapshot = xdp_doc_db_snapshot_ref (snapshot);
+  return TRUE;
+}
+
+/* Like xdp_doc_db_lookup_doc(), but without allocating. The view
+   holds a ref on the snapshot it was read from, and is left empty if
+   there is no such doc. */
+gboolean
+xdp_doc_db_lookup_doc_view (XdpDocDb *db,
+                            guint32 doc_id,
+                            XdpDocView *view)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_lookup_doc_view (snapshot, doc_id, view);
+}
+
+/* Lists the docs that @app_id has all of @permissions for. Only the
+   docs of the app in the reverse map are looked at, not all docs. */
+guint32 *
+xdp_doc_db_list_app_docs (XdpDocDb *db,
+                          const char *app_id,
+                          XdpPermissionFlags permissions)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+  g_autoptr(GVariant) app = NULL;
+  g_autoptr(GVariant) doc_array = NULL;
+  const guint32 *doc_ids = NULL;
+  gsize n_docs = 0, i;
+  GArray *res;
+
+  res = g_array_new (TRUE, FALSE, sizeof (guint32));
+
+  app = xdp_doc_db_snapshot_lookup_app (snapshot, app_id);
+  if (app)
+    {
+      doc_array = g_variant_get_child_value (app, 0);
+      doc_ids = g_variant_get_fixed_array (doc_array, &n_docs, sizeof (guint32));
+    }
+
+  for (i = 0; i < n_docs; i++)
+    {
+      g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
+
+      if (xdp_doc_db_snapshot_lookup_doc_view (snapshot, doc_ids[i], &doc) &&
+          xdp_doc_view_has_permissions (&doc, app_id, permissions))
+        g_array_append_val (res, doc_ids[i]);
+    }
+
+  return (guint32 *)g_array_free (res, FALSE);
+}
+
+GVariant *
+xdp_doc_db_lookup_app (XdpDocDb *db,
+                       const char *app_id)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_lookup_app (snapshot, app_id);
+}
+
+GVariant *
+xdp_doc_db_lookup_uri (XdpDocDb *db,
+                       const char *uri)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_lookup_uri (snapshot, uri);
+}
+
+guint32 *
+xdp_doc_db_list_docs (XdpDocDb *db)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_list_docs (snapshot);
+}
+
+/* Lists the docs for files anywhere inside the directory @path */
+guint32 *
+xdp_doc_db_list_docs_under (XdpDocDb *db,
+                            const char *path)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+  g_autofree char *prefix = xdp_doc_dir_uri_prefix (path);
+
+  return xdp_doc_db_snapshot_list_docs_with_prefix (snapshot, prefix);
+}
+
+char **
+xdp_doc_db_list_apps (XdpDocDb *db)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_list_apps (snapshot);
+}
+
+char **
+xdp_doc_db_list_uris (XdpDocDb *db)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_list_uris (snapshot);
+}
+
+/* The numeric id of an app, which stays the same across restarts.
+   Ids start at 1 and go up to XDP_APP_NUM_MAX. Returns 0 if the app
+   has none, which is the case until it is first granted something. */
+guint32
+xdp_doc_db_get_app_num (XdpDocDb *db,
+                        const char *app_id)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return xdp_doc_db_snapshot_get_app_num (snapshot, app_id);
+}
+
+/* Gives the app a numeric id ahead of granting it permissions, so
+   that callers can fail before changing anything. Returns FALSE if
+   the ids have run out. */
+gboolean
+xdp_doc_db_add_app (XdpDocDb *db,
+                    const char *app_id)
+{
+  guint32 num;
+
+  g_mutex_lock (&db->write_lock);
+  num = xdp_doc_db_add_app_unlocked (db, app_id);
+  xdp_doc_db_publish (db);
+  g_mutex_unlock (&db->write_lock);
+
+  return num != 0;
+}
+
+/* Returns NULL for unknown ids */
+char *
+xdp_doc_db_dup_app_from_num (XdpDocDb *db,
+                             guint32 num)
+{
+  g_autoptr(XdpDocDbSnapshot) snapshot = xdp_doc_db_get_snapshot (db);
+
+  return g_strdup (xdp_doc_db_snapshot_get_app_name (snapshot, num));
+}
+
+guint32
+xdp_doc_db_create_doc (XdpDocDb *db,
+                       const char *uri)
+{
+  guint64 old_generation;
+  guint32 doc_id;
+
+  g_mutex_lock (&db->write_lock);
+  old_generation = db->generation;
+  doc_id = xdp_doc_db_create_doc_unlocked (db, uri);
+  xdp_doc_db_unlock_and_notify (db, old_generation, doc_id);
+
+  return doc_id;
+}
+
+gboolean
+xdp_doc_db_delete_doc (XdpDocDb *db,
+                       guint32 doc_id)
+{
+  guint64 old_generation;
+  gboolean res;
+
+  g_mutex_lock (&db->write_lock);
+  old_generation = db->generation;
+  res = xdp_doc_db_delete_doc_unlocked (db, doc_id);
+  xdp_doc_db_unlock_and_notify (db, old_generation, doc_id);
+
+  return res;
+}
+
+gboolean
+xdp_doc_db_set_permissions (XdpDocDb *db,
+                            guint32 doc_id,
+                            const char *app_id,
+                            XdpPermissionFlags permissions,
+                            gboolean merge)
+{
+  guint64 old_generation;
+  gboolean res;
+
+  g_mutex_lock (&db->write_lock);
+  old_generation = db->generation;
+  res = xdp_doc_db_set_permissions_unlocked (db, doc_id, app_id,
+                                             permissions, merge);
+  xdp_doc_db_unlock_and_notify (db, old_generation, doc_id);
+
+  return res;
+}
+
+XdpPermissionFlags
+xdp_doc_get_permissions (GVariant *doc,
+                         const char *app_id)
+{
+  XdpDocView view;
+
+  if (strcmp (app_id, "") == 0)
+    return XDP_PERMISSION_FLAGS_ALL;
+
+  if (!xdp_doc_view_init (&view, g_variant_get_data (doc),
+                          g_variant_get_size (doc), FALSE, NULL))
+    return 0;
+
+  return xdp_doc_view_get_permissions (&view, app_id);
 }
 
 gboolean
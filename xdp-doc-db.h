@@ -11,11 +11,41 @@ G_BEGIN_DECLS
 
 G_DECLARE_FINAL_TYPE(XdpDocDb, xdp_doc_db, XDP, DOC_DB, GObject);
 
+/* Numeric app ids are below this, so that they fit in fuse inodes
+   next to a doc id */
+#define XDP_APP_NUM_MAX 0x00ffffff
+
+/* A borrowed view of a document, parsed in place from the serialised
+   doc so that reading it does not allocate. Keeps the data it points
+   into alive until cleared. */
+typedef struct {
+  /*< private >*/
+  gpointer snapshot;
+  gpointer doc_path;
+  gpointer app_nums;
+  const char *dir;
+  const char *uri;
+  const guint8 *perms;
+  gsize perms_size;
+  gsize perms_offsets;
+  guint n_perms;
+  guint8 offset_size;
+  gboolean byteswapped;
+} XdpDocView;
+
+#define XDP_DOC_VIEW_INIT { NULL, }
+
 XdpDocDb *         xdp_doc_db_new             (const char          *filename,
                                                GError             **error);
 gboolean           xdp_doc_db_save            (XdpDocDb            *db,
                                                GError             **error);
 gboolean           xdp_doc_db_is_dirty        (XdpDocDb            *db);
+void               xdp_doc_db_begin           (XdpDocDb            *db);
+void               xdp_doc_db_commit          (XdpDocDb            *db);
+void               xdp_doc_db_abort           (XdpDocDb            *db);
+guint64            xdp_doc_db_get_generation  (XdpDocDb            *db);
+guint32 *          xdp_doc_db_get_changes_since (XdpDocDb          *db,
+                                                 guint64            since);
 void               xdp_doc_db_dump            (XdpDocDb            *db);
 GVariant *         xdp_doc_db_lookup_doc_name (XdpDocDb            *db,
                                                const char          *doc_name);
@@ -25,9 +55,23 @@ GVariant *         xdp_doc_db_lookup_app      (XdpDocDb            *db,
                                                const char          *app_id);
 GVariant *         xdp_doc_db_lookup_uri      (XdpDocDb            *db,
                                                const char          *uri);
+gboolean           xdp_doc_db_lookup_doc_view (XdpDocDb            *db,
+                                               guint32              doc_id,
+                                               XdpDocView          *view);
 guint32*           xdp_doc_db_list_docs       (XdpDocDb            *db);
+guint32*           xdp_doc_db_list_docs_under (XdpDocDb            *db,
+                                               const char          *path);
+guint32*           xdp_doc_db_list_app_docs   (XdpDocDb            *db,
+                                               const char          *app_id,
+                                               XdpPermissionFlags   permissions);
 char **            xdp_doc_db_list_apps       (XdpDocDb            *db);
 char **            xdp_doc_db_list_uris       (XdpDocDb            *db);
+guint32            xdp_doc_db_get_app_num     (XdpDocDb            *db,
+                                               const char          *app_id);
+gboolean           xdp_doc_db_add_app         (XdpDocDb            *db,
+                                               const char          *app_id);
+char *             xdp_doc_db_dup_app_from_num (XdpDocDb           *db,
+                                                guint32             num);
 guint32            xdp_doc_db_create_doc      (XdpDocDb            *db,
                                                const char          *uri);
 gboolean           xdp_doc_db_delete_doc      (XdpDocDb            *db,
@@ -45,10 +89,33 @@ gboolean           xdp_doc_has_permissions    (GVariant            *doc,
                                                XdpPermissionFlags   permissions);
 guint32            xdb_doc_id_from_name       (const char          *name);
 char *             xdb_doc_name_from_id       (guint32              doc_id);
+char *             xdp_doc_dir_uri_prefix     (const char          *path);
 const char *       xdp_doc_get_uri            (GVariant            *doc);
 char *             xdp_doc_dup_path           (GVariant            *doc);
-char *             xdp_doc_dup_basename       (GVariant            *doc);
-char *             xdp_doc_dup_dirname        (GVariant            *doc);
+
+void               xdp_doc_view_clear         (XdpDocView          *view);
+void               xdp_doc_view_move          (XdpDocView          *dest,
+                                               XdpDocView          *src);
+gboolean           xdp_doc_view_is_set        (XdpDocView          *view);
+const char *       xdp_doc_view_get_uri       (XdpDocView          *view);
+guint              xdp_doc_view_get_n_perms   (XdpDocView          *view);
+const char *       xdp_doc_view_get_perm      (XdpDocView          *view,
+                                               guint                index,
+                                               XdpPermissionFlags  *permissions);
+XdpPermissionFlags xdp_doc_view_get_permissions (XdpDocView        *view,
+                                                 const char        *app_id);
+gboolean           xdp_doc_view_has_permissions (XdpDocView        *view,
+                                                 const char        *app_id,
+                                                 XdpPermissionFlags permissions);
+gboolean           xdp_doc_view_has_uri_prefix (XdpDocView         *view,
+                                                const char         *prefix);
+const char *       xdp_doc_view_get_path      (XdpDocView          *view);
+const char *       xdp_doc_view_get_basename  (XdpDocView          *view);
+const char *       xdp_doc_view_get_dirname   (XdpDocView          *view);
+const char *       xdp_doc_view_get_app_name  (XdpDocView          *view,
+                                               guint32              num);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (XdpDocView, xdp_doc_view_clear)
 
 G_END_DECLS
 
@@ -16,6 +16,7 @@
 
 #include "xdp-error.h"
 #include "xdp-fuse.h"
+#include "xdp-metrics.h"
 
 /* Layout:
 
@@ -24,7 +25,7 @@
       "org.gnome.gedit/" (APP_DIR:app id)
         "$id/" (APP_DOC_DIR:app_id<<32|doc_id)
           <same as DOC_DIR>
-    "in-homedir/" (APP_DOC_DIR:1)
+    "in-homedir/" (APP_DIR:XDP_APP_NUM_MAX)
     "$id" (DOC_DIR:doc_idid)
       $basename (DOC_FILE:doc_id)
       $tmpfile (TMPFILE:tmp_id)
@@ -32,7 +33,9 @@
 
 #define BY_APP_INO 2
 
-#define IN_HOMEDIR_APP_ID 1
+/* The app ids are the numeric ids from the db, which are the same
+   across restarts, so this one is above them */
+#define IN_HOMEDIR_APP_ID XDP_APP_NUM_MAX
 
 #define NON_DOC_DIR_PERMS 0500
 #define DOC_DIR_PERMS 0700
@@ -60,9 +63,9 @@ typedef enum {
 
 static XdpDocDb *db;
 
-static GHashTable *app_name_to_id;
-static GHashTable *app_id_to_name;
-static guint32 next_app_id;
+/* The uri prefix of docs in in-homedir, computed once so that
+   checking a doc doesn't need its path */
+static char *home_uri_prefix;
 
 static guint32 next_tmp_id;
 
@@ -90,6 +93,79 @@ typedef struct
 static GList *tmp_files = NULL;
 static GList *open_files = NULL;
 
+/* The outcome of the request being handled, for the metrics. It lives
+   on the stack of the handler wrapper, and the thread handling the
+   request points to it. */
+typedef struct
+{
+  gboolean failed;
+} XdpFuseOpState;
+
+static GPrivate current_op_state;
+
+static int
+xdp_reply_err (fuse_req_t req,
+               int err)
+{
+  XdpFuseOpState *state = g_private_get (&current_op_state);
+
+  g_warn_if_fail (err != 0);
+
+  if (state != NULL)
+    state->failed = TRUE;
+
+  return fuse_reply_err (req, err);
+}
+
+/* For ops that succeed without returning anything */
+static int
+xdp_reply_ok (fuse_req_t req)
+{
+  return fuse_reply_err (req, 0);
+}
+
+/* We keep O_PATH fds for the directories that contain documents, so
+   we can use the *at() syscalls with just the basename instead of
+   walking the full path on every operation. */
+#define DIR_FD_CACHE_SIZE 64
+#define DIR_FD_CACHE_TIME (1 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  char *path;
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  gint64 validated;
+  GList link;
+} XdpDirFd;
+
+static GHashTable *dir_fds;
+static GQueue dir_fd_lru = G_QUEUE_INIT;
+
+/* Read-only fds of recently opened documents, so that repeated opens
+   of the same file can just dup the fd. The fds that have not been
+   used for a while are closed, so they don't keep deleted files
+   around. */
+#define BACKING_FD_CACHE_SIZE 32
+#define BACKING_FD_CACHE_TIME (1 * G_USEC_PER_SEC)
+
+typedef struct
+{
+  dev_t dev;
+  ino_t ino;
+  /* Any change to the owner or the mode bumps the ctime */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec ctime;
+  gint64 used;
+  int fd;
+  GList link;
+} XdpBackingFd;
+
+static GQueue backing_fd_lru = G_QUEUE_INIT;
+
 static XdpTmp *
 find_tmp_by_name (guint64 parent_inode,
                   const char *name)
@@ -188,41 +264,222 @@ name_looks_like_id (const char *name)
 static guint32
 get_app_id_from_name (const char *name)
 {
-  guint32 id;
-  char *myname;
+  return xdp_doc_db_get_app_num (db, name);
+}
 
-  id = GPOINTER_TO_UINT (g_hash_table_lookup (app_name_to_id, name));
+static char *
+dup_app_name_from_id (guint32 id)
+{
+  return xdp_doc_db_dup_app_from_num (db, id);
+}
 
-  if (id != 0)
-    return id;
+static void
+xdp_dir_fd_free (XdpDirFd *dir)
+{
+  g_queue_unlink (&dir_fd_lru, &dir->link);
+  close (dir->fd);
+  g_free (dir->path);
+  g_free (dir);
+}
 
-  id = next_app_id++;
+/* Returns an O_PATH fd for dirname, owned by the cache. Don't close it,
+   and don't keep it around, as it may be closed on the next call. */
+static int
+get_dir_fd (const char *dirname)
+{
+  XdpDirFd *dir;
+  struct stat st_buf;
+  gint64 now = g_get_monotonic_time ();
+  int fd;
+
+  dir = g_hash_table_lookup (dir_fds, dirname);
+  if (dir != NULL)
+    {
+      /* Every once in a while verify that the path still leads to the
+         same directory, in case it was moved or replaced */
+      if (now - dir->validated > DIR_FD_CACHE_TIME)
+        {
+          if (stat (dirname, &st_buf) != 0 ||
+              st_buf.st_dev != dir->dev ||
+              st_buf.st_ino != dir->ino)
+            dir = NULL;
+          else
+            dir->validated = now;
+        }
 
-  /* We rely this to not overwrap into the high byte in the inode */
-  g_assert (id < 0x00ffffff);
+      if (dir != NULL)
+        {
+          g_queue_unlink (&dir_fd_lru, &dir->link);
+          g_queue_push_head_link (&dir_fd_lru, &dir->link);
+          return dir->fd;
+        }
 
-  myname = g_strdup (name);
-  g_hash_table_insert (app_name_to_id, myname, GUINT_TO_POINTER (id));
-  g_hash_table_insert (app_id_to_name, GUINT_TO_POINTER (id), myname);
-  return id;
+      g_hash_table_remove (dir_fds, dirname);
+    }
+
+  fd = open (dirname, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &st_buf) != 0)
+    {
+      int errsv = errno;
+      close (fd);
+      errno = errsv;
+      return -1;
+    }
+
+  if (g_queue_get_length (&dir_fd_lru) >= DIR_FD_CACHE_SIZE)
+    {
+      XdpDirFd *oldest = g_queue_peek_tail (&dir_fd_lru);
+      g_hash_table_remove (dir_fds, oldest->path);
+    }
+
+  dir = g_new0 (XdpDirFd, 1);
+  dir->path = g_strdup (dirname);
+  dir->fd = fd;
+  dir->dev = st_buf.st_dev;
+  dir->ino = st_buf.st_ino;
+  dir->validated = now;
+  dir->link.data = dir;
+
+  g_queue_push_head_link (&dir_fd_lru, &dir->link);
+  g_hash_table_insert (dir_fds, dir->path, dir);
+
+  return fd;
 }
 
-static const char *
-get_app_name_from_id (guint32 id)
+static int
+get_doc_dir_fd (XdpDocView *doc)
 {
-  return g_hash_table_lookup (app_id_to_name, GUINT_TO_POINTER (id));
+  const char *dirname = xdp_doc_view_get_dirname (doc);
+
+  if (dirname == NULL)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+
+  return get_dir_fd (dirname);
 }
 
 static void
-fill_app_name_hash (void)
+xdp_backing_fd_free (XdpBackingFd *backing)
 {
-  char **keys;
-  int i;
+  g_queue_unlink (&backing_fd_lru, &backing->link);
+  close (backing->fd);
+  g_free (backing);
+}
 
-  keys = xdp_doc_db_list_apps (db);
-  for (i = 0; keys[i] != NULL; i++)
-    get_app_id_from_name (keys[i]);
-  g_strfreev (keys);
+static void
+invalidate_backing_fd (dev_t dev, ino_t ino)
+{
+  GList *l;
+
+  for (l = backing_fd_lru.head; l != NULL; l = l->next)
+    {
+      XdpBackingFd *backing = l->data;
+
+      if (backing->dev == dev && backing->ino == ino)
+        {
+          xdp_backing_fd_free (backing);
+          return;
+        }
+    }
+}
+
+static void
+invalidate_backing_fd_at (int dir_fd,
+                          const char *name)
+{
+  struct stat st_buf;
+
+  if (fstatat (dir_fd, name, &st_buf, 0) == 0)
+    invalidate_backing_fd (st_buf.st_dev, st_buf.st_ino);
+}
+
+/* The least recently used fds are at the tail */
+static void
+expire_backing_fds (gint64 now)
+{
+  XdpBackingFd *backing;
+
+  while ((backing = g_queue_peek_tail (&backing_fd_lru)) != NULL &&
+         now - backing->used > BACKING_FD_CACHE_TIME)
+    xdp_backing_fd_free (backing);
+}
+
+/* Opens a document read-only. The fd is keyed by (dev, ino), so if
+   the file was replaced we will see a different inode and not use
+   the old fd. If the file's owner, mode or ctime changed since it was
+   opened, the fd is dropped and the file opened again, so that the
+   open is checked against the current permissions. */
+static int
+open_backing_fd (int dir_fd,
+                 const char *name)
+{
+  XdpBackingFd *backing;
+  struct stat st_buf;
+  gint64 now = g_get_monotonic_time ();
+  GList *l;
+  int fd, cached_fd;
+
+  expire_backing_fds (now);
+
+  if (fstatat (dir_fd, name, &st_buf, 0) == 0)
+    {
+      for (l = backing_fd_lru.head; l != NULL; l = l->next)
+        {
+          backing = l->data;
+
+          if (backing->dev != st_buf.st_dev ||
+              backing->ino != st_buf.st_ino)
+            continue;
+
+          if (backing->mode != st_buf.st_mode ||
+              backing->uid != st_buf.st_uid ||
+              backing->gid != st_buf.st_gid ||
+              backing->ctime.tv_sec != st_buf.st_ctim.tv_sec ||
+              backing->ctime.tv_nsec != st_buf.st_ctim.tv_nsec)
+            {
+              xdp_backing_fd_free (backing);
+              break;
+            }
+
+          backing->used = now;
+          g_queue_unlink (&backing_fd_lru, l);
+          g_queue_push_head_link (&backing_fd_lru, l);
+
+          /* All reads are done with pread, so sharing the file
+             offset with the cached fd is fine */
+          return fcntl (backing->fd, F_DUPFD_CLOEXEC, 3);
+        }
+    }
+
+  fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &st_buf) != 0 ||
+      (cached_fd = fcntl (fd, F_DUPFD_CLOEXEC, 3)) < 0)
+    return fd;
+
+  if (g_queue_get_length (&backing_fd_lru) >= BACKING_FD_CACHE_SIZE)
+    xdp_backing_fd_free (g_queue_peek_tail (&backing_fd_lru));
+
+  backing = g_new0 (XdpBackingFd, 1);
+  backing->dev = st_buf.st_dev;
+  backing->ino = st_buf.st_ino;
+  backing->mode = st_buf.st_mode;
+  backing->uid = st_buf.st_uid;
+  backing->gid = st_buf.st_gid;
+  backing->ctime = st_buf.st_ctim;
+  backing->used = now;
+  backing->fd = cached_fd;
+  backing->link.data = backing;
+  g_queue_push_head_link (&backing_fd_lru, &backing->link);
+
+  return fd;
 }
 
 static XdpFh *
@@ -245,9 +502,16 @@ static void
 xdp_fh_free (XdpFh *fh)
 {
   open_files = g_list_remove (open_files, fh);
+  expire_backing_fds (g_get_monotonic_time ());
 
   if (fh->truncated)
     {
+      struct stat st_buf;
+
+      /* The original file is going away, drop it from the cache */
+      if (fh->fd >= 0 && fstat (fh->fd, &st_buf) == 0)
+        invalidate_backing_fd (st_buf.st_dev, st_buf.st_ino);
+
       fsync (fh->trunc_fd);
       if (rename (fh->trunc_path, fh->real_path) != 0)
         g_warning ("Unable to replace truncated document");
@@ -299,20 +563,17 @@ get_entry_cache_time (int st_mode)
 }
 
 static gboolean
-app_can_see_doc (GVariant *doc, guint32 app_id)
+app_can_see_doc (XdpDocView *doc, guint32 app_id)
 {
-  const char *app_name = get_app_name_from_id (app_id);
+  /* The doc is checked against the apps as of when it was read */
+  const char *app_name = xdp_doc_view_get_app_name (doc, app_id);
   if (app_name != NULL &&
-      xdp_doc_has_permissions (doc, app_name, XDP_PERMISSION_FLAGS_READ))
+      xdp_doc_view_has_permissions (doc, app_name, XDP_PERMISSION_FLAGS_READ))
     return TRUE;
 
-  if (app_id == IN_HOMEDIR_APP_ID)
-    {
-      g_autofree char *path = xdp_doc_dup_path (doc);
-
-      if (g_str_has_prefix (path, g_get_home_dir ()))
-        return TRUE;
-    }
+  if (app_id == IN_HOMEDIR_APP_ID &&
+      xdp_doc_view_has_uri_prefix (doc, home_uri_prefix))
+    return TRUE;
 
   return FALSE;
 }
@@ -320,14 +581,15 @@ app_can_see_doc (GVariant *doc, guint32 app_id)
 static int
 xdp_stat (fuse_ino_t ino,
           struct stat *stbuf,
-          GVariant **doc_out)
+          XdpDocView *doc_out)
 {
   XdpInodeClass class = get_class (ino);
   guint64 class_ino = get_class_ino (ino);
-  g_autoptr (GVariant) doc = NULL;
-  g_autofree char *path = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
+  const char *basename = NULL;
   struct stat tmp_stbuf;
   XdpTmp *tmp;
+  int dir_fd;
 
   stbuf->st_ino = ino;
 
@@ -353,8 +615,13 @@ xdp_stat (fuse_ino_t ino,
       break;
 
     case APP_DIR_INO_CLASS:
-      if (class_ino != IN_HOMEDIR_APP_ID && get_app_name_from_id (class_ino) == 0)
-        return ENOENT;
+      if (class_ino != IN_HOMEDIR_APP_ID)
+        {
+          g_autofree char *app_name = dup_app_name_from_id (class_ino);
+
+          if (app_name == NULL)
+            return ENOENT;
+        }
 
       stbuf->st_mode = S_IFDIR | NON_DOC_DIR_PERMS;
       stbuf->st_nlink = 2;
@@ -365,9 +632,8 @@ xdp_stat (fuse_ino_t ino,
         guint32 app_id = get_app_id_from_app_doc_ino (class_ino);
         guint32 doc_id = get_doc_id_from_app_doc_ino (class_ino);
 
-        doc = xdp_doc_db_lookup_doc (db, doc_id);
-        if (doc == NULL ||
-            !app_can_see_doc (doc, app_id))
+        if (!xdp_doc_db_lookup_doc_view (db, doc_id, &doc) ||
+            !app_can_see_doc (&doc, app_id))
           return ENOENT;
 
         stbuf->st_mode = S_IFDIR | DOC_DIR_PERMS;
@@ -376,9 +642,7 @@ xdp_stat (fuse_ino_t ino,
       }
 
     case DOC_DIR_INO_CLASS:
-      doc = xdp_doc_db_lookup_doc (db, class_ino);
-
-      if (doc == NULL)
+      if (!xdp_doc_db_lookup_doc_view (db, class_ino, &doc))
         return ENOENT;
 
       stbuf->st_mode = S_IFDIR | DOC_DIR_PERMS;
@@ -386,15 +650,15 @@ xdp_stat (fuse_ino_t ino,
       break;
 
     case DOC_FILE_INO_CLASS:
-      doc = xdp_doc_db_lookup_doc (db, class_ino);
-
-      if (doc == NULL)
+      if (!xdp_doc_db_lookup_doc_view (db, class_ino, &doc))
         return ENOENT;
 
       stbuf->st_nlink = DOC_FILE_NLINK;
 
-      path = xdp_doc_dup_path (doc);
-      if (stat (path, &tmp_stbuf) != 0)
+      dir_fd = get_doc_dir_fd (&doc);
+      basename = xdp_doc_view_get_basename (&doc);
+      if (dir_fd < 0 ||
+          fstatat (dir_fd, basename, &tmp_stbuf, 0) != 0)
         return ENOENT;
 
       stbuf->st_mode = S_IFREG | get_user_perms (&tmp_stbuf);
@@ -434,8 +698,8 @@ xdp_stat (fuse_ino_t ino,
       return ENOENT;
     }
 
-  if (doc && doc_out)
-    *doc_out = g_steal_pointer (&doc);
+  if (doc_out && xdp_doc_view_is_set (&doc))
+    xdp_doc_view_move (doc_out, &doc);
 
   return 0;
 }
@@ -507,7 +771,7 @@ xdp_fuse_getattr (fuse_req_t req,
     }
 
   if ((res = xdp_stat (ino, &stbuf, NULL)) != 0)
-    fuse_reply_err (req, res);
+    xdp_reply_err (req, res);
   else
     fuse_reply_attr (req, &stbuf, get_attr_cache_time (stbuf.st_mode));
 }
@@ -517,16 +781,14 @@ xdp_lookup (fuse_ino_t parent,
             const char *name,
             fuse_ino_t *inode,
             struct stat *stbuf,
-            GVariant **doc_out,
+            XdpDocView *doc_out,
             XdpTmp **tmp_out)
 {
   XdpInodeClass parent_class = get_class (parent);
   guint64 parent_class_ino = get_class_ino (parent);
-  g_autoptr (GVariant) doc = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
   XdpTmp *tmp;
 
-  if (doc_out)
-    *doc_out = NULL;
   if (tmp_out)
     *tmp_out = NULL;
 
@@ -560,11 +822,13 @@ xdp_lookup (fuse_ino_t parent,
           break;
 
         case BY_APP_INO:
+          /* Only apps that have been granted something have an id,
+             looking up other names doesn't give them one */
           if (g_dbus_is_name (name) && !g_dbus_is_unique_name (name))
             {
               guint32 app_id = get_app_id_from_name (name);
               *inode = make_inode (APP_DIR_INO_CLASS, app_id);
-              if (xdp_stat (*inode, stbuf, NULL) == 0)
+              if (app_id != 0 && xdp_stat (*inode, stbuf, NULL) == 0)
                 return 0;
             }
 
@@ -591,19 +855,19 @@ xdp_lookup (fuse_ino_t parent,
     case APP_DOC_DIR_INO_CLASS:
     case DOC_DIR_INO_CLASS:
       if (parent_class == APP_DOC_DIR_INO_CLASS)
-        doc = xdp_doc_db_lookup_doc (db, get_doc_id_from_app_doc_ino (parent_class_ino));
+        xdp_doc_db_lookup_doc_view (db, get_doc_id_from_app_doc_ino (parent_class_ino), &doc);
       else
-        doc = xdp_doc_db_lookup_doc (db, parent_class_ino);
-      if (doc != NULL)
+        xdp_doc_db_lookup_doc_view (db, parent_class_ino, &doc);
+      if (xdp_doc_view_is_set (&doc))
         {
-          g_autofree char *basename = xdp_doc_dup_basename (doc);
+          const char *basename = xdp_doc_view_get_basename (&doc);
           if (strcmp (name, basename) == 0)
             {
               *inode = make_inode (DOC_FILE_INO_CLASS, parent_class_ino);
               if (xdp_stat (*inode, stbuf, NULL) == 0)
                 {
                   if (doc_out)
-                    *doc_out = g_steal_pointer (&doc);
+                    xdp_doc_view_move (doc_out, &doc);
                   return 0;
                 }
 
@@ -618,7 +882,7 @@ xdp_lookup (fuse_ino_t parent,
           if (xdp_stat (*inode, stbuf, NULL) == 0)
             {
               if (doc_out)
-                *doc_out = g_steal_pointer (&doc);
+                xdp_doc_view_move (doc_out, &doc);
               if (tmp_out)
                 *tmp_out = tmp;
               return 0;
@@ -662,7 +926,7 @@ xdp_fuse_lookup (fuse_req_t req,
     }
   else
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
     }
 }
 
@@ -700,16 +964,23 @@ dirbuf_add_docs (fuse_req_t req,
   int i;
   g_autofree char *doc_name = NULL;
 
-  docs = xdp_doc_db_list_docs (db);
+  /* The docs in the home dir come straight from the uri index, and
+     those of an app from the reverse map of its docs */
+  if (app_id == IN_HOMEDIR_APP_ID)
+    docs = xdp_doc_db_list_docs_under (db, g_get_home_dir ());
+  else if (app_id)
+    {
+      g_autofree char *app_name = dup_app_name_from_id (app_id);
+
+      if (app_name == NULL)
+        return;
+      docs = xdp_doc_db_list_app_docs (db, app_name, XDP_PERMISSION_FLAGS_READ);
+    }
+  else
+    docs = xdp_doc_db_list_docs (db);
+
   for (i = 0; docs[i] != 0; i++)
     {
-      if (app_id)
-        {
-          g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, docs[i]);
-          if (doc == NULL ||
-              !app_can_see_doc (doc, app_id))
-            continue;
-        }
       if (app_id)
         inode = make_app_doc_dir_inode (app_id, docs[i]);
       else
@@ -723,13 +994,14 @@ dirbuf_add_docs (fuse_req_t req,
 static void
 dirbuf_add_doc_file (fuse_req_t req,
                      struct dirbuf *b,
-                     GVariant *doc,
+                     XdpDocView *doc,
                      guint32 doc_id)
 {
   struct stat tmp_stbuf;
-  g_autofree char *path = xdp_doc_dup_path (doc);
-  g_autofree char *basename = xdp_doc_dup_basename (doc);
-  if (stat (path, &tmp_stbuf) == 0)
+  const char *basename = xdp_doc_view_get_basename (doc);
+  int dir_fd = get_doc_dir_fd (doc);
+  if (dir_fd >= 0 &&
+      fstatat (dir_fd, basename, &tmp_stbuf, 0) == 0)
     dirbuf_add (req, b, basename,
                 make_inode (DOC_FILE_INO_CLASS, doc_id));
 }
@@ -782,7 +1054,7 @@ xdp_fuse_opendir (fuse_req_t req,
   struct dirbuf b = {0};
   XdpInodeClass class;
   guint64 class_ino;
-  g_autoptr (GVariant) doc = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
   g_autofree char *basename = NULL;
   int res;
 
@@ -790,13 +1062,13 @@ xdp_fuse_opendir (fuse_req_t req,
 
   if ((res = xdp_stat (ino, &stbuf, &doc)) != 0)
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
       return;
     }
 
   if ((stbuf.st_mode & S_IFMT) != S_IFDIR)
     {
-      fuse_reply_err (req, ENOTDIR);
+      xdp_reply_err (req, ENOTDIR);
       return;
     }
 
@@ -822,21 +1094,16 @@ xdp_fuse_opendir (fuse_req_t req,
           dirbuf_add (req, &b, ".", ino);
           dirbuf_add (req, &b, "..", FUSE_ROOT_ID);
 
-          /* Update for any possible new app */
-          fill_app_name_hash ();
-
+          /* The ids are given out in order, so this is all the apps */
           {
-            GHashTableIter iter;
-            gpointer key, value;
+            char *name;
+            guint32 id;
 
-            g_hash_table_iter_init (&iter, app_name_to_id);
-            while (g_hash_table_iter_next (&iter, &key, &value))
+            for (id = 1; (name = dup_app_name_from_id (id)) != NULL; id++)
               {
-                const char *name = key;
-                guint32 id = GPOINTER_TO_UINT(value);
-
                 dirbuf_add (req, &b, name,
                             make_inode (APP_DIR_INO_CLASS, id));
+                g_free (name);
               }
           }
           break;
@@ -859,7 +1126,7 @@ xdp_fuse_opendir (fuse_req_t req,
     case DOC_DIR_INO_CLASS:
       dirbuf_add (req, &b, ".", ino);
       dirbuf_add (req, &b, "..", FUSE_ROOT_ID);
-      dirbuf_add_doc_file (req, &b, doc, class_ino);
+      dirbuf_add_doc_file (req, &b, &doc, class_ino);
       dirbuf_add_tmp_files (req, &b, ino);
       break;
 
@@ -867,7 +1134,7 @@ xdp_fuse_opendir (fuse_req_t req,
       dirbuf_add (req, &b, ".", ino);
       dirbuf_add (req, &b, "..", make_inode (APP_DIR_INO_CLASS,
                                              get_app_id_from_app_doc_ino (class_ino)));
-      dirbuf_add_doc_file (req, &b, doc,
+      dirbuf_add_doc_file (req, &b, &doc,
                            get_doc_id_from_app_doc_ino (class_ino));
       dirbuf_add_tmp_files (req, &b, ino);
       break;
@@ -880,7 +1147,7 @@ xdp_fuse_opendir (fuse_req_t req,
     }
 
   if (b.p == NULL)
-    fuse_reply_err (req, EIO);
+    xdp_reply_err (req, EIO);
   else
     {
       fi->fh = (gsize)g_memdup (&b, sizeof (b));
@@ -900,7 +1167,7 @@ xdp_fuse_releasedir (fuse_req_t req,
   struct dirbuf *b = (struct dirbuf *)(fi->fh);
   g_free (b->p);
   g_free (b);
-  fuse_reply_err (req, 0);
+  xdp_reply_ok (req);
 }
 
 static int
@@ -911,13 +1178,20 @@ get_open_flags (struct fuse_file_info *fi)
 }
 
 static char *
-create_tmp_for_doc (GVariant *doc, int flags, int *fd_out)
+create_tmp_for_doc (XdpDocView *doc, int flags, int *fd_out)
 {
-  g_autofree char *dirname = xdp_doc_dup_dirname (doc);
-  g_autofree char *basename = xdp_doc_dup_basename (doc);
-  g_autofree char *template = g_strconcat (dirname, "/.", basename, ".XXXXXX", NULL);
+  const char *dirname = xdp_doc_view_get_dirname (doc);
+  const char *basename = xdp_doc_view_get_basename (doc);
+  g_autofree char *template = NULL;
   int fd;
 
+  if (dirname == NULL)
+    {
+      errno = ENOENT;
+      return NULL;
+    }
+
+  template = g_strconcat (dirname, "/.", basename, ".XXXXXX", NULL);
   fd = g_mkstemp_full (template, flags, 0600);
   if (fd == -1)
     return NULL;
@@ -930,7 +1204,7 @@ create_tmp_for_doc (GVariant *doc, int flags, int *fd_out)
 static XdpTmp *
 tmpfile_new (fuse_ino_t parent,
              const char *name,
-             GVariant *doc,
+             XdpDocView *doc,
              int flags,
              int *fd_out)
 {
@@ -988,8 +1262,7 @@ xdp_fuse_open (fuse_req_t req,
   XdpInodeClass class = get_class (ino);
   guint64 class_ino = get_class_ino (ino);
   struct stat stbuf = {0};
-  g_autoptr (GVariant) doc = NULL;
-  g_autofree char *path = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
   XdpTmp *tmp;
   int fd, res;
   XdpFh *fh;
@@ -998,51 +1271,58 @@ xdp_fuse_open (fuse_req_t req,
 
   if ((res = xdp_stat (ino, &stbuf, &doc)) != 0)
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
       return;
     }
 
   if ((stbuf.st_mode & S_IFMT) != S_IFREG)
     {
-      fuse_reply_err (req, EISDIR);
+      xdp_reply_err (req, EISDIR);
       return;
     }
 
-  if (doc && class == DOC_FILE_INO_CLASS)
+  if (xdp_doc_view_is_set (&doc) && class == DOC_FILE_INO_CLASS)
     {
       g_autofree char *write_path = NULL;
+      const char *basename = xdp_doc_view_get_basename (&doc);
       int write_fd = -1;
+      int dir_fd;
 
-      path = xdp_doc_dup_path (doc);
+      dir_fd = get_doc_dir_fd (&doc);
+      if (dir_fd < 0)
+        {
+          xdp_reply_err (req, errno);
+          return;
+        }
 
       if ((fi->flags & 3) != O_RDONLY)
         {
-          if (access (path, W_OK) != 0)
+          if (faccessat (dir_fd, basename, W_OK, 0) != 0)
             {
-              fuse_reply_err (req, errno);
+              xdp_reply_err (req, errno);
               return;
             }
-          write_path = create_tmp_for_doc (doc, O_RDWR, &write_fd);
+          write_path = create_tmp_for_doc (&doc, O_RDWR, &write_fd);
           if (write_path == NULL)
             {
-              fuse_reply_err (req, errno);
+              xdp_reply_err (req, errno);
               return;
             }
         }
 
-      fd = open (path, O_RDONLY);
+      fd = open_backing_fd (dir_fd, basename);
       if (fd < 0)
         {
           int errsv = errno;
           if (write_fd >= 0)
             close (write_fd);
-          fuse_reply_err (req, errsv);
+          xdp_reply_err (req, errsv);
           return;
         }
       fh = xdp_fh_new (ino, fi, fd, NULL);
       fh->trunc_fd = write_fd;
       fh->trunc_path = g_steal_pointer (&write_path);
-      fh->real_path = g_steal_pointer (&path);
+      fh->real_path = g_strdup (xdp_doc_view_get_path (&doc));
       if (fuse_reply_open (req, fi))
         xdp_fh_free (fh);
     }
@@ -1052,7 +1332,7 @@ xdp_fuse_open (fuse_req_t req,
       fd = open (tmp->backing_path, get_open_flags (fi));
       if (fd < 0)
         {
-          fuse_reply_err (req, errno);
+          xdp_reply_err (req, errno);
           return;
         }
       fh = xdp_fh_new (ino, fi, fd, tmp);
@@ -1060,7 +1340,7 @@ xdp_fuse_open (fuse_req_t req,
         xdp_fh_free (fh);
     }
   else
-    fuse_reply_err (req, EIO);
+    xdp_reply_err (req, EIO);
 }
 
 static void
@@ -1074,9 +1354,8 @@ xdp_fuse_create (fuse_req_t req,
   XdpInodeClass parent_class = get_class (parent);
   struct stat stbuf;
   XdpFh *fh;
-  g_autoptr(GVariant) doc = NULL;
-  g_autofree char *basename = NULL;
-  g_autofree char *path = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
+  const char *basename = NULL;
   XdpTmp *tmpfile;
   int fd, res;
 
@@ -1084,46 +1363,52 @@ xdp_fuse_create (fuse_req_t req,
 
   if ((res = xdp_stat (parent, &stbuf, &doc)) != 0)
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
       return;
     }
 
   if ((stbuf.st_mode & S_IFMT) != S_IFDIR)
     {
-      fuse_reply_err (req, ENOTDIR);
+      xdp_reply_err (req, ENOTDIR);
       return;
     }
 
   if (parent_class != APP_DOC_DIR_INO_CLASS &&
       parent_class != DOC_DIR_INO_CLASS)
     {
-      fuse_reply_err (req, EACCES);
+      xdp_reply_err (req, EACCES);
       return;
     }
 
-  basename = xdp_doc_dup_basename (doc);
+  basename = xdp_doc_view_get_basename (&doc);
   if (strcmp (name, basename) == 0)
     {
       g_autofree char *write_path = NULL;
       int write_fd = -1;
+      int dir_fd;
       guint32 doc_id = xdb_doc_id_from_name (name);
 
-      write_path = create_tmp_for_doc (doc, O_RDWR, &write_fd);
-      if (write_path == NULL)
+      dir_fd = get_doc_dir_fd (&doc);
+      if (dir_fd < 0)
         {
-          fuse_reply_err (req, errno);
+          xdp_reply_err (req, errno);
           return;
         }
 
-      path = xdp_doc_dup_path (doc);
+      write_path = create_tmp_for_doc (&doc, O_RDWR, &write_fd);
+      if (write_path == NULL)
+        {
+          xdp_reply_err (req, errno);
+          return;
+        }
 
-      fd = open (path, O_CREAT|O_EXCL|O_RDONLY);
+      fd = openat (dir_fd, basename, O_CREAT|O_EXCL|O_RDONLY);
       if (fd < 0)
         {
           int errsv = errno;
           if (write_fd >= 0)
             close (write_fd);
-          fuse_reply_err (req, errsv);
+          xdp_reply_err (req, errsv);
           return;
         }
 
@@ -1133,12 +1418,12 @@ xdp_fuse_create (fuse_req_t req,
       fh->truncated = TRUE;
       fh->trunc_fd = write_fd;
       fh->trunc_path = g_steal_pointer (&write_path);
-      fh->real_path = g_steal_pointer (&path);
+      fh->real_path = g_strdup (xdp_doc_view_get_path (&doc));
 
       if (xdp_fstat (fh, &e.attr) != 0)
         {
           xdp_fh_free (fh);
-          fuse_reply_err (req, EIO);
+          xdp_reply_err (req, EIO);
           return;
         }
 
@@ -1153,7 +1438,7 @@ xdp_fuse_create (fuse_req_t req,
       tmpfile = find_tmp_by_name (parent, name);
       if (tmpfile != NULL && fi->flags & O_EXCL)
         {
-          fuse_reply_err (req, EEXIST);
+          xdp_reply_err (req, EEXIST);
           return;
         }
 
@@ -1162,16 +1447,16 @@ xdp_fuse_create (fuse_req_t req,
           fd = open (tmpfile->backing_path, get_open_flags (fi));
           if (fd == -1)
             {
-              fuse_reply_err (req, errno);
+              xdp_reply_err (req, errno);
               return;
             }
         }
       else
         {
-          tmpfile = tmpfile_new (parent, name, doc, get_open_flags (fi), &fd);
+          tmpfile = tmpfile_new (parent, name, &doc, get_open_flags (fi), &fd);
           if (tmpfile == NULL)
             {
-              fuse_reply_err (req, errno);
+              xdp_reply_err (req, errno);
               return;
             }
         }
@@ -1179,7 +1464,7 @@ xdp_fuse_create (fuse_req_t req,
       e.ino = make_inode (TMPFILE_INO_CLASS, tmpfile->tmp_id);
       if (xdp_stat (e.ino, &e.attr, NULL) != 0)
         {
-          fuse_reply_err (req, EIO);
+          xdp_reply_err (req, EIO);
           return;
         }
       e.attr_timeout = get_attr_cache_time (e.attr.st_mode);
@@ -1235,20 +1520,20 @@ xdp_fuse_write (fuse_req_t req,
 
   if (fh->readonly)
     {
-      fuse_reply_err (req, EACCES);
+      xdp_reply_err (req, EACCES);
       return;
     }
 
   fd = xdp_fh_get_fd (fh);
   if (fd == -1)
     {
-      fuse_reply_err (req, EIO);
+      xdp_reply_err (req, EIO);
       return;
     }
 
   res = pwrite (fd, buf, size, off);
   if (res < 0)
-    fuse_reply_err (req, errno);
+    xdp_reply_err (req, errno);
   else
     fuse_reply_write (req, res);
 }
@@ -1267,14 +1552,14 @@ xdp_fuse_write_buf (fuse_req_t req,
 
   if (fh->readonly)
     {
-      fuse_reply_err (req, EACCES);
+      xdp_reply_err (req, EACCES);
       return;
     }
 
   fd = xdp_fh_get_fd (fh);
   if (fd == -1)
     {
-      fuse_reply_err (req, EIO);
+      xdp_reply_err (req, EIO);
       return;
     }
 
@@ -1284,7 +1569,7 @@ xdp_fuse_write_buf (fuse_req_t req,
 
   res = fuse_buf_copy (&dst, bufv, FUSE_BUF_SPLICE_NONBLOCK);
   if (res < 0)
-    fuse_reply_err (req, -res);
+    xdp_reply_err (req, -res);
   else
     fuse_reply_write (req, res);
 }
@@ -1296,7 +1581,7 @@ xdp_fuse_release (fuse_req_t req,
 {
   XdpFh *fh = (gpointer)fi->fh;
   xdp_fh_free (fh);
-  fuse_reply_err (req, 0);
+  xdp_reply_ok (req);
 }
 
 static void
@@ -1307,11 +1592,11 @@ xdp_fuse_rename (fuse_req_t req,
                  const char *newname)
 {
   XdpInodeClass parent_class = get_class (parent);
-  g_autoptr (GVariant) doc = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
   int res;
   fuse_ino_t inode;
   struct stat stbuf = {0};
-  g_autofree char *basename = NULL;
+  const char *basename = NULL;
   XdpTmp *other_tmp, *tmp;
   GList *l;
 
@@ -1320,7 +1605,7 @@ xdp_fuse_rename (fuse_req_t req,
   res = xdp_lookup (parent, name,  &inode, &stbuf, &doc, &tmp);
   if (res != 0)
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
       return;
     }
 
@@ -1328,19 +1613,20 @@ xdp_fuse_rename (fuse_req_t req,
   if ((parent_class != DOC_DIR_INO_CLASS &&
        parent_class != APP_DOC_DIR_INO_CLASS) ||
       parent != newparent ||
-      doc == NULL ||
+      !xdp_doc_view_is_set (&doc) ||
       /* Also, don't allow renaming non-tmpfiles */
       tmp == NULL)
     {
-      fuse_reply_err (req, EACCES);
+      xdp_reply_err (req, EACCES);
       return;
     }
 
-  basename = xdp_doc_dup_basename (doc);
+  basename = xdp_doc_view_get_basename (&doc);
 
   if (strcmp (newname, basename) == 0)
     {
-      g_autofree char *real_path = xdp_doc_dup_path (doc);
+      const char *real_path = xdp_doc_view_get_path (&doc);
+      int dir_fd;
       /* Rename tmpfile to regular file */
 
       /* Stop writes to all outstanding fds to the temp file */
@@ -1351,9 +1637,14 @@ xdp_fuse_rename (fuse_req_t req,
             fh->readonly = TRUE;
         }
 
+      /* The file we replace can't be reused from the cache */
+      dir_fd = get_doc_dir_fd (&doc);
+      if (dir_fd >= 0)
+        invalidate_backing_fd_at (dir_fd, basename);
+
       if (rename (tmp->backing_path, real_path) != 0)
         {
-          fuse_reply_err (req, errno);
+          xdp_reply_err (req, errno);
           return;
         }
 
@@ -1361,7 +1652,7 @@ xdp_fuse_rename (fuse_req_t req,
       g_clear_pointer (&tmp->backing_path, g_free);
       tmpfile_free (tmp);
 
-      fuse_reply_err (req, 0);
+      xdp_reply_ok (req);
     }
   else
     {
@@ -1373,7 +1664,7 @@ xdp_fuse_rename (fuse_req_t req,
 
       g_free (tmp->name);
       tmp->name = g_strdup (newname);
-      fuse_reply_err (req, 0);
+      xdp_reply_ok (req);
    }
 }
 
@@ -1430,7 +1721,7 @@ xdp_fuse_setattr (fuse_req_t req,
       res = fh_truncate (fh, attr->st_size, &newattr);
       if (res < 0)
         {
-          fuse_reply_err (req, res);
+          xdp_reply_err (req, res);
           return;
         }
 
@@ -1459,13 +1750,13 @@ xdp_fuse_setattr (fuse_req_t req,
 
       if (!found)
         {
-          fuse_reply_err (req, EACCES);
+          xdp_reply_err (req, EACCES);
           return;
         }
 
       if (res < 0)
         {
-          fuse_reply_err (req, -res);
+          xdp_reply_err (req, -res);
           return;
         }
 
@@ -1502,20 +1793,20 @@ xdp_fuse_setattr (fuse_req_t req,
 
       if (!found)
         {
-          fuse_reply_err (req, EACCES);
+          xdp_reply_err (req, EACCES);
           return;
         }
 
       if (err < 0)
         {
-          fuse_reply_err (req, -err);
+          xdp_reply_err (req, -err);
           return;
         }
 
       fuse_reply_attr (req, &newattr, get_attr_cache_time (newattr.st_mode));
     }
   else
-    fuse_reply_err (req, ENOSYS);
+    xdp_reply_err (req, ENOSYS);
 }
 
 static void
@@ -1531,17 +1822,20 @@ xdp_fuse_fsyncdir (fuse_req_t req,
   if (class == DOC_DIR_INO_CLASS ||
       class == APP_DOC_DIR_INO_CLASS)
     {
-      g_autoptr (GVariant) doc = NULL;
+      g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
       if (class == APP_DOC_DIR_INO_CLASS)
         doc_id = get_doc_id_from_app_doc_ino (class_ino);
       else
         doc_id = class_ino;
 
-      doc = xdp_doc_db_lookup_doc (db, doc_id);
-      if (doc != NULL)
+      if (xdp_doc_db_lookup_doc_view (db, doc_id, &doc))
         {
-          g_autofree char *dirname = xdp_doc_dup_dirname (doc);
-          int fd = open (dirname, O_DIRECTORY|O_RDONLY);
+          int dir_fd = get_doc_dir_fd (&doc);
+          int fd = -1;
+
+          /* The cached fd is O_PATH, so we need a real one to sync */
+          if (dir_fd >= 0)
+            fd = openat (dir_fd, ".", O_DIRECTORY|O_RDONLY|O_CLOEXEC);
           if (fd >= 0)
             {
               if (datasync)
@@ -1553,7 +1847,7 @@ xdp_fuse_fsyncdir (fuse_req_t req,
         }
     }
 
-  fuse_reply_err (req, 0);
+  xdp_reply_ok (req);
 }
 
 static void
@@ -1574,7 +1868,7 @@ xdp_fuse_fsync (fuse_req_t req,
         fsync (fh->trunc_fd);
     }
 
-  fuse_reply_err (req, 0);
+  xdp_reply_ok (req);
 }
 
 static void
@@ -1583,11 +1877,11 @@ xdp_fuse_unlink (fuse_req_t req,
                  const char *name)
 {
   XdpInodeClass parent_class = get_class (parent);
-  g_autoptr (GVariant) doc = NULL;
+  g_auto(XdpDocView) doc = XDP_DOC_VIEW_INIT;
   int res;
   fuse_ino_t inode;
   struct stat stbuf = {0};
-  g_autofree char *basename = NULL;
+  const char *basename = NULL;
   XdpTmp *tmp;
 
   g_debug ("xdp_fuse_unlink %lx/%s", parent, name);
@@ -1595,57 +1889,129 @@ xdp_fuse_unlink (fuse_req_t req,
   res = xdp_lookup (parent, name,  &inode, &stbuf, &doc, &tmp);
   if (res != 0)
     {
-      fuse_reply_err (req, res);
+      xdp_reply_err (req, res);
       return;
     }
 
   /* Only allow unlink in (app) doc dirs */
   if ((parent_class != DOC_DIR_INO_CLASS &&
        parent_class != APP_DOC_DIR_INO_CLASS) ||
-      doc == NULL)
+      !xdp_doc_view_is_set (&doc))
     {
-      fuse_reply_err (req, EACCES);
+      xdp_reply_err (req, EACCES);
       return;
     }
 
-  basename = xdp_doc_dup_basename (doc);
+  basename = xdp_doc_view_get_basename (&doc);
   if (strcmp (name, basename) == 0)
     {
-      g_autofree char *real_path = xdp_doc_dup_path (doc);
+      int dir_fd = get_doc_dir_fd (&doc);
+
+      if (dir_fd < 0)
+        {
+          xdp_reply_err (req, errno);
+          return;
+        }
+
+      invalidate_backing_fd_at (dir_fd, basename);
 
-      if (unlink (real_path) != 0)
+      if (unlinkat (dir_fd, basename, 0) != 0)
         {
-          fuse_reply_err (req, errno);
+          xdp_reply_err (req, errno);
           return;
         }
 
-      fuse_reply_err (req, 0);
+      xdp_reply_ok (req);
     }
   else
     {
       tmpfile_free (tmp);
 
-      fuse_reply_err (req, 0);
+      xdp_reply_ok (req);
    }
 }
 
+/* All the handlers reply before returning, so the time spent in the
+   handler is the latency of the op */
+#define TIMED_OP(op, params, args)                                      \
+  static void                                                           \
+  xdp_fuse_timed_##op params                                            \
+  {                                                                     \
+    XdpFuseOpState state = { FALSE, };                                  \
+    gint64 start = g_get_monotonic_time ();                             \
+    g_private_set (&current_op_state, &state);                          \
+    xdp_fuse_##op args;                                                 \
+    g_private_set (&current_op_state, NULL);                            \
+    xdp_metrics_record ("fuse." #op,                                    \
+                        g_get_monotonic_time () - start, state.failed); \
+  }
+
+TIMED_OP (lookup,
+          (fuse_req_t req, fuse_ino_t parent, const char *name),
+          (req, parent, name))
+TIMED_OP (getattr,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+          (req, ino, fi))
+TIMED_OP (opendir,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+          (req, ino, fi))
+TIMED_OP (readdir,
+          (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+          (req, ino, size, off, fi))
+TIMED_OP (releasedir,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+          (req, ino, fi))
+TIMED_OP (fsyncdir,
+          (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+          (req, ino, datasync, fi))
+TIMED_OP (open,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+          (req, ino, fi))
+TIMED_OP (create,
+          (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+          (req, parent, name, mode, fi))
+TIMED_OP (read,
+          (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi),
+          (req, ino, size, off, fi))
+TIMED_OP (write,
+          (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi),
+          (req, ino, buf, size, off, fi))
+TIMED_OP (write_buf,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi),
+          (req, ino, bufv, off, fi))
+TIMED_OP (release,
+          (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+          (req, ino, fi))
+TIMED_OP (rename,
+          (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname),
+          (req, parent, name, newparent, newname))
+TIMED_OP (setattr,
+          (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi),
+          (req, ino, attr, to_set, fi))
+TIMED_OP (fsync,
+          (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+          (req, ino, datasync, fi))
+TIMED_OP (unlink,
+          (fuse_req_t req, fuse_ino_t parent, const char *name),
+          (req, parent, name))
+
 static struct fuse_lowlevel_ops xdp_fuse_oper = {
-  .lookup       = xdp_fuse_lookup,
-  .getattr      = xdp_fuse_getattr,
-  .opendir      = xdp_fuse_opendir,
-  .readdir      = xdp_fuse_readdir,
-  .releasedir   = xdp_fuse_releasedir,
-  .fsyncdir     = xdp_fuse_fsyncdir,
-  .open         = xdp_fuse_open,
-  .create       = xdp_fuse_create,
-  .read         = xdp_fuse_read,
-  .write        = xdp_fuse_write,
-  .write_buf    = xdp_fuse_write_buf,
-  .release      = xdp_fuse_release,
-  .rename       = xdp_fuse_rename,
-  .setattr      = xdp_fuse_setattr,
-  .fsync        = xdp_fuse_fsync,
-  .unlink       = xdp_fuse_unlink,
+  .lookup       = xdp_fuse_timed_lookup,
+  .getattr      = xdp_fuse_timed_getattr,
+  .opendir      = xdp_fuse_timed_opendir,
+  .readdir      = xdp_fuse_timed_readdir,
+  .releasedir   = xdp_fuse_timed_releasedir,
+  .fsyncdir     = xdp_fuse_timed_fsyncdir,
+  .open         = xdp_fuse_timed_open,
+  .create       = xdp_fuse_timed_create,
+  .read         = xdp_fuse_timed_read,
+  .write        = xdp_fuse_timed_write,
+  .write_buf    = xdp_fuse_timed_write_buf,
+  .release      = xdp_fuse_timed_release,
+  .rename       = xdp_fuse_timed_rename,
+  .setattr      = xdp_fuse_timed_setattr,
+  .fsync        = xdp_fuse_timed_fsync,
+  .unlink       = xdp_fuse_timed_unlink,
 };
 
 typedef struct
@@ -1724,9 +2090,37 @@ static struct fuse_session *session = NULL;
 static struct fuse_chan *main_ch = NULL;
 static char *mount_path = NULL;
 
+/* All fuse requests are handled in a separate thread with its own
+   main context, so that file i/o and dbus calls don't delay each
+   other. Everything in this file except init and exit runs there. */
+static GMainContext *fuse_context = NULL;
+static GMainLoop *fuse_loop = NULL;
+static GThread *fuse_thread = NULL;
+
+static gpointer
+xdp_fuse_mainloop (gpointer data)
+{
+  g_main_context_push_thread_default (fuse_context);
+  g_main_loop_run (fuse_loop);
+  g_main_context_pop_thread_default (fuse_context);
+
+  return NULL;
+}
+
 void
 xdp_fuse_exit (void)
 {
+  if (fuse_thread != NULL)
+    {
+      g_main_loop_quit (fuse_loop);
+      g_thread_join (fuse_thread);
+      fuse_thread = NULL;
+    }
+
+  while (!g_queue_is_empty (&backing_fd_lru))
+    xdp_backing_fd_free (g_queue_peek_head (&backing_fd_lru));
+  g_clear_pointer (&dir_fds, g_hash_table_unref);
+
   fuse_session_reset (session);
   fuse_session_remove_chan (main_ch);
   fuse_session_destroy (session);
@@ -1743,12 +2137,11 @@ xdp_fuse_init (XdpDocDb *_db,
   GSource *source;
 
   db = _db;
-  app_name_to_id =
-    g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
-  app_id_to_name =
-    g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, NULL);
-  next_app_id = IN_HOMEDIR_APP_ID + 1;
+  home_uri_prefix = xdp_doc_dir_uri_prefix (g_get_home_dir ());
   next_tmp_id = 1;
+  dir_fds =
+    g_hash_table_new_full (g_str_hash, g_str_equal,
+                           NULL, (GDestroyNotify)xdp_dir_fd_free);
 
   mount_path = g_build_filename (g_get_user_runtime_dir(), "doc", NULL);
   if (g_mkdir_with_parents  (mount_path, 0700))
@@ -1776,8 +2169,14 @@ xdp_fuse_init (XdpDocDb *_db,
 
   fuse_session_add_chan (session, ch);
 
+  fuse_context = g_main_context_new ();
+  fuse_loop = g_main_loop_new (fuse_context, FALSE);
+
   source = fuse_source_new (ch);
-  g_source_attach (source, NULL);
+  g_source_attach (source, fuse_context);
+  g_source_unref (source);
+
+  fuse_thread = g_thread_new ("fuse", xdp_fuse_mainloop, NULL);
 
   return TRUE;
 }
@@ -0,0 +1,99 @@
+#include "config.h"
+
+#include <locale.h>
+#include <gio/gio.h>
+
+#include "xdp-dbus.h"
+
+int
+do_info (int argc, char *argv[])
+{
+  GDBusConnection *bus;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GVariant) apps = NULL;
+  const char *doc_path;
+  const char *app_id;
+  const char **permissions;
+  GVariantIter iter;
+  guint32 doc_id;
+
+  setlocale (LC_ALL, "");
+
+  if (argc != 1)
+    {
+      g_printerr ("Usage: xdp info FILE\n");
+      return 1;
+    }
+
+  file = g_file_new_for_commandline_arg (argv[0]);
+  path = g_file_get_path (file);
+  if (path == NULL)
+    {
+      g_printerr ("%s is not a local file\n", argv[0]);
+      g_printerr ("Usage: xdp info FILE\n");
+      return 1;
+    }
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (bus == NULL)
+    {
+      g_printerr ("Can't get session bus: %s\n", error->message);
+      return 1;
+    }
+
+  ret = g_dbus_connection_call_sync (bus,
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "/org/freedesktop/portal/document",
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "Lookup",
+                                     g_variant_new ("(s)", path),
+                                     G_VARIANT_TYPE ("(u)"),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     30000,
+                                     NULL,
+                                     &error);
+  if (ret == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_variant_get (ret, "(u)", &doc_id);
+  g_clear_pointer (&ret, g_variant_unref);
+
+  ret = g_dbus_connection_call_sync (bus,
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "/org/freedesktop/portal/document",
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "Info",
+                                     g_variant_new ("(u)", doc_id),
+                                     G_VARIANT_TYPE ("(sa{sas})"),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     30000,
+                                     NULL,
+                                     &error);
+  if (ret == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_variant_get (ret, "(&s@a{sas})", &doc_path, &apps);
+
+  g_print ("document id: %x\n", doc_id);
+  g_print ("path: %s\n", doc_path);
+
+  g_variant_iter_init (&iter, apps);
+  while (g_variant_iter_next (&iter, "{&s^a&s}", &app_id, &permissions))
+    {
+      g_autofree char *perms_str = g_strjoinv (", ", (char **)permissions);
+
+      g_print ("  %s: %s\n", app_id, perms_str);
+      g_free (permissions);
+    }
+
+  return 0;
+}
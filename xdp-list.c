@@ -0,0 +1,58 @@
+#include "config.h"
+
+#include <locale.h>
+#include <gio/gio.h>
+
+#include "xdp-dbus.h"
+
+int
+do_list (int argc, char *argv[])
+{
+  GDBusConnection *bus;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GVariant) docs = NULL;
+  GVariantIter iter;
+  const char *path;
+  guint32 doc_id;
+
+  setlocale (LC_ALL, "");
+
+  if (argc != 1)
+    {
+      g_printerr ("Usage: xdp list APPID\n");
+      return 1;
+    }
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (bus == NULL)
+    {
+      g_printerr ("Can't get session bus: %s\n", error->message);
+      return 1;
+    }
+
+  ret = g_dbus_connection_call_sync (bus,
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "/org/freedesktop/portal/document",
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "List",
+                                     g_variant_new ("(s)", argv[0]),
+                                     G_VARIANT_TYPE ("(a{us})"),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     30000,
+                                     NULL,
+                                     &error);
+  if (ret == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_variant_get (ret, "(@a{us})", &docs);
+
+  g_variant_iter_init (&iter, docs);
+  while (g_variant_iter_next (&iter, "{u&s}", &doc_id, &path))
+    g_print ("%x\t%s\n", doc_id, path);
+
+  return 0;
+}
@@ -3,8 +3,10 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -16,6 +18,7 @@
 #include "xdp-error.h"
 #include "xdp-util.h"
 #include "xdp-fuse.h"
+#include "xdp-metrics.h"
 
 typedef struct
 {
@@ -31,9 +34,88 @@ typedef struct
 static GMainLoop *loop = NULL;
 static XdpDocDb *db = NULL;
 static GDBusNodeInfo *introspection_data = NULL;
+static XdpDbusDocumentPortal *portal_helper = NULL;
+static XdpDbusDocumentPortalDebug *portal_debug_helper = NULL;
+static GDBusServer *private_server = NULL;
+static char *private_socket_path = NULL;
+
+/* Doc ids changed since we last emitted Changed */
+static GHashTable *pending_changes = NULL;
+static guint changes_idle = 0;
+
+/* Changed tells what GetChangesSince does, so it is only sent to the
+   unsandboxed peers that called that, and not broadcast on the bus */
+typedef struct
+{
+  GDBusConnection *connection;
+  char *name; /* NULL on private connections */
+} XdpChangeSubscriber;
+
+static GList *change_subscribers = NULL;
 
 static guint save_timeout = 0;
 
+/* Attached to each invocation, and recorded when the invocation is
+   finalized, which is after the reply has been sent. */
+typedef struct
+{
+  char *name;
+  gint64 start;
+  gboolean failed;
+} XdpMethodStats;
+
+static void
+method_stats_done (gpointer data)
+{
+  XdpMethodStats *stats = data;
+
+  xdp_metrics_record (stats->name,
+                      g_get_monotonic_time () - stats->start,
+                      stats->failed);
+  g_free (stats->name);
+  g_free (stats);
+}
+
+static void
+invocation_mark_failed (GDBusMethodInvocation *invocation)
+{
+  XdpMethodStats *stats;
+
+  stats = g_object_get_data (G_OBJECT (invocation), "xdp-method-stats");
+  if (stats != NULL)
+    stats->failed = TRUE;
+}
+
+static void
+return_error (GDBusMethodInvocation *invocation,
+              gint                   code,
+              const char            *format,
+              ...) G_GNUC_PRINTF (3, 4);
+
+static void
+return_error (GDBusMethodInvocation *invocation,
+              gint                   code,
+              const char            *format,
+              ...)
+{
+  va_list args;
+
+  invocation_mark_failed (invocation);
+
+  va_start (args, format);
+  g_dbus_method_invocation_return_error_valist (invocation, XDP_ERROR, code,
+                                                format, args);
+  va_end (args);
+}
+
+static void
+return_gerror (GDBusMethodInvocation *invocation,
+               const GError          *error)
+{
+  invocation_mark_failed (invocation);
+  g_dbus_method_invocation_return_gerror (invocation, error);
+}
+
 static gboolean
 queue_db_save_timeout (gpointer user_data)
 {
@@ -50,6 +132,119 @@ queue_db_save_timeout (gpointer user_data)
   return FALSE;
 }
 
+static void
+add_change_subscriber (GDBusMethodInvocation *invocation)
+{
+  GDBusConnection *connection = g_dbus_method_invocation_get_connection (invocation);
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  XdpChangeSubscriber *subscriber;
+  GList *l;
+
+  for (l = change_subscribers; l != NULL; l = l->next)
+    {
+      subscriber = l->data;
+      if (subscriber->connection == connection &&
+          g_strcmp0 (subscriber->name, sender) == 0)
+        return;
+    }
+
+  subscriber = g_new0 (XdpChangeSubscriber, 1);
+  subscriber->connection = g_object_ref (connection);
+  subscriber->name = g_strdup (sender);
+  change_subscribers = g_list_prepend (change_subscribers, subscriber);
+}
+
+/* Drops the subscribers with the given name on @connection, or all
+   of them if @name is NULL */
+static void
+remove_change_subscribers (GDBusConnection *connection,
+                           const char      *name)
+{
+  GList *l, *next;
+
+  for (l = change_subscribers; l != NULL; l = next)
+    {
+      XdpChangeSubscriber *subscriber = l->data;
+
+      next = l->next;
+      if (subscriber->connection != connection ||
+          (name != NULL && g_strcmp0 (subscriber->name, name) != 0))
+        continue;
+
+      change_subscribers = g_list_delete_link (change_subscribers, l);
+      g_object_unref (subscriber->connection);
+      g_free (subscriber->name);
+      g_free (subscriber);
+    }
+}
+
+static void
+subscriber_name_owner_changed (GDBusConnection *connection,
+                               const gchar     *sender_name,
+                               const gchar     *object_path,
+                               const gchar     *interface_name,
+                               const gchar     *signal_name,
+                               GVariant        *parameters,
+                               gpointer         user_data)
+{
+  const char *name, *from, *to;
+
+  g_variant_get (parameters, "(&s&s&s)", &name, &from, &to);
+
+  if (name[0] == ':' && to[0] == '\0')
+    remove_change_subscribers (connection, name);
+}
+
+static gboolean
+emit_changes_idle (gpointer user_data)
+{
+  g_autoptr(GVariant) parameters = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key;
+  GList *l;
+
+  changes_idle = 0;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+  g_hash_table_iter_init (&iter, pending_changes);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_variant_builder_add (&builder, "u", GPOINTER_TO_UINT (key));
+  g_hash_table_remove_all (pending_changes);
+
+  parameters = g_variant_ref_sink (g_variant_new ("(aut)", &builder,
+                                                  xdp_doc_db_get_generation (db)));
+
+  for (l = change_subscribers; l != NULL; l = l->next)
+    {
+      XdpChangeSubscriber *subscriber = l->data;
+
+      g_dbus_connection_emit_signal (subscriber->connection,
+                                     subscriber->name,
+                                     "/org/freedesktop/portal/document",
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "Changed",
+                                     parameters,
+                                     NULL);
+    }
+
+  return FALSE;
+}
+
+/* Changes are collected and sent as one signal when the mainloop is
+   idle, so a batch call only results in one signal */
+static void
+doc_changed_cb (XdpDocDb *doc_db,
+                guint32 doc_id,
+                guint64 generation,
+                gpointer user_data)
+{
+  g_hash_table_add (pending_changes, GUINT_TO_POINTER (doc_id));
+
+  if (changes_idle == 0)
+    changes_idle = g_idle_add (emit_changes_idle, NULL);
+}
+
 static void
 queue_db_save (void)
 {
@@ -88,6 +283,179 @@ parse_permissions (const char **permissions, GError **error)
   return perms;
 }
 
+static void
+add_permissions_strv (GVariantBuilder *builder,
+                      XdpPermissionFlags perms)
+{
+  g_variant_builder_open (builder, G_VARIANT_TYPE_STRING_ARRAY);
+  if (perms & XDP_PERMISSION_FLAGS_READ)
+    g_variant_builder_add (builder, "s", "read");
+  if (perms & XDP_PERMISSION_FLAGS_WRITE)
+    g_variant_builder_add (builder, "s", "write");
+  if (perms & XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS)
+    g_variant_builder_add (builder, "s", "grant-permissions");
+  if (perms & XDP_PERMISSION_FLAGS_DELETE)
+    g_variant_builder_add (builder, "s", "delete");
+  g_variant_builder_close (builder);
+}
+
+/* Non-file uris have no path, so show the uri instead */
+static char *
+get_doc_display_path (GVariant *doc)
+{
+  char *path = xdp_doc_dup_path (doc);
+
+  if (path == NULL)
+    return g_strdup (xdp_doc_get_uri (doc));
+
+  return path;
+}
+
+static void
+portal_lookup (GDBusMethodInvocation *invocation,
+               GVariant *parameters,
+               const char *app_id)
+{
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *uri = NULL;
+  g_autoptr(GVariant) uri_v = NULL;
+  g_autoptr(GVariant) doc_array = NULL;
+  const guint32 *doc_ids;
+  gsize n_docs, i;
+  const char *filename;
+
+  g_variant_get (parameters, "(&s)", &filename);
+
+  /* Relative paths would resolve against the portal's cwd */
+  if (!g_path_is_absolute (filename))
+    {
+      return_error (invocation, XDP_ERROR_INVALID_ARGUMENT,
+                    "Not an absolute path: %s", filename);
+      return;
+    }
+
+  file = g_file_new_for_path (filename);
+  uri = g_file_get_uri (file);
+
+  uri_v = xdp_doc_db_lookup_uri (db, uri);
+  if (uri_v != NULL)
+    {
+      doc_array = g_variant_get_child_value (uri_v, 0);
+      doc_ids = g_variant_get_fixed_array (doc_array, &n_docs, sizeof (guint32));
+
+      for (i = 0; i < n_docs; i++)
+        {
+          g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, doc_ids[i]);
+
+          /* Don't reveal documents the app can't see anyway */
+          if (doc != NULL &&
+              xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_READ))
+            {
+              g_dbus_method_invocation_return_value (invocation,
+                                                     g_variant_new ("(u)", doc_ids[i]));
+              return;
+            }
+        }
+    }
+
+  return_error (invocation, XDP_ERROR_NOT_FOUND,
+                "No document for %s", filename);
+}
+
+static void
+portal_info (GDBusMethodInvocation *invocation,
+             GVariant *parameters,
+             const char *app_id)
+{
+  g_autoptr(GVariant) doc = NULL;
+  g_autoptr(GVariant) app_array = NULL;
+  g_autofree char *path = NULL;
+  GVariantBuilder builder;
+  GVariantIter iter;
+  const char *child_app_id;
+  guint32 child_perms;
+  guint32 doc_id;
+
+  g_variant_get (parameters, "(u)", &doc_id);
+
+  doc = xdp_doc_db_lookup_doc (db, doc_id);
+  if (doc == NULL ||
+      !xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_READ))
+    {
+      return_error (invocation, XDP_ERROR_NOT_FOUND,
+                    "No such document: %d", doc_id);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sas}"));
+
+  app_array = g_variant_get_child_value (doc, 1);
+  g_variant_iter_init (&iter, app_array);
+  while (g_variant_iter_next (&iter, "(&su)", &child_app_id, &child_perms))
+    {
+      /* Sandboxed apps only get to see their own permissions */
+      if (app_id[0] != '\0' && strcmp (app_id, child_app_id) != 0)
+        continue;
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sas}"));
+      g_variant_builder_add (&builder, "s", child_app_id);
+      add_permissions_strv (&builder, child_perms);
+      g_variant_builder_close (&builder);
+    }
+
+  path = get_doc_display_path (doc);
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(&sa{sas})",
+                                                        path, &builder));
+}
+
+static void
+portal_list (GDBusMethodInvocation *invocation,
+             GVariant *parameters,
+             const char *app_id)
+{
+  g_autoptr(GVariant) app = NULL;
+  g_autoptr(GVariant) doc_array = NULL;
+  GVariantBuilder builder;
+  const guint32 *doc_ids;
+  const char *target_app_id;
+  gsize n_docs, i;
+
+  g_variant_get (parameters, "(&s)", &target_app_id);
+
+  /* Sandboxed apps can only list their own documents */
+  if (app_id[0] != '\0' && strcmp (app_id, target_app_id) != 0)
+    {
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not enough permissions");
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{us}"));
+
+  app = xdp_doc_db_lookup_app (db, target_app_id);
+  if (app != NULL)
+    {
+      doc_array = g_variant_get_child_value (app, 0);
+      doc_ids = g_variant_get_fixed_array (doc_array, &n_docs, sizeof (guint32));
+
+      for (i = 0; i < n_docs; i++)
+        {
+          g_autoptr(GVariant) doc = xdp_doc_db_lookup_doc (db, doc_ids[i]);
+          g_autofree char *path = NULL;
+
+          if (doc == NULL)
+            continue;
+
+          path = get_doc_display_path (doc);
+          g_variant_builder_add (&builder, "{u&s}", doc_ids[i], path);
+        }
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(a{us})", &builder));
+}
+
 static void
 portal_grant_permissions (GDBusMethodInvocation *invocation,
                           GVariant *parameters,
@@ -105,33 +473,109 @@ portal_grant_permissions (GDBusMethodInvocation *invocation,
   doc = xdp_doc_db_lookup_doc (db, doc_id);
   if (doc == NULL)
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_FOUND,
-                                             "No such document: %d", doc_id);
+      return_error (invocation, XDP_ERROR_NOT_FOUND,
+                    "No such document: %d", doc_id);
       return;
     }
   
   perms = parse_permissions (permissions, &error);
   if (perms == -1)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
+      return_gerror (invocation, error);
       return;
     }
 
   /* Must have grant-permissions and all the newly granted permissions */
   if (!xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS | perms))
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_ALLOWED,
-                                             "Not enough permissions");
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not enough permissions");
       return;
     }
 
-  xdp_doc_db_set_permissions (db, doc_id, target_app_id, perms, TRUE);
+  if (!xdp_doc_db_set_permissions (db, doc_id, target_app_id, perms, TRUE))
+    {
+      return_error (invocation, XDP_ERROR_FAILED,
+                    "Can't grant permissions to %s", target_app_id);
+      return;
+    }
   queue_db_save ();
 
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
 
 }
 
+static void
+portal_grant_permissions_bulk (GDBusMethodInvocation *invocation,
+                               GVariant *parameters,
+                               const char *app_id)
+{
+  g_autoptr(GVariant) grants = NULL;
+  g_autofree XdpPermissionFlags *perms = NULL;
+  gsize n_grants, i;
+
+  g_variant_get (parameters, "(@a(usas))", &grants);
+  n_grants = g_variant_n_children (grants);
+  perms = g_new0 (XdpPermissionFlags, n_grants);
+
+  /* Check the entire batch before changing anything */
+  for (i = 0; i < n_grants; i++)
+    {
+      g_autoptr(GVariant) doc = NULL;
+      g_autoptr(GError) error = NULL;
+      g_autofree const char **permissions = NULL;
+      const char *target_app_id;
+      guint32 doc_id;
+
+      g_variant_get_child (grants, i, "(u&s^a&s)", &doc_id, &target_app_id, &permissions);
+
+      doc = xdp_doc_db_lookup_doc (db, doc_id);
+      if (doc == NULL)
+        {
+          return_error (invocation, XDP_ERROR_NOT_FOUND,
+                        "No such document: %d", doc_id);
+          return;
+        }
+
+      perms[i] = parse_permissions (permissions, &error);
+      if (perms[i] == -1)
+        {
+          return_gerror (invocation, error);
+          return;
+        }
+
+      /* Must have grant-permissions and all the newly granted permissions */
+      if (!xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS | perms[i]))
+        {
+          return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                        "Not enough permissions");
+          return;
+        }
+    }
+
+  /* Granting can still fail if the numeric app ids run out, which
+     drops the whole batch, ids given out for it included */
+  xdp_doc_db_begin (db);
+  for (i = 0; i < n_grants; i++)
+    {
+      const char *target_app_id;
+      guint32 doc_id;
+
+      g_variant_get_child (grants, i, "(u&sas)", &doc_id, &target_app_id, NULL);
+      if (!xdp_doc_db_set_permissions (db, doc_id, target_app_id, perms[i], TRUE))
+        {
+          xdp_doc_db_abort (db);
+          return_error (invocation, XDP_ERROR_FAILED,
+                        "Can't grant permissions to %s", target_app_id);
+          return;
+        }
+    }
+  xdp_doc_db_commit (db);
+  queue_db_save ();
+
+  g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+}
+
 static void
 portal_revoke_permissions (GDBusMethodInvocation *invocation,
                            GVariant *parameters,
@@ -149,15 +593,15 @@ portal_revoke_permissions (GDBusMethodInvocation *invocation,
   doc = xdp_doc_db_lookup_doc (db, doc_id);
   if (doc == NULL)
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_FOUND,
-                                             "No such document: %d", doc_id);
+      return_error (invocation, XDP_ERROR_NOT_FOUND,
+                    "No such document: %d", doc_id);
       return;
     }
 
   perms = parse_permissions (permissions, &error);
   if (perms == -1)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
+      return_gerror (invocation, error);
       return;
     }
 
@@ -165,8 +609,8 @@ portal_revoke_permissions (GDBusMethodInvocation *invocation,
   if (!xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_GRANT_PERMISSIONS) ||
       strcmp (app_id, target_app_id) == 0)
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_ALLOWED,
-                                             "Not enough permissions");
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not enough permissions");
       return;
     }
 
@@ -191,15 +635,15 @@ portal_delete (GDBusMethodInvocation *invocation,
   doc = xdp_doc_db_lookup_doc (db, doc_id);
   if (doc == NULL)
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_FOUND,
-                                             "No such document: %d", doc_id);
+      return_error (invocation, XDP_ERROR_NOT_FOUND,
+                    "No such document: %d", doc_id);
       return;
     }
 
   if (!xdp_doc_has_permissions (doc, app_id, XDP_PERMISSION_FLAGS_DELETE))
     {
-      g_dbus_method_invocation_return_error (invocation, XDP_ERROR, XDP_ERROR_NOT_ALLOWED,
-                                             "Not enough permissions");
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not enough permissions");
       return;
     }
   
@@ -220,9 +664,8 @@ portal_add (GDBusMethodInvocation *invocation,
   if (app_id[0] != '\0')
     {
       /* don't allow this from within the sandbox */
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDP_ERROR, XDP_ERROR_NOT_ALLOWED,
-                                             "Not allowed inside sandbox");
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not allowed inside sandbox");
       return;
     }
 
@@ -234,35 +677,18 @@ portal_add (GDBusMethodInvocation *invocation,
   queue_db_save ();
 }
 
-static void
-portal_add_local (GDBusMethodInvocation *invocation,
-                  GVariant *parameters,
-                  const char *app_id)
+/* Returns the uri of the file the fd refers to, or NULL if the fd is
+   not an acceptable file to export */
+static char *
+get_uri_for_fd (int fd,
+                int *fd_flags_out)
 {
-  GDBusMessage *message;
-  GUnixFDList *fd_list;
-  guint32 id;
   g_autofree char *proc_path = NULL;
-  g_autofree char *uri = NULL;
-  int fd_id, fd, fds_len, fd_flags;
-  const int *fds;
   char path_buffer[PATH_MAX+1];
   g_autoptr(GFile) file = NULL;
   ssize_t symlink_size;
   struct stat st_buf, real_st_buf;
-
-  g_variant_get (parameters, "(h)", &fd_id);
-
-  message = g_dbus_method_invocation_get_message (invocation);
-  fd_list = g_dbus_message_get_unix_fd_list (message);
-
-  fd = -1;
-  if (fd_list != NULL)
-    {
-      fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
-      if (fd_id < fds_len)
-        fd = fds[fd_id];
-    }
+  int fd_flags;
 
   proc_path = g_strdup_printf ("/proc/self/fd/%d", fd);
 
@@ -277,12 +703,7 @@ portal_add_local (GDBusMethodInvocation *invocation,
       (fd_flags & O_ACCMODE) == O_WRONLY ||
       /* Must be able to read path from /proc/self/fd */
       (symlink_size = readlink (proc_path, path_buffer, sizeof (path_buffer) - 1)) < 0)
-    {
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDP_ERROR, XDP_ERROR_INVALID_ARGUMENT,
-                                             "Invalid fd passed");
-      return;
-    }
+    return NULL;
 
   path_buffer[symlink_size] = 0;
 
@@ -291,17 +712,48 @@ portal_add_local (GDBusMethodInvocation *invocation,
       st_buf.st_ino != real_st_buf.st_ino)
     {
       /* Don't leak any info about real file path existance, etc */
-      g_dbus_method_invocation_return_error (invocation,
-                                             XDP_ERROR, XDP_ERROR_INVALID_ARGUMENT,
-                                             "Invalid fd passed");
-      return;
+      return NULL;
     }
 
   file = g_file_new_for_path (path_buffer);
-  uri = g_file_get_uri (file);
+
+  *fd_flags_out = fd_flags;
+  return g_file_get_uri (file);
+}
+
+static int
+get_invocation_fd (GDBusMethodInvocation *invocation,
+                   int fd_id)
+{
+  GDBusMessage *message;
+  GUnixFDList *fd_list;
+  const int *fds;
+  int fds_len;
+
+  message = g_dbus_method_invocation_get_message (invocation);
+  fd_list = g_dbus_message_get_unix_fd_list (message);
+
+  if (fd_list != NULL)
+    {
+      fds = g_unix_fd_list_peek_fds (fd_list, &fds_len);
+      if (fd_id >= 0 && fd_id < fds_len)
+        return fds[fd_id];
+    }
+
+  return -1;
+}
+
+static guint32
+create_local_doc (const char *uri,
+                  int fd_flags,
+                  const char *app_id)
+{
+  guint32 id;
 
   id = xdp_doc_db_create_doc (db, uri);
 
+  /* The callers have given the app its numeric id, so this can't
+     fail */
   if (app_id[0] != '\0')
     {
       /* also grant app-id perms based on file_mode */
@@ -311,11 +763,198 @@ portal_add_local (GDBusMethodInvocation *invocation,
       xdp_doc_db_set_permissions (db, id, app_id, perms, TRUE);
     }
 
+  return id;
+}
+
+static void
+portal_add_local (GDBusMethodInvocation *invocation,
+                  GVariant *parameters,
+                  const char *app_id)
+{
+  g_autofree char *uri = NULL;
+  guint32 id;
+  int fd_id, fd_flags;
+
+  g_variant_get (parameters, "(h)", &fd_id);
+
+  uri = get_uri_for_fd (get_invocation_fd (invocation, fd_id), &fd_flags);
+  if (uri == NULL)
+    {
+      return_error (invocation, XDP_ERROR_INVALID_ARGUMENT,
+                    "Invalid fd passed");
+      return;
+    }
+
+  if (app_id[0] != '\0' && !xdp_doc_db_add_app (db, app_id))
+    {
+      return_error (invocation, XDP_ERROR_FAILED,
+                    "Can't grant permissions to %s", app_id);
+      return;
+    }
+
+  id = create_local_doc (uri, fd_flags, app_id);
+
   g_dbus_method_invocation_return_value (invocation,
                                          g_variant_new ("(u)", id));
   queue_db_save ();
 }
 
+static void
+portal_add_many (GDBusMethodInvocation *invocation,
+                 GVariant *parameters,
+                 const char *app_id)
+{
+  g_autofree const char **uris = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  if (app_id[0] != '\0')
+    {
+      /* don't allow this from within the sandbox */
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not allowed inside sandbox");
+      return;
+    }
+
+  g_variant_get (parameters, "(^a&s)", &uris);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+  xdp_doc_db_begin (db);
+  for (i = 0; uris[i] != NULL; i++)
+    g_variant_builder_add (&builder, "u", xdp_doc_db_create_doc (db, uris[i]));
+  xdp_doc_db_commit (db);
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(au)", &builder));
+  queue_db_save ();
+}
+
+static void
+portal_add_local_many (GDBusMethodInvocation *invocation,
+                       GVariant *parameters,
+                       const char *app_id)
+{
+  g_autoptr(GVariant) handles = NULL;
+  g_autoptr(GPtrArray) uris = NULL;
+  g_autofree int *fd_flags = NULL;
+  GVariantBuilder builder;
+  gsize n_handles, i;
+  const gint32 *fd_ids;
+
+  g_variant_get (parameters, "(@ah)", &handles);
+  fd_ids = g_variant_get_fixed_array (handles, &n_handles, sizeof (gint32));
+
+  /* Validate everything first, so that we either add all or nothing */
+  uris = g_ptr_array_new_with_free_func (g_free);
+  fd_flags = g_new0 (int, n_handles);
+  for (i = 0; i < n_handles; i++)
+    {
+      char *uri = get_uri_for_fd (get_invocation_fd (invocation, fd_ids[i]),
+                                  &fd_flags[i]);
+      if (uri == NULL)
+        {
+          return_error (invocation, XDP_ERROR_INVALID_ARGUMENT,
+                        "Invalid fd passed");
+          return;
+        }
+      g_ptr_array_add (uris, uri);
+    }
+
+  if (app_id[0] != '\0' && !xdp_doc_db_add_app (db, app_id))
+    {
+      return_error (invocation, XDP_ERROR_FAILED,
+                    "Can't grant permissions to %s", app_id);
+      return;
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+  xdp_doc_db_begin (db);
+  for (i = 0; i < n_handles; i++)
+    g_variant_builder_add (&builder, "u",
+                           create_local_doc (g_ptr_array_index (uris, i),
+                                             fd_flags[i], app_id));
+  xdp_doc_db_commit (db);
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(au)", &builder));
+  queue_db_save ();
+}
+
+static void
+portal_get_changes_since (GDBusMethodInvocation *invocation,
+                          GVariant *parameters,
+                          const char *app_id)
+{
+  g_autofree guint32 *doc_ids = NULL;
+  guint64 since;
+  GVariantBuilder builder;
+  int i;
+
+  if (app_id[0] != '\0')
+    {
+      /* don't allow this from within the sandbox */
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not allowed inside sandbox");
+      return;
+    }
+
+  g_variant_get (parameters, "(t)", &since);
+
+  /* Only callers that keep up with the changes get the signal */
+  add_change_subscriber (invocation);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+
+  doc_ids = xdp_doc_db_get_changes_since (db, since);
+  if (doc_ids != NULL)
+    {
+      for (i = 0; doc_ids[i] != 0; i++)
+        g_variant_builder_add (&builder, "u", doc_ids[i]);
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(baut)",
+                                                        doc_ids != NULL,
+                                                        &builder,
+                                                        xdp_doc_db_get_generation (db)));
+}
+
+static void
+portal_get_private_address (GDBusMethodInvocation *invocation,
+                            GVariant *parameters,
+                            const char *app_id)
+{
+  if (private_server == NULL)
+    {
+      return_error (invocation, XDP_ERROR_FAILED,
+                    "No private server");
+      return;
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(s)",
+                                                        g_dbus_server_get_client_address (private_server)));
+}
+
+static void
+portal_get_stats (GDBusMethodInvocation *invocation,
+                  GVariant *parameters,
+                  const char *app_id)
+{
+  if (app_id[0] != '\0')
+    {
+      /* don't allow this from within the sandbox */
+      return_error (invocation, XDP_ERROR_NOT_ALLOWED,
+                    "Not allowed inside sandbox");
+      return;
+    }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(@a{s(ttttat)}@a{sx})",
+                                                        xdp_metrics_get_ops (),
+                                                        xdp_metrics_get_gauges ()));
+}
+
 typedef void (*PortalMethod) (GDBusMethodInvocation *invocation,
                               GVariant *parameters,
                               const char *app_id);
@@ -333,7 +972,7 @@ got_app_id_cb (GObject *source_object,
   app_id = xdp_invocation_lookup_app_id_finish (invocation, res, &error);
 
   if (app_id == NULL)
-    g_dbus_method_invocation_return_gerror (invocation, error);
+    return_gerror (invocation, error);
   else
     portal_method (invocation, g_dbus_method_invocation_get_parameters (invocation), app_id);
 }
@@ -342,33 +981,201 @@ static gboolean
 handle_method (GCallback method_callback,
                GDBusMethodInvocation *invocation)
 {
+  XdpMethodStats *stats;
+
+  stats = g_new0 (XdpMethodStats, 1);
+  stats->name = g_strconcat ("dbus.",
+                             g_dbus_method_invocation_get_method_name (invocation),
+                             NULL);
+  stats->start = g_get_monotonic_time ();
+  g_object_set_data_full (G_OBJECT (invocation), "xdp-method-stats",
+                          stats, method_stats_done);
+
   xdp_invocation_lookup_app_id (invocation, NULL, got_app_id_cb, method_callback);
 
   return TRUE;
 }
 
+static void
+private_connection_closed (GDBusConnection *connection,
+                           gboolean         remote_peer_vanished,
+                           GError          *error,
+                           gpointer         user_data)
+{
+  remove_change_subscribers (connection, NULL);
+  g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (portal_helper),
+                                                      connection);
+  g_dbus_interface_skeleton_unexport_from_connection (G_DBUS_INTERFACE_SKELETON (portal_debug_helper),
+                                                      connection);
+  g_object_unref (connection);
+}
+
+static gboolean
+on_new_private_connection (GDBusServer     *server,
+                           GDBusConnection *connection,
+                           gpointer         user_data)
+{
+  g_autoptr(GError) error = NULL;
+
+  /* Serve the same objects as on the bus. The app id of the caller
+     comes from the socket credentials, see xdp_invocation_lookup_app_id() */
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (portal_helper),
+                                         connection,
+                                         "/org/freedesktop/portal/document",
+                                         &error) ||
+      !g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (portal_debug_helper),
+                                         connection,
+                                         "/org/freedesktop/portal/document",
+                                         &error))
+    {
+      g_warning ("error: %s\n", error->message);
+      return FALSE;
+    }
+
+  g_signal_connect (connection, "closed", G_CALLBACK (private_connection_closed), NULL);
+  g_object_ref (connection);
+
+  return TRUE;
+}
+
+static gboolean
+authorize_private_peer (GDBusAuthObserver *observer,
+                        GIOStream         *stream,
+                        GCredentials      *credentials,
+                        gpointer           user_data)
+{
+  /* Only the user that owns the portal */
+  return credentials != NULL &&
+    g_credentials_get_unix_user (credentials, NULL) == getuid ();
+}
+
+/* Whether the socket at @path is left over from an instance that is
+   gone, in which case nobody accepts connections on it */
+static gboolean
+private_socket_is_stale (const char *path)
+{
+  struct sockaddr_un addr = { 0 };
+  gboolean stale;
+  int fd;
+
+  if (strlen (path) >= sizeof addr.sun_path)
+    return FALSE;
+
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return FALSE;
+
+  stale = connect (fd, (struct sockaddr *)&addr, sizeof addr) != 0 &&
+    errno == ECONNREFUSED;
+  close (fd);
+
+  return stale;
+}
+
+/* A socket in the runtime dir that serves the portal without going
+   through the bus daemon, for local clients that make a lot of calls.
+   Only started once we own the bus name, so that an instance that
+   loses the name never touches the socket of the one that has it. */
+static void
+start_private_server (void)
+{
+  g_autoptr(GDBusAuthObserver) observer = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *guid = NULL;
+  g_autofree char *escaped = NULL;
+  g_autofree char *address = NULL;
+
+  private_socket_path = g_build_filename (g_get_user_runtime_dir (),
+                                          "xdg-document-portal-socket", NULL);
+  /* Remove any leftover from an earlier instance, but never a socket
+     that someone is still serving */
+  if (private_socket_is_stale (private_socket_path))
+    unlink (private_socket_path);
+
+  escaped = g_dbus_address_escape_value (private_socket_path);
+  address = g_strconcat ("unix:path=", escaped, NULL);
+  guid = g_dbus_generate_guid ();
+
+  observer = g_dbus_auth_observer_new ();
+  g_signal_connect (observer, "authorize-authenticated-peer",
+                    G_CALLBACK (authorize_private_peer), NULL);
+
+  private_server = g_dbus_server_new_sync (address,
+                                           G_DBUS_SERVER_FLAGS_NONE,
+                                           guid,
+                                           observer,
+                                           NULL,
+                                           &error);
+  if (private_server == NULL)
+    {
+      g_warning ("Can't create private server: %s\n", error->message);
+      g_clear_pointer (&private_socket_path, g_free);
+      return;
+    }
+
+  g_signal_connect (private_server, "new-connection",
+                    G_CALLBACK (on_new_private_connection), NULL);
+  g_dbus_server_start (private_server);
+}
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
                  gpointer         user_data)
 {
   XdpDbusDocumentPortal *helper;
+  XdpDbusDocumentPortalDebug *debug_helper;
   GError *error = NULL;
 
   helper = xdp_dbus_document_portal_skeleton_new ();
+  portal_helper = helper;
 
   g_signal_connect_swapped (helper, "handle-add", G_CALLBACK (handle_method), portal_add);
   g_signal_connect_swapped (helper, "handle-add-local", G_CALLBACK (handle_method), portal_add_local);
+  g_signal_connect_swapped (helper, "handle-add-many", G_CALLBACK (handle_method), portal_add_many);
+  g_signal_connect_swapped (helper, "handle-add-local-many", G_CALLBACK (handle_method), portal_add_local_many);
   g_signal_connect_swapped (helper, "handle-grant-permissions", G_CALLBACK (handle_method), portal_grant_permissions);
+  g_signal_connect_swapped (helper, "handle-grant-permissions-bulk", G_CALLBACK (handle_method), portal_grant_permissions_bulk);
   g_signal_connect_swapped (helper, "handle-revoke-permissions", G_CALLBACK (handle_method), portal_revoke_permissions);
   g_signal_connect_swapped (helper, "handle-delete", G_CALLBACK (handle_method), portal_delete);
+  g_signal_connect_swapped (helper, "handle-lookup", G_CALLBACK (handle_method), portal_lookup);
+  g_signal_connect_swapped (helper, "handle-info", G_CALLBACK (handle_method), portal_info);
+  g_signal_connect_swapped (helper, "handle-list", G_CALLBACK (handle_method), portal_list);
+  g_signal_connect_swapped (helper, "handle-get-changes-since", G_CALLBACK (handle_method), portal_get_changes_since);
+  g_signal_connect_swapped (helper, "handle-get-private-address", G_CALLBACK (handle_method), portal_get_private_address);
 
   xdp_connection_track_name_owners (connection);
+  g_dbus_connection_signal_subscribe (connection,
+                                      "org.freedesktop.DBus",
+                                      "org.freedesktop.DBus",
+                                      "NameOwnerChanged",
+                                      "/org/freedesktop/DBus",
+                                      NULL,
+                                      G_DBUS_SIGNAL_FLAGS_NONE,
+                                      subscriber_name_owner_changed,
+                                      NULL, NULL);
 
   if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (helper),
                                          connection,
                                          "/org/freedesktop/portal/document",
                                          &error))
+    {
+      g_warning ("error: %s\n", error->message);
+      g_clear_error (&error);
+    }
+
+  debug_helper = xdp_dbus_document_portal_debug_skeleton_new ();
+  portal_debug_helper = debug_helper;
+
+  g_signal_connect_swapped (debug_helper, "handle-get-stats", G_CALLBACK (handle_method), portal_get_stats);
+
+  if (!g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (debug_helper),
+                                         connection,
+                                         "/org/freedesktop/portal/document",
+                                         &error))
     {
       g_warning ("error: %s\n", error->message);
       g_error_free (error);
@@ -387,6 +1194,7 @@ on_name_acquired (GDBusConnection *connection,
       exit (1);
     }
 
+  start_private_server ();
 }
 
 static void
@@ -513,6 +1321,9 @@ main (int    argc,
       return 2;
     }
 
+  pending_changes = g_hash_table_new (NULL, NULL);
+  g_signal_connect (db, "doc-changed", G_CALLBACK (doc_changed_cb), NULL);
+
   session_bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
   if (session_bus == NULL)
     {
@@ -556,6 +1367,12 @@ main (int    argc,
 
   xdp_fuse_exit ();
 
+  if (private_server != NULL)
+    {
+      g_dbus_server_stop (private_server);
+      unlink (private_socket_path);
+    }
+
   g_bus_unown_name (owner_id);
 
   g_dbus_node_info_unref (introspection_data);
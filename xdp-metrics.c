@@ -0,0 +1,154 @@
+#include "config.h"
+
+#include "xdp-metrics.h"
+
+typedef struct {
+  guint64 count;
+  guint64 errors;
+  guint64 total_usec;
+  guint64 max_usec;
+  guint64 buckets[XDP_METRICS_N_BUCKETS];
+} XdpOpStats;
+
+/* Recorded from both the dbus and fuse handlers, so everything is
+   protected by a single lock. The critical sections are tiny. */
+G_LOCK_DEFINE_STATIC (metrics);
+static GHashTable *ops = NULL;
+static GHashTable *gauges = NULL;
+
+static void
+ensure_tables (void)
+{
+  if (ops == NULL)
+    {
+      ops = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      gauges = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    }
+}
+
+static int
+get_bucket (gint64 usec)
+{
+  int bucket;
+
+  if (usec <= 0)
+    return 0;
+
+  bucket = g_bit_storage ((gulong)usec) - 1;
+  return MIN (bucket, XDP_METRICS_N_BUCKETS - 1);
+}
+
+void
+xdp_metrics_record (const char *name,
+                    gint64      usec,
+                    gboolean    failed)
+{
+  XdpOpStats *stats;
+
+  if (usec < 0)
+    usec = 0;
+
+  G_LOCK (metrics);
+
+  ensure_tables ();
+
+  stats = g_hash_table_lookup (ops, name);
+  if (stats == NULL)
+    {
+      stats = g_new0 (XdpOpStats, 1);
+      g_hash_table_insert (ops, g_strdup (name), stats);
+    }
+
+  stats->count++;
+  if (failed)
+    stats->errors++;
+  stats->total_usec += usec;
+  stats->max_usec = MAX (stats->max_usec, (guint64)usec);
+  stats->buckets[get_bucket (usec)]++;
+
+  G_UNLOCK (metrics);
+}
+
+void
+xdp_metrics_set_gauge (const char *name,
+                       gint64      value)
+{
+  gint64 *gauge;
+
+  G_LOCK (metrics);
+
+  ensure_tables ();
+
+  gauge = g_hash_table_lookup (gauges, name);
+  if (gauge == NULL)
+    {
+      gauge = g_new0 (gint64, 1);
+      g_hash_table_insert (gauges, g_strdup (name), gauge);
+    }
+  *gauge = value;
+
+  G_UNLOCK (metrics);
+}
+
+/* Returns a{s(ttttat)}: name => (count, errors, total usec, max usec,
+   histogram buckets) */
+GVariant *
+xdp_metrics_get_ops (void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(ttttat)}"));
+
+  G_LOCK (metrics);
+
+  ensure_tables ();
+
+  g_hash_table_iter_init (&iter, ops);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      XdpOpStats *stats = value;
+      GVariant *buckets;
+
+      buckets = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                           stats->buckets,
+                                           XDP_METRICS_N_BUCKETS,
+                                           sizeof (guint64));
+      g_variant_builder_add (&builder, "{s(tttt@at)}",
+                             (const char *)key,
+                             stats->count,
+                             stats->errors,
+                             stats->total_usec,
+                             stats->max_usec,
+                             buckets);
+    }
+
+  G_UNLOCK (metrics);
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Returns a{sx}: name => last value */
+GVariant *
+xdp_metrics_get_gauges (void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sx}"));
+
+  G_LOCK (metrics);
+
+  ensure_tables ();
+
+  g_hash_table_iter_init (&iter, gauges);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{sx}",
+                           (const char *)key, *(gint64 *)value);
+
+  G_UNLOCK (metrics);
+
+  return g_variant_builder_end (&builder);
+}
@@ -0,0 +1,23 @@
+#ifndef XDP_METRICS_H
+#define XDP_METRICS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Latencies are bucketed by powers of two: bucket i counts the
+   samples that took less than 2^(i+1) usec (and at least 2^i, for
+   i > 0). The last bucket also gets everything slower. */
+#define XDP_METRICS_N_BUCKETS 32
+
+void      xdp_metrics_record    (const char *name,
+                                 gint64      usec,
+                                 gboolean    failed);
+void      xdp_metrics_set_gauge (const char *name,
+                                 gint64      value);
+GVariant *xdp_metrics_get_ops    (void);
+GVariant *xdp_metrics_get_gauges (void);
+
+G_END_DECLS
+
+#endif /* XDP_METRICS_H */
@@ -0,0 +1,108 @@
+#include "config.h"
+
+#include <locale.h>
+#include <gio/gio.h>
+
+#include "xdp-dbus.h"
+
+/* Upper bound (in usec) of the histogram bucket containing the
+   given fraction of the samples */
+static guint64
+get_percentile (const guint64 *buckets,
+                gsize n_buckets,
+                guint64 count,
+                double fraction)
+{
+  guint64 seen = 0;
+  gsize i;
+
+  for (i = 0; i < n_buckets; i++)
+    {
+      seen += buckets[i];
+      if (seen >= count * fraction)
+        break;
+    }
+
+  return G_GUINT64_CONSTANT (1) << (MIN (i, n_buckets - 1) + 1);
+}
+
+int
+do_stats (int argc, char *argv[])
+{
+  GDBusConnection *bus;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) ret = NULL;
+  g_autoptr(GVariant) ops = NULL;
+  g_autoptr(GVariant) gauges = NULL;
+  GVariantIter iter;
+  const char *name;
+  guint64 count, errors, total, max;
+  GVariant *buckets;
+  gint64 value;
+
+  setlocale (LC_ALL, "");
+
+  if (argc != 0)
+    {
+      g_printerr ("Usage: xdp stats\n");
+      return 1;
+    }
+
+  bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error);
+  if (bus == NULL)
+    {
+      g_printerr ("Can't get session bus: %s\n", error->message);
+      return 1;
+    }
+
+  ret = g_dbus_connection_call_sync (bus,
+                                     "org.freedesktop.portal.DocumentPortal",
+                                     "/org/freedesktop/portal/document",
+                                     "org.freedesktop.portal.DocumentPortalDebug",
+                                     "GetStats",
+                                     NULL,
+                                     G_VARIANT_TYPE ("(a{s(ttttat)}a{sx})"),
+                                     G_DBUS_CALL_FLAGS_NONE,
+                                     30000,
+                                     NULL,
+                                     &error);
+  if (ret == NULL)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_variant_get (ret, "(@a{s(ttttat)}@a{sx})", &ops, &gauges);
+
+  g_print ("%-24s %10s %8s %10s %10s %10s %10s\n",
+           "op", "count", "errors", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+
+  g_variant_iter_init (&iter, ops);
+  while (g_variant_iter_next (&iter, "{&s(tttt@at)}",
+                              &name, &count, &errors, &total, &max, &buckets))
+    {
+      const guint64 *bucket_data;
+      gsize n_buckets;
+
+      bucket_data = g_variant_get_fixed_array (buckets, &n_buckets, sizeof (guint64));
+
+      if (count > 0 && n_buckets > 0)
+        g_print ("%-24s %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT
+                 " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                 " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT "\n",
+                 name, count, errors, total / count,
+                 get_percentile (bucket_data, n_buckets, count, 0.5),
+                 get_percentile (bucket_data, n_buckets, count, 0.99),
+                 max);
+
+      g_variant_unref (buckets);
+    }
+
+  g_print ("\n");
+
+  g_variant_iter_init (&iter, gauges);
+  while (g_variant_iter_next (&iter, "{&sx}", &name, &value))
+    g_print ("%-24s %10" G_GINT64_FORMAT "\n", name, value);
+
+  return 0;
+}
@@ -18,11 +18,22 @@ extern int do_new (int argc, char *argv[]);
 extern int do_new_local (int argc, char *argv[]);
 extern int do_update (int argc, char *argv[]);
 extern int do_info (int argc, char *argv[]);
+extern int do_stats (int argc, char *argv[]);
+extern int do_lookup (int argc, char *argv[]);
+extern int do_list (int argc, char *argv[]);
 
 static void
 usage (void)
 {
-  g_printerr ("Usage: xdp COMMAND [ARGUMENTS...]\n");
+  g_printerr ("Usage: xdp COMMAND [ARGUMENTS...]\n"
+              "\n"
+              "Commands:\n"
+              "  add FILE [APPID]        Export a file\n"
+              "  add-local FILE [APPID]  Export a file through AddLocal\n"
+              "  info FILE               Show the document for a file\n"
+              "  lookup FILE             Show the document id for a file\n"
+              "  list APPID              List the documents of an app\n"
+              "  stats                   Show portal statistics\n");
   exit (1);
 }
 
@@ -45,6 +56,14 @@ main (int argc, char *argv[])
     return do_add (argc, argv);
   else if (strcmp (command, "add-local") == 0)
     return do_add_local (argc, argv);
+  else if (strcmp (command, "info") == 0)
+    return do_info (argc, argv);
+  else if (strcmp (command, "lookup") == 0)
+    return do_lookup (argc, argv);
+  else if (strcmp (command, "list") == 0)
+    return do_list (argc, argv);
+  else if (strcmp (command, "stats") == 0)
+    return do_stats (argc, argv);
   else
     usage ();
 
@@ -1,27 +1,57 @@
 #include "config.h"
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include "xdp-error.h"
 
+/* Resolved senders are kept in an LRU, in addition to being dropped
+   when the name goes away, so that we don't grow without bounds if
+   we miss a NameOwnerChanged. */
+#define APP_ID_CACHE_SIZE 256
 
 static GHashTable *app_ids;
+static GQueue app_ids_lru = G_QUEUE_INIT;
 
 typedef struct {
   char *name;
   char *app_id;
   gboolean exited;
   GList *pending;
+  GList link;
 } AppIdInfo;
 
 static void
 app_id_info_free (AppIdInfo *info)
 {
+  if (info->link.data != NULL)
+    g_queue_unlink (&app_ids_lru, &info->link);
   g_free (info->name);
   g_free (info->app_id);
   g_free (info);
 }
 
+static void
+app_id_info_touch (AppIdInfo *info)
+{
+  if (info->link.data != NULL)
+    g_queue_unlink (&app_ids_lru, &info->link);
+
+  info->link.data = info;
+  g_queue_push_head_link (&app_ids_lru, &info->link);
+
+  while (g_queue_get_length (&app_ids_lru) > APP_ID_CACHE_SIZE)
+    {
+      AppIdInfo *oldest = g_queue_peek_tail (&app_ids_lru);
+      g_hash_table_remove (app_ids, oldest->name);
+    }
+}
+
 static void
 ensure_app_ids (void)
 {
@@ -30,6 +60,183 @@ ensure_app_ids (void)
                                      NULL, (GDestroyNotify)app_id_info_free);
 }
 
+/* Finds the app id in the contents of /proc/$pid/cgroup, looking at
+   the name=systemd hierarchy for cgroup v1 and the unified hierarchy
+   for v2. This is done in a single pass, without allocating, and the
+   returned app id points into @content. An empty app id means the
+   process is not sandboxed. */
+static gboolean
+parse_cgroup_app_id (const char  *content,
+                     gsize        len,
+                     const char **app_id_out,
+                     gsize       *app_id_len_out)
+{
+  const char *end = content + len;
+  const char *line, *line_end;
+  const char *unit = NULL, *unit_end = NULL;
+  const char *scope, *name, *dash;
+  gsize scope_len;
+
+  for (line = content; line < end; line = line_end + 1)
+    {
+      const char *id_end, *controllers, *controllers_end;
+
+      line_end = memchr (line, '\n', end - line);
+      if (line_end == NULL)
+        line_end = end;
+
+      id_end = memchr (line, ':', line_end - line);
+      if (id_end == NULL)
+        continue;
+
+      controllers = id_end + 1;
+      controllers_end = memchr (controllers, ':', line_end - controllers);
+      if (controllers_end == NULL)
+        continue;
+
+      if (controllers_end - controllers == strlen ("name=systemd") &&
+          memcmp (controllers, "name=systemd", strlen ("name=systemd")) == 0)
+        {
+          /* v1, this is what we want */
+          unit = controllers_end + 1;
+          unit_end = line_end;
+          break;
+        }
+
+      if (id_end - line == 1 && line[0] == '0' &&
+          controllers_end == controllers)
+        {
+          /* v2, keep looking in case of a hybrid setup */
+          unit = controllers_end + 1;
+          unit_end = line_end;
+        }
+    }
+
+  if (unit == NULL)
+    return FALSE;
+
+  scope = unit_end;
+  while (scope > unit && scope[-1] != '/')
+    scope--;
+  scope_len = unit_end - scope;
+
+  if (scope_len > strlen ("xdg-app-") + strlen (".scope") &&
+      memcmp (scope, "xdg-app-", strlen ("xdg-app-")) == 0 &&
+      memcmp (unit_end - strlen (".scope"), ".scope", strlen (".scope")) == 0)
+    {
+      name = scope + strlen ("xdg-app-");
+      dash = memchr (name, '-', unit_end - name);
+      if (dash == NULL)
+        return FALSE;
+
+      *app_id_out = name;
+      *app_id_len_out = dash - name;
+    }
+  else
+    {
+      *app_id_out = "";
+      *app_id_len_out = 0;
+    }
+
+  return TRUE;
+}
+
+/* Returns FALSE if the pidfd is known to refer to a process that
+   has exited, in which case the pid may have been reused */
+static gboolean
+pidfd_is_alive (int pidfd)
+{
+#ifdef SYS_pidfd_send_signal
+  if (syscall (SYS_pidfd_send_signal, pidfd, 0, NULL, 0) != 0 &&
+      errno == ESRCH)
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+static char *
+lookup_app_id_for_pid (guint32 pid,
+                       int pidfd)
+{
+  char path[64];
+  char content[8192];
+  gsize len = 0;
+  const char *app_id;
+  gsize app_id_len;
+  int fd;
+
+  g_snprintf (path, sizeof (path), "/proc/%u/cgroup", pid);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+
+  while (len < sizeof (content))
+    {
+      ssize_t res = read (fd, content + len, sizeof (content) - len);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0)
+        break;
+      len += res;
+    }
+
+  close (fd);
+
+  /* Make sure we read the cgroup of the process that sent the
+     message, and not that of a later process with the same pid */
+  if (pidfd >= 0 && !pidfd_is_alive (pidfd))
+    return NULL;
+
+  if (!parse_cgroup_app_id (content, len, &app_id, &app_id_len))
+    return NULL;
+
+  return g_strndup (app_id, app_id_len);
+}
+
+/* For peer-to-peer connections there is no bus to ask, so we use the
+   credentials of the socket */
+static char *
+lookup_app_id_for_peer (GDBusConnection *connection)
+{
+  GCredentials *credentials;
+#ifdef SO_PEERPIDFD
+  GIOStream *stream;
+#endif
+  pid_t pid;
+  int pidfd = -1;
+  char *app_id;
+
+  credentials = g_dbus_connection_get_peer_credentials (connection);
+  if (credentials == NULL)
+    return NULL;
+
+  pid = g_credentials_get_unix_pid (credentials, NULL);
+  if (pid == -1)
+    return NULL;
+
+#ifdef SO_PEERPIDFD
+  stream = g_dbus_connection_get_stream (connection);
+  if (G_IS_SOCKET_CONNECTION (stream))
+    {
+      GSocket *socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (stream));
+      socklen_t len = sizeof (pidfd);
+
+      if (getsockopt (g_socket_get_fd (socket), SOL_SOCKET, SO_PEERPIDFD,
+                      &pidfd, &len) != 0)
+        pidfd = -1;
+    }
+#endif
+
+  app_id = lookup_app_id_for_pid (pid, pidfd);
+
+  if (pidfd >= 0)
+    close (pidfd);
+
+  return app_id;
+}
+
 static void
 got_credentials_cb (GObject *source_object,
                     GAsyncResult *res,
@@ -43,46 +250,28 @@ got_credentials_cb (GObject *source_object,
   reply = g_dbus_connection_send_message_with_reply_finish (G_DBUS_CONNECTION (source_object),
                                                             res, &error);
 
-  if (!info->exited && reply != NULL)
+  if (!info->exited && reply != NULL &&
+      g_dbus_message_get_message_type (reply) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN)
     {
       GVariant *body = g_dbus_message_get_body (reply);
+      g_autoptr(GVariant) credentials = NULL;
+      GUnixFDList *fd_list;
       guint32 pid;
-      g_autofree char *path = NULL;
-      g_autofree char *content = NULL;
+      gint32 pidfd_id;
+      int pidfd = -1;
 
-      g_variant_get (body, "(u)", &pid);
+      g_variant_get (body, "(@a{sv})", &credentials);
 
-      path = g_strdup_printf ("/proc/%u/cgroup", pid);
+      fd_list = g_dbus_message_get_unix_fd_list (reply);
+      if (fd_list != NULL &&
+          g_variant_lookup (credentials, "ProcessFD", "h", &pidfd_id))
+        pidfd = g_unix_fd_list_get (fd_list, pidfd_id, NULL);
 
-      if (g_file_get_contents (path, &content, NULL, NULL))
-        {
-          gchar **lines =  g_strsplit (content, "\n", -1);
-          int i;
-
-          for (i = 0; lines[i] != NULL; i++)
-            {
-              if (g_str_has_prefix (lines[i], "1:name=systemd:"))
-                {
-                  const char *unit = lines[i] + strlen ("1:name=systemd:");
-                  g_autofree char *scope = g_path_get_basename (unit);
-
-                  if (g_str_has_prefix (scope, "xdg-app-") &&
-                      g_str_has_suffix (scope, ".scope"))
-                    {
-                      const char *name = scope + strlen("xdg-app-");
-                      char *dash = strchr (name, '-');
-                      if (dash != NULL)
-                        {
-                          *dash = 0;
-                          info->app_id = g_strdup (name);
-                        }
-                    }
-                  else
-                    info->app_id = g_strdup ("");
-                }
-            }
-          g_strfreev (lines);
-        }
+      if (g_variant_lookup (credentials, "ProcessID", "u", &pid))
+        info->app_id = lookup_app_id_for_pid (pid, pidfd);
+
+      if (pidfd >= 0)
+        close (pidfd);
     }
 
   for (l = info->pending; l != NULL; l = l->next)
@@ -99,8 +288,10 @@ got_credentials_cb (GObject *source_object,
   g_list_free_full (info->pending, g_object_unref);
   info->pending = NULL;
 
-  if (info->app_id == NULL)
+  if (info->app_id == NULL || info->exited)
     g_hash_table_remove (app_ids, info->name);
+  else
+    app_id_info_touch (info);
 }
 
 void
@@ -116,6 +307,29 @@ xdp_invocation_lookup_app_id (GDBusMethodInvocation *invocation,
 
   task = g_task_new (invocation, cancellable, callback, user_data);
 
+  if (g_dbus_connection_get_unique_name (connection) == NULL)
+    {
+      const char *app_id;
+
+      /* The peer can't change, so look it up once per connection */
+      app_id = g_object_get_data (G_OBJECT (connection), "xdp-app-id");
+      if (app_id == NULL)
+        {
+          char *new_app_id = lookup_app_id_for_peer (connection);
+          if (new_app_id != NULL)
+            g_object_set_data_full (G_OBJECT (connection), "xdp-app-id",
+                                    new_app_id, g_free);
+          app_id = new_app_id;
+        }
+
+      if (app_id == NULL)
+        g_task_return_new_error (task, XDP_ERROR, XDP_ERROR_FAILED,
+                                 "Can't find app id");
+      else
+        g_task_return_pointer (task, g_strdup (app_id), g_free);
+      return;
+    }
+
   ensure_app_ids ();
 
   info = g_hash_table_lookup (app_ids, sender);
@@ -128,7 +342,10 @@ xdp_invocation_lookup_app_id (GDBusMethodInvocation *invocation,
     }
 
   if (info->app_id)
-    g_task_return_pointer (task, g_strdup (info->app_id), g_free);
+    {
+      app_id_info_touch (info);
+      g_task_return_pointer (task, g_strdup (info->app_id), g_free);
+    }
   else
     {
       if (info->pending == NULL)
@@ -136,7 +353,7 @@ xdp_invocation_lookup_app_id (GDBusMethodInvocation *invocation,
           g_autoptr (GDBusMessage) msg = g_dbus_message_new_method_call ("org.freedesktop.DBus",
                                                                          "/org/freedesktop/DBus",
                                                                          "org.freedesktop.DBus",
-                                                                         "GetConnectionUnixProcessID");
+                                                                         "GetConnectionCredentials");
           g_dbus_message_set_body (msg, g_variant_new ("(s)", sender));
 
           g_dbus_connection_send_message_with_reply (connection, msg,